@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../cmap_dynamic/cmap_dyn.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+enum class Increment {
+  Subscript,
+  Accumulate,
+};
+
+inline const char* IncrementName(Increment how)
+{
+  switch (how) {
+    case Increment::Subscript: return " operator[]";
+    case Increment::Accumulate: return " Accumulate";
+  }
+  return "";
+}
+
+// Every thread bumps increments counters spread over key_count present
+// keys through operator[] or Accumulate; Accumulate's pending
+// deltas are flushed before the clock stops. Returns throughput in
+// millions of increments per second.
+template <typename Map>
+double RunIncrements(Map& map, size_t thread_count, int increments, int key_count, Increment how)
+{
+  for (int key = 0; key < key_count; key++) {
+    map.FetchAdd(key, 0);
+  }
+
+  auto kernel = [&map, increments, key_count, how](int seed)
+  {
+    for (int i = 0; i < increments; i++) {
+      const int key = (i * 7 + seed) % key_count;
+      switch (how) {
+        case Increment::Subscript: map[key].ref_to_value++; break;
+        case Increment::Accumulate: map.Accumulate(key, 1); break;
+      }
+    }
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, static_cast<int>(i)));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+  map.Flush();
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(increments) * thread_count * 1e3 / elapsed;
+}
+
+template <typename Factory>
+void SweepIncrements(const string& name, Factory make_map, Increment how)
+{
+  for (size_t threads : {1, 4}) {
+    auto map = make_map();
+    const double mops = RunIncrements(map, threads, 500000, 64, how);
+    cout << setw(20) << left << name
+         << IncrementName(how)
+         << " threads=" << threads
+         << " " << fixed << setprecision(2) << mops << " Mops/s" << endl;
+  }
+}
+
+// Counters on 4 shards: operator[] serializes every increment on the
+// shard lock, while Accumulate with write combining takes each shard
+// lock once per flushed buffer.
+void BenchAccumulate()
+{
+  SweepIncrements("one2one/mutex", [] {
+    return cmap_one2one::ConcurrentMap<int, long>(4);
+  }, Increment::Subscript);
+  SweepIncrements("dynamic/node", [] {
+    return cmap_dyn::ConcurrentMap<int, long>(4, 2, false);
+  }, Increment::Subscript);
+  SweepIncrements("one2one/combining", [] {
+    cmap_one2one::ConcurrentMap<int, long> map(4);
+    map.EnableWriteCombining();
+    return map;
+  }, Increment::Accumulate);
+}
+
+}
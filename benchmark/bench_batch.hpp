@@ -0,0 +1,101 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../cmap_dynamic/cmap_dyn.hpp"
+#include "../utils/flat_map.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// Every thread applies batch_count batches of batch_size random keys,
+// either key by key through operator[] or with one MultiUpdate per batch.
+// Returns throughput in millions of updated keys per second.
+template <typename Map>
+double RunBatches(Map& map, size_t thread_count, size_t batch_count, size_t batch_size, int key_count, bool batched)
+{
+  auto kernel = [&map, batch_count, batch_size, key_count, batched](size_t seed)
+  {
+    default_random_engine rng(seed);
+    uniform_int_distribution<int> keys(0, key_count - 1);
+    vector<int> batch(batch_size);
+
+    for (size_t b = 0; b < batch_count; b++) {
+      for (auto& key : batch) {
+        key = keys(rng);
+      }
+      if (batched) {
+        map.MultiUpdate(batch, [](const int&, int& value) { value++; });
+      } else {
+        for (auto key : batch) {
+          map[key].ref_to_value++;
+        }
+      }
+    }
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(batch_count * batch_size * thread_count) * 1e3 / elapsed;
+}
+
+template <typename Factory>
+void SweepBatches(const string& name, Factory make_map)
+{
+  const size_t batch_size = 256;
+  const size_t batch_count = 2000;
+  const int key_count = 100000;
+
+  for (size_t threads : {1, 4}) {
+    for (bool batched : {false, true}) {
+      auto map = make_map();
+      const double mops = RunBatches(map, threads, batch_count, batch_size, key_count, batched);
+      cout << setw(20) << left << name
+           << (batched ? " MultiUpdate" : " per-key    ")
+           << " threads=" << threads
+           << " " << fixed << setprecision(2) << mops << " Mops/s" << endl;
+    }
+  }
+}
+
+// Batches of 256 keys on 16 shards: one lock round trip per shard group
+// instead of one per key.
+void BenchBatch()
+{
+  const size_t shards = 16;
+  using cmap_common::FlatStorage;
+
+  SweepBatches("one2one/node", [&] {
+    return cmap_one2one::ConcurrentMap<int, int>(shards);
+  });
+  SweepBatches("one2one/flat", [&] {
+    return cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage>(shards);
+  });
+  SweepBatches("one2many/node", [&] {
+    return cmap_o2m::ConcurrentMap<int, int>(shards, shards / 2, false);
+  });
+  SweepBatches("dynamic/node", [&] {
+    return cmap_dyn::ConcurrentMap<int, int>(shards, shards / 2, false);
+  });
+}
+
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../utils/flat_map.h"
+#include "../utils/visit.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+template <typename Fn>
+double MillisecondsOf(Fn fn)
+{
+  const auto start = steady_clock::now();
+  fn();
+  return duration_cast<microseconds>(steady_clock::now() - start).count() / 1e3;
+}
+
+// Exports key_count entries the four ways: inserting shard after shard
+// into an unreserved map (what BuildOrdinaryMap used to do), the reserved
+// BuildOrdinaryMap, the parallel one on 4 tasks, and ExtractOrdinaryMap.
+template <typename Factory>
+void RunExport(const string& name, Factory make_map)
+{
+  const int key_count = 1000000;
+  auto map = make_map();
+  for (int i = 0; i < key_count; i++) {
+    map[i].ref_to_value = i;
+  }
+
+  using MapType = typename decltype(map)::MapType;
+  using ShardMap = typename decltype(map)::ShardMap;
+  size_t size = 0;
+
+  const double unreserved = MillisecondsOf([&] {
+    MapType result;
+    map.ForEachShard([&](const ShardMap& mp) { result.insert(mp.begin(), mp.end()); });
+    size += result.size();
+  });
+  const double reserved = MillisecondsOf([&] { size += map.BuildOrdinaryMap().size(); });
+  const double parallel = MillisecondsOf([&] {
+    size += map.BuildOrdinaryMap(cmap_common::AsyncExecutor(4)).size();
+  });
+  const double extracted = MillisecondsOf([&] { size += map.ExtractOrdinaryMap().size(); });
+
+  if (size != 4u * key_count) {
+    cerr << name << ": exported " << size << " entries" << endl;
+  }
+  cout << setw(16) << left << name << fixed << setprecision(1)
+       << " unreserved " << unreserved << " ms"
+       << " reserved " << reserved << " ms"
+       << " parallel " << parallel << " ms"
+       << " extract " << extracted << " ms" << endl;
+}
+
+// A million int entries on 16 shards exported into an unordered_map.
+void BenchExport()
+{
+  const size_t shards = 16;
+  using cmap_common::FlatStorage;
+
+  RunExport("one2one/node", [&] {
+    return cmap_one2one::ConcurrentMap<int, int>(shards);
+  });
+  RunExport("one2one/flat", [&] {
+    return cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage>(shards);
+  });
+  RunExport("one2many/node", [&] {
+    return cmap_o2m::ConcurrentMap<int, int>(shards, shards / 2, false);
+  });
+}
+
+}
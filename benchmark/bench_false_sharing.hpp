@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../utils/shard_lock.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// The parallel-array layout the shards used to have: neighbouring
+// mutexes and counters share cache lines.
+struct PackedLocks {
+  explicit PackedLocks(size_t n) : mutexes(n), counters(n) {}
+
+  mutex& Mutex(size_t i) { return mutexes[i]; }
+  atomic<long long>& Counter(size_t i) { return counters[i]; }
+
+  vector<mutex> mutexes;
+  vector<atomic<long long>> counters;
+};
+
+// The Shard layout: lock and counter of one index on their own line.
+struct PaddedLocks {
+  struct alignas(cmap_common::kCacheLineSize) Slot {
+    mutex m;
+    atomic<long long> counter{0};
+  };
+
+  explicit PaddedLocks(size_t n) : slots(n) {}
+
+  mutex& Mutex(size_t i) { return slots[i].m; }
+  atomic<long long>& Counter(size_t i) { return slots[i].counter; }
+
+  vector<Slot> slots;
+};
+
+// Every thread locks only its own index, so any slowdown with more
+// threads comes from cache lines shared between indices.
+template <typename Locks>
+double RunDisjointLocks(size_t thread_count, size_t ops_per_thread)
+{
+  Locks locks(thread_count);
+
+  auto kernel = [&locks, ops_per_thread](size_t index)
+  {
+    for (size_t i = 0; i < ops_per_thread; i++) {
+      lock_guard<mutex> guard(locks.Mutex(index));
+      locks.Counter(index).fetch_add(1, memory_order_relaxed);
+    }
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(ops_per_thread * thread_count) * 1e3 / elapsed;
+}
+
+// Same pattern through a ConcurrentMap: thread t only writes keys that
+// hash to shard t.
+double RunDisjointShards(size_t thread_count, size_t ops_per_thread)
+{
+  cmap_one2one::ConcurrentMap<int, int> map(thread_count);
+
+  auto kernel = [&map, thread_count, ops_per_thread](size_t index)
+  {
+    for (size_t i = 0; i < ops_per_thread; i++) {
+      const int key = static_cast<int>(index + (i % 64) * thread_count);
+      map[key].ref_to_value++;
+    }
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(ops_per_thread * thread_count) * 1e3 / elapsed;
+}
+
+void BenchFalseSharing()
+{
+  const size_t ops_per_thread = 2000000;
+  const size_t cores = max(1u, thread::hardware_concurrency());
+
+  for (size_t threads : {size_t(1), size_t(2), size_t(4), cores}) {
+    cout << "threads=" << setw(3) << threads << fixed << setprecision(2)
+         << "  packed " << setw(7) << RunDisjointLocks<PackedLocks>(threads, ops_per_thread) << " Mops/s"
+         << "  padded " << setw(7) << RunDisjointLocks<PaddedLocks>(threads, ops_per_thread) << " Mops/s"
+         << "  one2one shards " << setw(7) << RunDisjointShards(threads, ops_per_thread / 4) << " Mops/s"
+         << endl;
+  }
+}
+
+}
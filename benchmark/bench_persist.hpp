@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../utils/visit.h"
+#include "bench_export.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// Saves key_count entries to a snapshot file and loads them into an
+// empty map of the same shape, on one task and on 4.
+template <typename Factory>
+void RunPersist(const string& name, Factory make_map)
+{
+  const int key_count = 1000000;
+  const string path = (filesystem::temp_directory_path() / "cmap_bench_snapshot.bin").string();
+  auto map = make_map();
+  for (int i = 0; i < key_count; i++) {
+    map[i].ref_to_value = i;
+  }
+
+  for (size_t workers : {1, 4}) {
+    const cmap_common::AsyncExecutor executor(workers);
+    const double saved = MillisecondsOf([&] { map.SaveSnapshot(path, executor); });
+    auto loaded = make_map();
+    const double load = MillisecondsOf([&] { loaded.LoadSnapshot(path, executor); });
+    if (loaded.Count() != static_cast<size_t>(key_count)) {
+      cerr << name << ": loaded " << loaded.Count() << " entries" << endl;
+    }
+    cout << setw(16) << left << name << " tasks=" << workers << fixed << setprecision(1)
+         << " save " << saved << " ms"
+         << " load " << load << " ms"
+         << " " << filesystem::file_size(path) / 1024 << " KiB" << endl;
+  }
+  filesystem::remove(path);
+}
+
+// A million int entries on 16 shards through a snapshot file.
+void BenchPersist()
+{
+  const size_t shards = 16;
+
+  RunPersist("one2one/node", [&] {
+    return cmap_one2one::ConcurrentMap<int, int>(shards);
+  });
+  RunPersist("one2many/node", [&] {
+    return cmap_o2m::ConcurrentMap<int, int>(shards, shards / 2, false);
+  });
+}
+
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../cmap_dynamic/cmap_dyn.hpp"
+#include "../utils/shard_lock.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// Read through the shard lock.
+struct LockedRead {
+  template <typename Map>
+  int operator()(const Map& map, int key) const { return map.At(key).ref_to_value; }
+};
+
+// Lock-free read validated by the shard sequence counter.
+struct OptimisticRead {
+  template <typename Map>
+  int operator()(const Map& map, int key) const { return *map.Get(key); }
+};
+
+// Copy read through Get, whose critical section a flat combining mutex
+// runs on the combiner's thread.
+struct CopyRead {
+  template <typename Map>
+  int operator()(const Map& map, int key) const { return *map.Get(key); }
+};
+
+// Write through the shard lock held by operator[].
+struct SubscriptWrite {
+  template <typename Map>
+  void operator()(Map& map, int key) const { map[key].ref_to_value++; }
+};
+
+// Write as a critical section handed to Update, which a flat combining
+// mutex runs on the combiner's thread.
+struct UpdateWrite {
+  template <typename Map>
+  void operator()(Map& map, int key) const { map.Update(key, [](int& value) { value++; }); }
+};
+
+// Every thread performs ops_per_thread operations on a prefilled map,
+// read_percent of them through read, the rest through write. Returns
+// throughput in millions of operations per second.
+template <typename Map, typename Read = LockedRead, typename Write = SubscriptWrite>
+double RunReadWriteMix(
+  Map& map,
+  size_t thread_count,
+  int read_percent,
+  size_t ops_per_thread,
+  int key_count,
+  Read read = {},
+  Write write = {}
+) {
+  for (int key = 0; key < key_count; key++) {
+    map[key].ref_to_value = key;
+  }
+
+  auto kernel = [&map, read_percent, ops_per_thread, key_count, read, write](size_t seed)
+  {
+    default_random_engine rng(seed);
+    uniform_int_distribution<int> keys(0, key_count - 1);
+    uniform_int_distribution<int> percent(0, 99);
+
+    long long sink = 0;
+    for (size_t i = 0; i < ops_per_thread; i++) {
+      const int key = keys(rng);
+      if (percent(rng) < read_percent) {
+        sink += read(map, key);
+      } else {
+        write(map, key);
+      }
+    }
+    return sink;
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<long long>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(ops_per_thread * thread_count) * 1e3 / elapsed;
+}
+
+template <typename Factory, typename Read = LockedRead, typename Write = SubscriptWrite>
+void SweepReadWrite(const string& name, Factory make_map, Read read = {}, Write write = {})
+{
+  const size_t ops_per_thread = 100000;
+  const int key_count = 10000;
+
+  for (int read_percent : {0, 50, 90, 95, 99, 100}) {
+    for (size_t threads : {1, 2, 4, 8}) {
+      auto map = make_map();
+      const double mops = RunReadWriteMix(map, threads, read_percent, ops_per_thread, key_count, read, write);
+      cout << setw(28) << left << name
+           << " reads=" << setw(3) << right << read_percent << "%"
+           << " threads=" << setw(2) << threads
+           << " " << fixed << setprecision(2) << mops << " Mops/s" << endl;
+    }
+  }
+}
+
+// Exclusive shard mutexes against the read-mostly modes of all three
+// strategies with a deliberately small shard count, so that readers hit
+// the same shard and the lock flavour decides the scaling. The
+// optimistic rows read through the seqlock path and never lock; the
+// flat combining row and its mutex baseline go through Get and Update,
+// whose critical sections the combiner can run for other threads.
+void BenchReadWrite()
+{
+  const size_t shards = 4;
+  using cmap_common::OptimisticFlatStorage;
+
+  SweepReadWrite("one2one/mutex", [&] {
+    return cmap_one2one::ConcurrentMap<int, int>(shards);
+  });
+  SweepReadWrite("one2one/shared_mutex", [&] {
+    return cmap_one2one::ReadMostlyConcurrentMap<int, int>(shards);
+  });
+  SweepReadWrite("one2one/reader_biased", [&] {
+    return cmap_one2one::ConcurrentMap<int, int, hash<int>, cmap_common::ReaderBiasedMutex>(shards);
+  });
+  SweepReadWrite("one2one/optimistic", [&] {
+    return cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, OptimisticFlatStorage>(shards);
+  }, OptimisticRead{});
+
+  SweepReadWrite("one2many/mutex", [&] {
+    return cmap_o2m::ConcurrentMap<int, int>(shards, shards / 2, false);
+  });
+  SweepReadWrite("one2many/shared_mutex", [&] {
+    return cmap_o2m::ReadMostlyConcurrentMap<int, int>(shards, shards / 2, false);
+  });
+  SweepReadWrite("one2many/optimistic", [&] {
+    return cmap_o2m::ConcurrentMap<int, int, hash<int>, mutex, OptimisticFlatStorage>(shards, shards / 2, false);
+  }, OptimisticRead{});
+  SweepReadWrite("one2many/mutex_update", [&] {
+    return cmap_o2m::ConcurrentMap<int, int>(shards, shards / 2, false);
+  }, CopyRead{}, UpdateWrite{});
+  SweepReadWrite("one2many/flat_combining", [&] {
+    return cmap_o2m::CombiningConcurrentMap<int, int>(shards, shards / 2, false);
+  }, CopyRead{}, UpdateWrite{});
+
+  SweepReadWrite("dynamic/mutex", [&] {
+    return cmap_dyn::ConcurrentMap<int, int>(shards, shards, false);
+  });
+  SweepReadWrite("dynamic/shared_mutex", [&] {
+    return cmap_dyn::ReadMostlyConcurrentMap<int, int>(shards, shards, false);
+  });
+  SweepReadWrite("dynamic/optimistic", [&] {
+    return cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, OptimisticFlatStorage>(shards, shards, false);
+  }, OptimisticRead{});
+}
+
+}
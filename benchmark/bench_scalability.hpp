@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../cmap_dynamic/cmap_dyn.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// Keys of [0, n) drawn with probability proportional to 1 / (k + 1)^theta,
+// so a few hot keys take most of the traffic. Gray et al.'s method, as in
+// YCSB: O(n) setup, then constant time per draw.
+class ZipfianKeys {
+public:
+  explicit ZipfianKeys(int n, double theta = 0.99) :
+  n_(n),
+  theta_(theta),
+  alpha_(1.0 / (1.0 - theta)),
+  zetan_(Zeta(n, theta)),
+  eta_((1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - Zeta(2, theta) / zetan_))
+  {}
+
+  int operator()(default_random_engine& rng) const
+  {
+    const double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+    const double uz = u * zetan_;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < 1.0 + pow(0.5, theta_)) {
+      return 1;
+    }
+    return min(n_ - 1, static_cast<int>(n_ * pow(eta_ * u - eta_ + 1.0, alpha_)));
+  }
+
+private:
+  static double Zeta(int n, double theta)
+  {
+    double sum = 0;
+    for (int i = 1; i <= n; i++) {
+      sum += 1.0 / pow(i, theta);
+    }
+    return sum;
+  }
+
+  int n_;
+  double theta_;
+  double alpha_;
+  double zetan_;
+  double eta_;
+};
+
+struct Workload {
+  size_t threads;
+  int key_count;
+  int read_percent;
+  bool zipfian;
+};
+
+// Latencies a thread sampled, and the sum of the values it read.
+struct ThreadSamples {
+  vector<uint64_t> latencies;
+  long long sink = 0;
+};
+
+struct WorkloadResult {
+  double mops;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+};
+
+// Every thread performs ops_per_thread reads (At) and writes (operator[])
+// on a prefilled map, and times every kSampleEvery-th of them on its own,
+// so that the clock reads barely dent the throughput.
+template <typename Map>
+WorkloadResult RunWorkload(Map& map, const Workload& w, size_t ops_per_thread)
+{
+  constexpr size_t kSampleEvery = 8;
+
+  for (int key = 0; key < w.key_count; key++) {
+    map[key].ref_to_value = key;
+  }
+  const ZipfianKeys zipfian(w.key_count);
+
+  auto kernel = [&map, &w, &zipfian, ops_per_thread](size_t seed)
+  {
+    default_random_engine rng(seed);
+    uniform_int_distribution<int> uniform(0, w.key_count - 1);
+    uniform_int_distribution<int> percent(0, 99);
+
+    ThreadSamples samples;
+    samples.latencies.reserve(ops_per_thread / kSampleEvery + 1);
+    for (size_t i = 0; i < ops_per_thread; i++) {
+      const int key = w.zipfian ? zipfian(rng) : uniform(rng);
+      const bool read = percent(rng) < w.read_percent;
+      const bool sampled = i % kSampleEvery == 0;
+
+      const auto start = sampled ? steady_clock::now() : steady_clock::time_point();
+      if (read) {
+        samples.sink += map.At(key).ref_to_value;
+      } else {
+        map[key].ref_to_value++;
+      }
+      if (sampled) {
+        samples.latencies.push_back(duration_cast<nanoseconds>(steady_clock::now() - start).count());
+      }
+    }
+    return samples;
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<ThreadSamples>> futures;
+  for (size_t i = 0; i < w.threads; i++) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+  vector<uint64_t> latencies;
+  for (auto& f : futures) {
+    const ThreadSamples part = f.get();
+    latencies.insert(latencies.end(), part.latencies.begin(), part.latencies.end());
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+  };
+  return {
+    static_cast<double>(ops_per_thread * w.threads) * 1e3 / elapsed,
+    percentile(0.50),
+    percentile(0.99),
+    percentile(0.999),
+  };
+}
+
+// One JSON object per run, elements of the array BenchScalability prints.
+class JsonRuns {
+public:
+  JsonRuns() { cout << "[" << endl; }
+  ~JsonRuns() { cout << endl << "]" << endl; }
+
+  void Add(const string& strategy, size_t shards, size_t mutexes, const Workload& w, const WorkloadResult& r)
+  {
+    cout << (first_ ? "" : ",\n")
+         << "  {\"strategy\": \"" << strategy << "\""
+         << ", \"shards\": " << shards
+         << ", \"mutexes\": " << mutexes
+         << ", \"threads\": " << w.threads
+         << ", \"keys\": " << w.key_count
+         << ", \"read_percent\": " << w.read_percent
+         << ", \"distribution\": \"" << (w.zipfian ? "zipfian" : "uniform") << "\""
+         << ", \"mops\": " << r.mops
+         << ", \"p50_ns\": " << r.p50_ns
+         << ", \"p99_ns\": " << r.p99_ns
+         << ", \"p999_ns\": " << r.p999_ns
+         << "}" << flush;
+    first_ = false;
+  }
+
+private:
+  bool first_ = true;
+};
+
+// Sweeps the three strategies over shard counts, mutex ratios (one2many
+// and dynamic), thread counts, key counts, read shares and uniform versus
+// Zipfian (theta 0.99) keys. Prints a JSON array with the throughput and
+// the p50/p99/p999 operation latency of every run, e.g. to track
+// regressions with ./bin/main scalability > scalability.json.
+void BenchScalability()
+{
+  const size_t ops_per_thread = 50000;
+  const vector<size_t> shard_counts = {8, 64};
+  const vector<size_t> mutex_divisors = {1, 4};
+
+  vector<Workload> workloads;
+  for (size_t threads : {1, 2, 4, 8, 16}) {
+    for (int key_count : {1000, 100000}) {
+      for (int read_percent : {50, 95}) {
+        for (bool zipfian : {false, true}) {
+          workloads.push_back({threads, key_count, read_percent, zipfian});
+        }
+      }
+    }
+  }
+
+  JsonRuns runs;
+  for (size_t shards : shard_counts) {
+    for (const Workload& w : workloads) {
+      cmap_one2one::ConcurrentMap<int, int> map(shards);
+      runs.Add("one2one", shards, shards, w, RunWorkload(map, w, ops_per_thread));
+    }
+    for (size_t divisor : mutex_divisors) {
+      const size_t mutexes = shards / divisor;
+      for (const Workload& w : workloads) {
+        cmap_o2m::ConcurrentMap<int, int> map(shards, mutexes, false);
+        runs.Add("one2many", shards, mutexes, w, RunWorkload(map, w, ops_per_thread));
+      }
+      for (const Workload& w : workloads) {
+        cmap_dyn::ConcurrentMap<int, int> map(shards, mutexes, false);
+        runs.Add("dynamic", shards, mutexes, w, RunWorkload(map, w, ops_per_thread));
+      }
+    }
+  }
+}
+
+}
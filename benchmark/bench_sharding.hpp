@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../utils/flat_map.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// Single-threaded FetchAdd over key_count keys, where the shard index
+// computation is a visible part of every operation. Returns nanoseconds
+// per operation.
+template <typename Map>
+double RunShardIndexing(Map& map, int operations, int key_count)
+{
+  for (int key = 0; key < key_count; key++) {
+    map.FetchAdd(key, 0);
+  }
+
+  const auto start = steady_clock::now();
+  for (int i = 0; i < operations; i++) {
+    map.FetchAdd((i * 7) % key_count, 1);
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(elapsed) / operations;
+}
+
+template <typename Map>
+void ReportShardIndexing(const string& name, Map& map)
+{
+  cout << setw(28) << left << name << " "
+       << fixed << setprecision(2) << RunShardIndexing(map, 4000000, 4096) << " ns/op" << endl;
+}
+
+// Runtime shard counts divide on every operation, FixedSharding masks.
+void BenchSharding()
+{
+  using cmap_common::FlatStorage;
+  using cmap_common::FixedSharding;
+
+  {
+    cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage> map(16);
+    ReportShardIndexing("one2one/flat runtime 16", map);
+  }
+  {
+    cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage, FixedSharding<16>> map;
+    ReportShardIndexing("one2one/flat fixed 16", map);
+  }
+  {
+    cmap_o2m::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage> map(16, 4, false);
+    ReportShardIndexing("one2many/flat runtime 16/4", map);
+  }
+  {
+    cmap_o2m::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage, FixedSharding<16, 4>> map(false);
+    ReportShardIndexing("one2many/flat fixed 16/4", map);
+  }
+}
+
+}
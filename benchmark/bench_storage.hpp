@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bench_read_write.hpp"
+#include "../utils/flat_map.h"
+#include "../utils/pmr_storage.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// Every thread inserts its own key_count distinct keys into a fresh map.
+// Returns throughput in millions of inserts per second.
+template <typename Map>
+double RunInserts(Map& map, size_t thread_count, int key_count)
+{
+  auto kernel = [&map, key_count](int seed)
+  {
+    for (int key = 0; key < key_count; key++) {
+      map[seed * key_count + key].ref_to_value = key;
+    }
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, static_cast<int>(i)));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(key_count * thread_count) * 1e3 / elapsed;
+}
+
+template <typename Factory>
+void SweepStorage(const string& name, Factory make_map)
+{
+  const int key_count = 200000;
+  const size_t ops_per_thread = 500000;
+
+  for (size_t threads : {1, 4}) {
+    auto map = make_map();
+    const double mops = RunInserts(map, threads, key_count);
+    cout << setw(24) << left << name
+         << " insert     threads=" << setw(2) << right << threads
+         << " " << fixed << setprecision(2) << mops << " Mops/s" << endl;
+  }
+
+  for (int read_percent : {50, 100}) {
+    for (size_t threads : {1, 4}) {
+      auto map = make_map();
+      const double mops = RunReadWriteMix(map, threads, read_percent, ops_per_thread, key_count);
+      cout << setw(24) << left << name
+           << " reads=" << setw(3) << right << read_percent << "%"
+           << " threads=" << setw(2) << threads
+           << " " << fixed << setprecision(2) << mops << " Mops/s" << endl;
+    }
+  }
+}
+
+// Node-based unordered_map shards against the open-addressing FlatMap
+// shards on int -> int counters, with a key set far larger than the
+// caches so that pointer chasing shows. The pool and arena rows allocate
+// the nodes from a memory resource per shard instead of malloc.
+void BenchStorage()
+{
+  const size_t shards = 16;
+  using cmap_common::ArenaStorage;
+  using cmap_common::FlatStorage;
+  using cmap_common::PoolStorage;
+
+  SweepStorage("one2one/node", [&] {
+    return cmap_one2one::ConcurrentMap<int, int>(shards);
+  });
+  SweepStorage("one2one/flat", [&] {
+    return cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage>(shards);
+  });
+  SweepStorage("one2one/pool", [&] {
+    return cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, PoolStorage>(shards);
+  });
+  SweepStorage("one2one/arena", [&] {
+    return cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, ArenaStorage>(shards);
+  });
+
+  SweepStorage("one2many/node", [&] {
+    return cmap_o2m::ConcurrentMap<int, int>(shards, shards / 2, false);
+  });
+  SweepStorage("one2many/flat", [&] {
+    return cmap_o2m::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage>(shards, shards / 2, false);
+  });
+
+  SweepStorage("dynamic/node", [&] {
+    return cmap_dyn::ConcurrentMap<int, int>(shards, shards, false);
+  });
+  SweepStorage("dynamic/flat", [&] {
+    return cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, FlatStorage>(shards, shards, false);
+  });
+}
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../cmap_dynamic/cmap_dyn.hpp"
+#include "../utils/trace.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+// Every thread performs ops writes and reads over 1000 keys. Returns
+// throughput in millions of operations per second.
+template <typename Map>
+double RunTraced(Map& map, size_t thread_count, int ops)
+{
+  auto kernel = [&map, ops](int seed)
+  {
+    long long sink = 0;
+    for (int i = 0; i < ops; i++) {
+      const int key = (i * 7 + seed) % 1000;
+      if (i % 2 == 0) {
+        map[key].ref_to_value++;
+      } else {
+        sink += map.Has(key);
+      }
+    }
+    return sink;
+  };
+
+  const auto start = steady_clock::now();
+  vector<future<long long>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, static_cast<int>(i)));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  return static_cast<double>(ops) * thread_count * 1e3 / elapsed;
+}
+
+template <typename Factory>
+void SweepTraced(const string& name, Factory make_map)
+{
+  for (size_t threads : {1, 4}) {
+    for (bool traced : {false, true}) {
+      auto map = make_map(traced);
+      const double mops = RunTraced(map, threads, 500000);
+      cout << setw(16) << left << name
+           << (traced ? " traced  " : " untraced")
+           << " threads=" << threads
+           << " " << fixed << setprecision(2) << mops << " Mops/s" << endl;
+    }
+  }
+}
+
+// Cost of log_flag with the mutex-to-map trace written to a binary file
+// by the background drainer, versus no tracing at all.
+void BenchTrace()
+{
+  const string path = (filesystem::temp_directory_path() / "cmap_bench_trace.bin").string();
+  auto& tracer = cmap_common::Tracer::Instance();
+  const uint64_t dropped = tracer.Dropped();
+  tracer.Open(path);
+
+  SweepTraced("one2many", [](bool traced) {
+    return cmap_o2m::ConcurrentMap<int, int>(64, 16, traced);
+  });
+  SweepTraced("dynamic", [](bool traced) {
+    return cmap_dyn::ConcurrentMap<int, int>(64, 16, traced);
+  });
+
+  tracer.Close();
+  cout << "records dropped on full rings: " << tracer.Dropped() - dropped << endl;
+  filesystem::remove(path);
+}
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../cmap_dynamic/cmap_dyn.hpp"
+#include "../utils/wait_strategy.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+struct WaitResult {
+  double mops;
+  double cpu_per_op_ns;
+  double p50_ns;
+  double p99_ns;
+  double p999_ns;
+};
+
+// thread_count threads increment random keys; every operation is timed
+// on its own, so waiters that sleep through a release show up in the tail.
+template <typename Map>
+WaitResult RunOversubscribed(Map& map, size_t thread_count, size_t ops_per_thread, int key_count)
+{
+  auto kernel = [&map, ops_per_thread, key_count](size_t seed)
+  {
+    default_random_engine rng(seed);
+    uniform_int_distribution<int> keys(0, key_count - 1);
+
+    vector<long long> latencies;
+    latencies.reserve(ops_per_thread);
+    for (size_t i = 0; i < ops_per_thread; i++) {
+      const int key = keys(rng);
+      const auto start = steady_clock::now();
+      map[key].ref_to_value++;
+      latencies.push_back(duration_cast<nanoseconds>(steady_clock::now() - start).count());
+    }
+    return latencies;
+  };
+
+  const clock_t cpu_start = clock();
+  const auto start = steady_clock::now();
+  vector<future<vector<long long>>> futures;
+  for (size_t i = 0; i < thread_count; i++) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+  vector<long long> latencies;
+  for (auto& f : futures) {
+    const auto part = f.get();
+    latencies.insert(latencies.end(), part.begin(), part.end());
+  }
+  const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  const double cpu_ns = static_cast<double>(clock() - cpu_start) * 1e9 / CLOCKS_PER_SEC;
+
+  sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    return static_cast<double>(latencies[static_cast<size_t>(p * (latencies.size() - 1))]);
+  };
+
+  const double ops = static_cast<double>(ops_per_thread * thread_count);
+  return {ops * 1e3 / elapsed, cpu_ns / ops, percentile(0.5), percentile(0.99), percentile(0.999)};
+}
+
+template <typename Wait>
+void SweepWait(const string& name)
+{
+  const size_t cores = max(1u, thread::hardware_concurrency());
+  const size_t ops_per_thread = 50000;
+
+  for (size_t oversubscription : {1, 4, 16}) {
+    const size_t threads = cores * oversubscription;
+    cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::NodeStorage, Wait> map(4, 2, false);
+    const auto r = RunOversubscribed(map, threads, ops_per_thread, 1000);
+    cout << setw(16) << left << name
+         << " threads=" << setw(3) << right << threads
+         << fixed << setprecision(2)
+         << " " << setw(6) << r.mops << " Mops/s"
+         << " cpu/op=" << setw(8) << r.cpu_per_op_ns << "ns"
+         << setprecision(0)
+         << " p50=" << r.p50_ns << "ns"
+         << " p99=" << r.p99_ns << "ns"
+         << " p999=" << r.p999_ns << "ns" << endl;
+  }
+}
+
+// cmap_dyn flag waiting with more threads than cores: pure spinning
+// against spin-then-park. Parking should cut CPU time per operation and
+// the tail, since spinners no longer steal the lock holders' cores.
+void BenchWait()
+{
+  SweepWait<cmap_common::BusySpin>("dynamic/spin");
+  SweepWait<cmap_common::SpinThenPark>("dynamic/park");
+}
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace bench
+{
+
+inline const char* DurabilityName(cmap_common::WalDurability durability)
+{
+  switch (durability) {
+    case cmap_common::WalDurability::Async: return "async  ";
+    case cmap_common::WalDurability::Written: return "written";
+    case cmap_common::WalDurability::Synced: return "synced ";
+  }
+  return "";
+}
+
+// Every thread writes writes values through operator[] to a map with a
+// write-ahead log. Prints thousands of writes per second and the writes
+// that shared one group commit on average.
+void RunWal(cmap_common::WalDurability durability, size_t thread_count, int writes)
+{
+  const string path = (filesystem::temp_directory_path() / "cmap_bench_wal.log").string();
+  filesystem::remove(path);
+  double kops = 0;
+  double per_commit = 0;
+  {
+    cmap_one2one::ConcurrentMap<int, long> map(16);
+    map.EnableWal(path, {durability});
+
+    auto kernel = [&map, writes](int seed) {
+      for (int i = 0; i < writes; i++) {
+        map[(i * 7 + seed) % 1024].ref_to_value = i;
+      }
+    };
+
+    const auto start = steady_clock::now();
+    vector<future<void>> futures;
+    for (size_t i = 0; i < thread_count; i++) {
+      futures.push_back(async(launch::async, kernel, static_cast<int>(i)));
+    }
+    for (auto& f : futures) {
+      f.get();
+    }
+    map.SyncWal();
+    const auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+    kops = static_cast<double>(writes) * thread_count * 1e6 / elapsed;
+    per_commit = static_cast<double>(writes) * thread_count / max<uint64_t>(map.WalCommits(), 1);
+  }
+  filesystem::remove(path);
+
+  cout << "one2one/wal " << DurabilityName(durability)
+       << " threads=" << thread_count << fixed << setprecision(1)
+       << " " << kops << " Kops/s"
+       << " " << per_commit << " writes/commit" << endl;
+}
+
+// The durability levels of the write-ahead log: with more writers waiting
+// for their records, more of them share every sync.
+void BenchWal()
+{
+  for (auto durability : {cmap_common::WalDurability::Async,
+                          cmap_common::WalDurability::Written,
+                          cmap_common::WalDurability::Synced}) {
+    for (size_t threads : {1, 4, 16}) {
+      RunWal(durability, threads, 2000);
+    }
+  }
+}
+
+}
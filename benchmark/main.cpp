@@ -0,0 +1,58 @@
+#include "bench_accumulate.hpp"
+#include "bench_batch.hpp"
+#include "bench_export.hpp"
+#include "bench_false_sharing.hpp"
+#include "bench_persist.hpp"
+#include "bench_read_write.hpp"
+#include "bench_scalability.hpp"
+#include "bench_sharding.hpp"
+#include "bench_storage.hpp"
+#include "bench_trace.hpp"
+#include "bench_wait.hpp"
+#include "bench_wal.hpp"
+
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+
+using namespace std;
+
+// ./bin/main [benchmark...], runs every benchmark when none is named.
+// The headers go to stderr, so that stdout of a single benchmark is its
+// report alone (JSON for scalability).
+int main(int argc, char** argv) {
+  const map<string, function<void()>> benchmarks = {
+    {"accumulate", bench::BenchAccumulate},
+    {"batch", bench::BenchBatch},
+    {"export", bench::BenchExport},
+    {"false_sharing", bench::BenchFalseSharing},
+    {"persist", bench::BenchPersist},
+    {"read_write", bench::BenchReadWrite},
+    {"scalability", bench::BenchScalability},
+    {"sharding", bench::BenchSharding},
+    {"storage", bench::BenchStorage},
+    {"trace", bench::BenchTrace},
+    {"wait", bench::BenchWait},
+    {"wal", bench::BenchWal},
+  };
+
+  if (argc == 1) {
+    for (const auto& [name, run] : benchmarks) {
+      cerr << "== " << name << endl;
+      run();
+    }
+    return 0;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    const auto it = benchmarks.find(argv[i]);
+    if (it == benchmarks.end()) {
+      cerr << "unknown benchmark " << argv[i] << endl;
+      return 1;
+    }
+    cerr << "== " << it->first << endl;
+    it->second();
+  }
+  return 0;
+}
@@ -11,127 +11,187 @@
 #include <algorithm>
 #include <random>
 #include <atomic>
+#include <shared_mutex>
+#include <optional>
+
+#include "../utils/shard_lock.h"
+#include "../utils/flat_map.h"
+#include "../utils/hot_keys.h"
+#include "../utils/lock_stats.h"
+#include "../utils/persist.h"
+#include "../utils/pmr_storage.h"
+#include "../utils/batch.h"
+#include "../utils/cache.h"
+#include "../utils/sharding.h"
+#include "../utils/snapshot.h"
+#include "../utils/trace.h"
+#include "../utils/visit.h"
+#include "../utils/write_combining.h"
+#include "../utils/wait_strategy.h"
 using namespace std;
 
 namespace cmap_dyn
 {
 
-void logMutexMapId(size_t mapId, size_t mutexId)
+// Traces which mutex handles which map, see cmap_common::Tracer.
+inline void logMutexMapId(cmap_common::TraceOp op, size_t mapId, size_t mutexId)
 {
-  stringstream ss;
-  ss << "Hello, I am mutex " << mutexId << " and I am handling map" << mapId << "\n";
-  cout << ss.str();
+  cmap_common::Tracer::Instance().Record(op, mapId, mutexId);
 }
 
-template <typename K, typename V, typename Hash = std::hash<K>>
+template <
+  typename K,
+  typename V,
+  typename Hash = std::hash<K>,
+  typename Mutex = mutex,
+  typename Storage = cmap_common::NodeStorage,
+  typename Wait = cmap_common::SpinThenPark,
+  typename Sharding = cmap_common::RuntimeSharding>
 class ConcurrentMap {
 public:
   using MapType = unordered_map<K, V, Hash>;
+  using ShardMap = typename Storage::template Map<K, V, Hash>;
+  using SnapshotView = cmap_common::MapSnapshot<K, V, Hash, ShardMap, Sharding>;
+  using WriteGuard = cmap_common::WriteGuard<Mutex>;
+  using ReadGuard = cmap_common::ReadGuard<Mutex>;
+  using ParkingLot = cmap_common::ParkingLot;
 
 private:
+  // claimed map and mutex flags, handed back on destruction;
+  // declared before the guard so they are released after the unlock and
+  // also when the lookup in the constructor throws
+  struct ExclusiveFlag {
+    ~ExclusiveFlag() { ReleaseExclusive(flag, lot); }
+    atomic<int>& flag;
+    const ParkingLot& lot;
+  };
+
+  struct SharedFlag {
+    ~SharedFlag() { ReleaseShared(flag, lot); }
+    atomic<int>& flag;
+    const ParkingLot& lot;
+  };
+
+  struct PooledFlag {
+    ~PooledFlag() { owner.ReleaseMutex(index_of_mutex); }
+    const ConcurrentMap& owner;
+    size_t index_of_mutex;
+  };
+
+  // counted by Stats() along with the pool mutexes
+  static constexpr bool kStats = cmap_common::is_instrumented<Mutex>::value;
+
+  // A map with its flag and sequence counter, on cache lines of its own.
+  struct alignas(cmap_common::kCacheLineSize) Shard {
+    mutable atomic<int> flag{0};
+    mutable conditional_t<kStats, cmap_common::LockStats, cmap_common::NoLockStats> flag_stats;
+    cmap_common::SeqLock seqlock;
+    ShardMap map;
+  };
+
+  // A pool mutex with the flag that claims it, padded apart from the
+  // neighbouring pool entries.
+  struct alignas(cmap_common::kCacheLineSize) PooledMutex {
+    Mutex mutex;
+    atomic<int> flag{0};
+  };
+
   struct WriteAccess {
     WriteAccess(
       const K& key,
-      mutex& m,
-      MapType& mp,
+      Mutex& m,
+      ShardMap& mp,
       atomic<int>& map_guard,
-      atomic<int>& mutex_guard) :
+      const ConcurrentMap& owner,
+      size_t index_of_mutex,
+      const ParkingLot& lot,
+      cmap_common::SeqLock* seq) :
+    map_guard_{map_guard, lot},
+    mutex_guard_{owner, index_of_mutex},
     guard(m),
-    ref_to_value(mp[key]),
-    map_guard_(map_guard),
-    mutex_guard_(mutex_guard)
+    window(seq),
+    ref_to_value(mp[key])
     {}
 
-    ~WriteAccess() {
-      //mutex_guard_.store(0);
-      //map_guard_.store(0);
-    }
+    ExclusiveFlag map_guard_;
+    PooledFlag mutex_guard_;
 
-    lock_guard<mutex> guard;
+    WriteGuard guard;
+    cmap_common::SeqLock::WriteWindow window;
     V& ref_to_value;
-
-    atomic<int>& map_guard_;
-    atomic<int>& mutex_guard_;
   };
 
   struct ReadAccess {
     ReadAccess(
       const K& key,
-      mutex& m,
-      const MapType& mp,
+      Mutex& m,
+      const ShardMap& mp,
       atomic<int>& map_guard,
-      atomic<int>& mutex_guard) :
+      const ConcurrentMap& owner,
+      size_t index_of_mutex,
+      const ParkingLot& lot) :
+    map_guard_{map_guard, lot},
+    mutex_guard_{owner, index_of_mutex},
     guard(m),
-    ref_to_value(mp.at(key)),
-    map_guard_(map_guard),
-    mutex_guard_(mutex_guard)
+    ref_to_value(mp.at(key))
     {}
 
-    ~ReadAccess() {
-      mutex_guard_.store(0);
-      map_guard_.store(0);
-    }
+    SharedFlag map_guard_;
+    PooledFlag mutex_guard_;
 
-    lock_guard<mutex> guard;
+    ReadGuard guard;
     const V& ref_to_value;
-
-    atomic<int>& map_guard_;
-    atomic<int>& mutex_guard_;
   };
 
   struct ValuePresence {
     ValuePresence(
       const K& key,
-      mutex& m,
-      const MapType& mp,
+      Mutex& m,
+      const ShardMap& mp,
       atomic<int>& map_guard,
-      atomic<int>& mutex_guard) :
+      const ConcurrentMap& owner,
+      size_t index_of_mutex,
+      const ParkingLot& lot) :
+    map_guard_{map_guard, lot},
+    mutex_guard_{owner, index_of_mutex},
     guard(m),
-    presence(mp.count(key)),
-    map_guard_(map_guard),
-    mutex_guard_(mutex_guard)
+    presence(mp.count(key))
     {}
 
-    ~ValuePresence() {
-      mutex_guard_.store(0);
-      map_guard_.store(0);
-    }
+    SharedFlag map_guard_;
+    PooledFlag mutex_guard_;
 
-    lock_guard<mutex> guard;
+    ReadGuard guard;
     const bool presence;
-
-    atomic<int>& map_guard_;
-    atomic<int>& mutex_guard_;
   };
 
 public:
+  // bucket_count maps sharing mutex_number mutexes (RuntimeSharding)
+  template <typename S = Sharding, enable_if_t<!S::kFixed, int> = 0>
   explicit ConcurrentMap(
     size_t bucket_count,
     size_t mutex_number,
     bool log_flag = true
   ) :
-  buckets_(bucket_count),
-  map_collection_(bucket_count),
+  sharding_(bucket_count, mutex_number),
+  shards_(bucket_count),
   mutexes_(mutex_number),
-  mutex_table_(mutex_number),
-  map_table_(bucket_count),
   log_(log_flag)
-  {
-    for (size_t i = 0; i < map_table_.size(); i++)
-    {
-      map_table_[i].store(0);
-    }
-
-    for (size_t i = 0; i < mutex_table_.size(); i++)
-    {
-      mutex_table_[i].store(0);
-    }
-  }
+  {}
+
+  // Sharding::Shards() maps sharing Sharding::Mutexes() mutexes
+  // (FixedSharding)
+  template <typename S = Sharding, enable_if_t<S::kFixed, int> = 0>
+  explicit ConcurrentMap(bool log_flag = true) :
+  shards_(Sharding::Shards()),
+  mutexes_(Sharding::Mutexes()),
+  log_(log_flag)
+  {}
 
   WriteAccess operator[](const K& key)
   {
     // compute index of correct hash map
-    size_t index_of_map = hasher_(key) % buckets_;
+    size_t index_of_map = IndexOf(key);
 
     // busy-waiting while the required map will be free
     acquireMapLock(index_of_map);
@@ -141,126 +201,694 @@ public:
 
     // LOGGER
     if (log_) {
-      logMutexMapId(index_of_map, index_of_mutex);
+      logMutexMapId(cmap_common::TraceOp::Write, index_of_map, index_of_mutex);
     }
 
     return WriteAccess(
       key,
-      mutexes_[index_of_mutex],
-      map_collection_[index_of_map],
-      map_table_[index_of_map],
-      mutex_table_[index_of_mutex]
+      mutexes_[index_of_mutex].mutex,
+      shards_[index_of_map].map,
+      shards_[index_of_map].flag,
+      *this,
+      index_of_mutex,
+      parking_lot_,
+      SeqLockOf(shards_[index_of_map])
     );
   }
 
   ReadAccess At(const K& key) const
   {
     // compute index of correct hash map
-    size_t index_of_map = hasher_(key) % buckets_;
+    size_t index_of_map = IndexOf(key);
 
-    // busy-waiting while the required map will be free
-    acquireMapLock(index_of_map);
+    // busy-waiting while the required map has a writer
+    acquireSharedMapLock(index_of_map);
 
     // locking of first free mutex in interleaving fashion
     const size_t index_of_mutex = acquireFirstFreeMutex();
 
     // LOGGER
     if (log_) {
-      logMutexMapId(index_of_map, index_of_mutex);
+      logMutexMapId(cmap_common::TraceOp::Read, index_of_map, index_of_mutex);
     }
 
     return ReadAccess(
       key,
-      mutexes_[index_of_mutex],
-      map_collection_[index_of_map],
-      map_table_[index_of_map],
-      mutex_table_[index_of_mutex]
+      mutexes_[index_of_mutex].mutex,
+      shards_[index_of_map].map,
+      shards_[index_of_map].flag,
+      *this,
+      index_of_mutex,
+      parking_lot_
     );
   }
 
   bool Has(const K& key) const
   {
     // compute index of correct hash map
-    size_t index_of_map = hasher_(key) % buckets_;
+    size_t index_of_map = IndexOf(key);
 
-    // busy-waiting while the required map will be free
-    acquireMapLock(index_of_map);
+    // busy-waiting while the required map has a writer
+    acquireSharedMapLock(index_of_map);
 
     // locking of first free mutex in interleaving fashion
     const size_t index_of_mutex = acquireFirstFreeMutex();
 
     // LOGGER
     if (log_) {
-      logMutexMapId(index_of_map, index_of_mutex);
+      logMutexMapId(cmap_common::TraceOp::Has, index_of_map, index_of_mutex);
     }
 
     return ValuePresence(
       key,
-      mutexes_[index_of_mutex],
-      map_collection_[index_of_map],
-      map_table_[index_of_map],
-      mutex_table_[index_of_mutex]
+      mutexes_[index_of_mutex].mutex,
+      shards_[index_of_map].map,
+      shards_[index_of_map].flag,
+      *this,
+      index_of_mutex,
+      parking_lot_
     ).presence;
   }
 
-  MapType BuildOrdinaryMap() const
+  // Copy of the value under key. With OptimisticFlatStorage it is read
+  // without touching the map and mutex flags and validated by the map's
+  // sequence counter; with hot keys enabled, keys the calling thread reads
+  // most are served from its replicas (see EnableHotKeys); otherwise it is
+  // read under a claimed mutex. With write combining, the deltas the
+  // calling thread has pending for key are added.
+  optional<V> Get(const K& key) const
   {
-    MapType result;
-    for(size_t i = 0; i < buckets_; i++){
+    if constexpr (cmap_common::is_combinable<V>::value) {
+      if (combiner_)
+        return combiner_->Read(key, [&] { return FlushedGet(key); });
+    }
+    return FlushedGet(key);
+  }
+
+  // Lets Get serve the keys each thread reads most from thread-local
+  // copies, validated against the version of their map (see
+  // cmap_common::HotKeyReplicas); call it before the map is shared. Every
+  // write then bumps the version of its map.
+  void EnableHotKeys(cmap_common::HotKeys options = {})
+  {
+    static_assert(!Storage::kOptimisticReads, "ConcurrentMap::EnableHotKeys: Get takes no lock anyway");
+    hot_keys_ = options;
+    map_id_ = cmap_common::NextMapId();
+  }
 
-      // busy-waiting while the required map will be free
-      acquireMapLock(i);
+  // Makes Accumulate add through per-thread buffers that are applied to
+  // the maps in batches (see cmap_common::WriteCombiner); call it before
+  // the map is shared. Get then adds the calling thread's pending deltas.
+  void EnableWriteCombining(cmap_common::WriteCombining options = {})
+  {
+    static_assert(cmap_common::is_combinable<V>::value, "ConcurrentMap::EnableWriteCombining needs V += V");
+    combiner_ = make_unique<Combiner>(options);
+  }
 
-      // locking of first free mutex in interleaving fashion
-      const size_t index_of_mutex = acquireFirstFreeMutex();
+  // Adds delta to the value under key, inserting V() first when missing,
+  // like FetchAdd. With write combining the addition waits in the calling
+  // thread's buffer until it is flushed; otherwise it is a FetchAdd.
+  void Accumulate(const K& key, V delta)
+  {
+    if (combiner_)
+      combiner_->Add(key, delta, ApplyDeltas());
+    else
+      FetchAdd(key, delta);
+  }
 
-      {
-        lock_guard<mutex> lock_guard(mutexes_[index_of_mutex]);
-        result.insert(map_collection_[i].begin(), map_collection_[i].end());
+  // Applies the deltas every thread has pending (write combining only).
+  void Flush()
+  {
+    if (combiner_)
+      combiner_->Flush(ApplyDeltas());
+  }
+
+  // Calls fn(value) with the map claimed exclusively if key is present;
+  // missing keys are not inserted. Returns whether fn was called.
+  template <typename Fn>
+  bool Update(const K& key, Fn fn)
+  {
+    return WithMapExclusive(IndexOf(key), [&](ShardMap& mp) {
+      const auto it = mp.find(key);
+      if (it == mp.end())
+        return false;
+      fn(it->second);
+      return true;
+    });
+  }
+
+  // Removes key with the map claimed exclusively (not with FlatStorage).
+  // Returns whether it was present.
+  bool Erase(const K& key)
+  {
+    return WithMapExclusive(IndexOf(key), [&](ShardMap& mp) {
+      return mp.erase(key) != 0;
+    });
+  }
+
+  // Inserts init if key is missing, otherwise calls fn(value).
+  // Returns whether init was inserted.
+  template <typename Fn>
+  bool UpsertWith(const K& key, const V& init, Fn fn)
+  {
+    return WithMapExclusive(IndexOf(key), [&](ShardMap& mp) {
+      const auto it = mp.find(key);
+      if (it == mp.end()) {
+        mp[key] = init;
+        return true;
       }
+      fn(it->second);
+      return false;
+    });
+  }
+
+  // Adds delta to the value under key, inserting V() first when missing,
+  // and returns the previous value, all under one exclusive claim of the
+  // map. With SnapshotStorage a value a snapshot shares is copied first.
+  V FetchAdd(const K& key, V delta)
+  {
+    static_assert(cmap_common::is_combinable<V>::value, "ConcurrentMap::FetchAdd needs V += V");
+
+    return WithMapExclusive(IndexOf(key), [&](ShardMap& mp) {
+      V& value = mp[key];
+      const V previous = value;
+      value += delta;
+      return previous;
+    });
+  }
+
+  // Batched operations: the keys are grouped by map and every group is
+  // served under a single claim of the map flag and of a pool mutex.
+
+  // Values of keys in their order, nullopt for the missing ones.
+  vector<optional<V>> MultiGet(const vector<K>& keys) const
+  {
+    vector<optional<V>> result(keys.size());
+    ForEachGroup(keys.size(), [&](size_t i) -> const K& { return keys[i]; },
+      [&](size_t index_of_map, const size_t* first, const size_t* last) {
+        const ShardMap& mp = shards_[index_of_map].map;
+
+        acquireSharedMapLock(index_of_map);
+        SharedFlag map_flag{shards_[index_of_map].flag, parking_lot_};
+        const size_t index_of_mutex = acquireFirstFreeMutex();
+        PooledFlag mutex_flag{*this, index_of_mutex};
+
+        ReadGuard guard(mutexes_[index_of_mutex].mutex);
+        cmap_common::ForEachInGroup(mp, first, last,
+          [&](size_t i) -> const K& { return keys[i]; },
+          [&](size_t i) {
+            const auto it = mp.find(keys[i]);
+            if (it != mp.end())
+              result[i] = it->second;
+          });
+      });
+    return result;
+  }
+
+  // Calls fn(key, value) for every key, inserting missing keys with a
+  // default value like operator[]. A key given twice is visited twice.
+  template <typename Fn>
+  void MultiUpdate(const vector<K>& keys, Fn fn)
+  {
+    ForEachGroup(keys.size(), [&](size_t i) -> const K& { return keys[i]; },
+      [&](size_t index_of_map, const size_t* first, const size_t* last) {
+        UpdateGroup(index_of_map, first, last,
+          [&](size_t i) -> const K& { return keys[i]; },
+          [&](ShardMap& mp, size_t i) { fn(keys[i], mp[keys[i]]); });
+      });
+  }
+
+  // Inserts or overwrites every entry; later entries win on equal keys.
+  void InsertBatch(const vector<pair<K, V>>& entries)
+  {
+    ForEachGroup(entries.size(), [&](size_t i) -> const K& { return entries[i].first; },
+      [&](size_t index_of_map, const size_t* first, const size_t* last) {
+        UpdateGroup(index_of_map, first, last,
+          [&](size_t i) -> const K& { return entries[i].first; },
+          [&](ShardMap& mp, size_t i) { mp[entries[i].first] = entries[i].second; });
+      });
+  }
+
+  // Visitors: the maps are walked in place, one at a time with the map
+  // flag shared and a pool mutex held, so fn must not call back into the
+  // map.
 
-      mutex_table_[index_of_mutex].store(0);
-      map_table_[i].store(0);
+  // Calls fn(map) for every map.
+  template <typename Fn>
+  void ForEachShard(Fn fn) const
+  {
+    for(size_t i = 0; i < sharding_.Shards(); i++){
+      VisitShard(i, fn);
     }
+  }
+
+  // Calls fn(key, value) for every entry.
+  template <typename Fn>
+  void ForEach(Fn fn) const
+  {
+    ForEachShard([&](const ShardMap& mp) {
+      for (const auto& [key, value] : mp)
+        fn(key, value);
+    });
+  }
+
+  // ForEach with the maps spread over the tasks of executor (see
+  // cmap_common::AsyncExecutor); fn is called concurrently for entries of
+  // different maps.
+  template <typename Executor, typename Fn>
+  void ParallelForEach(const Executor& executor, Fn fn) const
+  {
+    cmap_common::ParallelForIndexes(executor, sharding_.Shards(), [&](size_t i) {
+      VisitShard(i, [&](const ShardMap& mp) {
+        for (const auto& [key, value] : mp)
+          fn(key, value);
+      });
+    });
+  }
+
+  // Folds fn(acc, key, value) over every entry.
+  template <typename T, typename Fn>
+  T Reduce(T init, Fn fn) const
+  {
+    ForEach([&](const K& key, const V& value) { init = fn(move(init), key, value); });
+    return init;
+  }
+
+  // Number of entries, summed map by map.
+  size_t Count() const
+  {
+    size_t count = 0;
+    ForEachShard([&](const ShardMap& mp) { count += mp.size(); });
+    return count;
+  }
+
+  // Number of entries for which pred(key, value) holds.
+  template <typename Pred>
+  size_t Count(Pred pred) const
+  {
+    size_t count = 0;
+    ForEach([&](const K& key, const V& value) { count += pred(key, value) ? 1 : 0; });
+    return count;
+  }
+
+  // Export into an ordinary map, reserved once for every entry instead of
+  // growing insert by insert.
+
+  // Copy of every entry.
+  MapType BuildOrdinaryMap() const
+  {
+    MapType result;
+    result.reserve(Count());
+    ForEachShard([&](const ShardMap& mp) { result.insert(mp.begin(), mp.end()); });
     return result;
   }
 
+  // BuildOrdinaryMap with the maps copied in parallel by the tasks of
+  // executor, each into a staging map of its own, which the calling thread
+  // then splices into the result without copying again.
+  template <typename Executor>
+  MapType BuildOrdinaryMap(const Executor& executor) const
+  {
+    vector<MapType> staged(sharding_.Shards());
+    cmap_common::ParallelForIndexes(executor, staged.size(), [&](size_t i) {
+      VisitShard(i, [&](const ShardMap& mp) {
+        staged[i].reserve(mp.size());
+        staged[i].insert(mp.begin(), mp.end());
+      });
+    });
+    return cmap_common::MergeShards<MapType>(staged);
+  }
+
+  // Empties the map and returns its shard maps, moved out without
+  // copying an entry. Writers racing with it land either in a returned
+  // map or in the emptied one. Not offered with OptimisticFlatStorage,
+  // whose lock-free readers may still be probing the maps moved out.
+  vector<ShardMap> ExtractShards()
+  {
+    static_assert(!Storage::kOptimisticReads,
+                  "ConcurrentMap::ExtractShards: lock-free readers may still probe the shards");
+    vector<ShardMap> shards;
+    shards.reserve(sharding_.Shards());
+    for(size_t i = 0; i < sharding_.Shards(); i++){
+      WithMapExclusive(i, [&](ShardMap& mp) { shards.push_back(exchange(mp, ShardMap())); });
+    }
+    return shards;
+  }
+
+  // Empties the map into an ordinary one. With NodeStorage the nodes are
+  // spliced over, so no entry is copied.
+  MapType ExtractOrdinaryMap()
+  {
+    vector<ShardMap> shards = ExtractShards();
+    return cmap_common::MergeShards<MapType>(shards);
+  }
+
+  // Hits, misses and evictions summed over the maps (BoundedStorage only).
+  cmap_common::CacheCounters CacheStats() const
+  {
+    static_assert(cmap_common::is_bounded<Storage>::value,
+                  "ConcurrentMap::CacheStats needs BoundedStorage");
+
+    cmap_common::CacheCounters counters;
+    ForEachShard([&](const ShardMap& mp) { counters += mp.Counters(); });
+    return counters;
+  }
+
+  // Entry count and map flag counters of every map, and lock counters of
+  // every pool mutex (InstrumentedMutex only). A pool mutex is only taken
+  // once its flag is claimed, so waits show on the map flags. The
+  // counters are read on the fly; the entry counts are taken like
+  // ForEachShard does, so those acquisitions show in the next call.
+  cmap_common::MapStats Stats() const
+  {
+    static_assert(kStats, "ConcurrentMap::Stats needs an InstrumentedMutex");
+
+    cmap_common::MapStats stats;
+    for (const auto& m : mutexes_)
+      stats.mutexes.push_back(m.mutex.Stats());
+    stats.shards.resize(sharding_.Shards());
+    for(size_t i = 0; i < sharding_.Shards(); i++){
+      stats.shards[i].lock = shards_[i].flag_stats.Read();
+    }
+    ForEachShard([&, i = size_t(0)](const ShardMap& mp) mutable {
+      stats.shards[i++].entries = mp.size();
+    });
+    return stats;
+  }
+
+  // Writes every entry to path in the snapshot file format (see
+  // cmap_common::MappedSnapshot), one section per map. The maps are
+  // encoded in parallel by the tasks of executor, each under its lock,
+  // and written in parallel; the file is synced under a temporary name
+  // and then renamed over path, so a crash while saving leaves the
+  // previous snapshot in place. Throws runtime_error on I/O errors.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void SaveSnapshot(const string& path, const Executor& executor = Executor()) const
+  {
+    vector<cmap_common::EncodedSection> sections(sharding_.Shards());
+    cmap_common::ParallelForIndexes(executor, sections.size(), [&](size_t i) {
+      VisitShard(i, [&](const ShardMap& mp) { cmap_common::EncodeEntries<K, V>(sections[i], mp); });
+    });
+    cmap_common::WriteSnapshotFile<K, V>(path, sections, executor);
+  }
+
+  // Inserts every entry SaveSnapshot wrote to path, overwriting equal
+  // keys. The file is mapped and its sections are decoded straight from
+  // the mapping in parallel by the tasks of executor, each inserted as one
+  // InsertBatch; with the map count it was saved with, every section
+  // fills exactly one map. Throws runtime_error when path holds no
+  // snapshot of K and V.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void LoadSnapshot(const string& path, const Executor& executor = Executor())
+  {
+    const cmap_common::MappedSnapshot snapshot(path);
+    snapshot.Expect<K, V>();
+    cmap_common::ParallelForIndexes(executor, snapshot.Sections(), [&](size_t i) {
+      InsertBatch(snapshot.Decode<K, V>(i));
+    });
+  }
+
+  // Point-in-time view of every entry (SnapshotStorage only), taken in
+  // O(maps): every map flag is held shared at once, but only while the
+  // current map versions are shared. Writers afterwards copy a map they
+  // touch while the snapshot still holds it.
+  SnapshotView Snapshot() const
+  {
+    static_assert(Storage::kSnapshots, "ConcurrentMap::Snapshot needs SnapshotStorage");
+
+    vector<shared_ptr<const typename SnapshotView::Map>> versions;
+    versions.reserve(sharding_.Shards());
+    for(size_t i = 0; i < sharding_.Shards(); i++){
+      acquireSharedMapLock(i);
+    }
+    auto release_all = [&] {
+      for (const Shard& shard : shards_)
+        ReleaseShared(shard.flag, parking_lot_);
+    };
+    try {
+      for (const Shard& shard : shards_)
+        versions.push_back(shard.map.Share());
+    } catch (...) {
+      release_all();
+      throw;
+    }
+    release_all();
+    return SnapshotView(sharding_, hasher_, move(versions));
+  }
+
+
 private:
   Hash hasher_;
 
-  size_t buckets_;
-  vector<MapType> map_collection_;
-
-  mutable vector<mutex> mutexes_;
-  mutable vector<atomic<int>> mutex_table_;
-  mutable vector<atomic<int>> map_table_;
+  Sharding sharding_;
+  vector<Shard> shards_;
+  mutable vector<PooledMutex> mutexes_;
+
+  // threads parked on map flags and on pool_releases_
+  ParkingLot parking_lot_;
+
+  // Bumped by every pool mutex release, so a waiter that found the whole
+  // pool taken parks until any of the mutexes comes free.
+  struct PoolReleases {
+    PoolReleases() = default;
+    // a map is only moved before it is shared, nobody can be parked
+    PoolReleases(PoolReleases&&) noexcept {}
+    PoolReleases& operator=(PoolReleases&&) noexcept { return *this; }
+    mutable atomic<int> count{0};
+  };
+  PoolReleases pool_releases_;
 
   bool log_;
 
+  // disabled until EnableHotKeys()
+  cmap_common::HotKeys hot_keys_{0};
+  uint64_t map_id_ = 0;
+
+  using Combiner = cmap_common::WriteCombiner<K, V, Hash>;
+  // null until EnableWriteCombining()
+  unique_ptr<Combiner> combiner_;
+
+  using Replicas = cmap_common::HotKeyReplicas<K, V, Hash>;
+
 private:
+  // Get without the deltas pending in write combining buffers.
+  optional<V> FlushedGet(const K& key) const
+  {
+    const size_t hash = hasher_(key);
+    size_t index_of_map = sharding_.ShardOf(hash);
+    const Shard& shard = shards_[index_of_map];
+    const ShardMap& mp = shard.map;
+    auto locked_get = [&] {
+      acquireSharedMapLock(index_of_map);
+      const size_t index_of_mutex = acquireFirstFreeMutex();
+
+      typename Replicas::LockedValue result{nullopt, &shard.seqlock, shard.seqlock.Version()};
+      {
+        ReadGuard guard(mutexes_[index_of_mutex].mutex);
+        const auto it = mp.find(key);
+        if (it != mp.end()) {
+          result.value = it->second;
+        }
+      }
+
+      ReleaseMutex(index_of_mutex);
+      ReleaseShared(shard.flag, parking_lot_);
+      return result;
+    };
+
+    if constexpr (Storage::kOptimisticReads) {
+      return shard.seqlock.ReadOptimistic(
+        [&] { return mp.OptimisticFind(key); },
+        [&] { return locked_get().value; });
+    } else {
+      if (hot_keys_.sample_every == 0)
+        return locked_get().value;
+      return Replicas::Local().Read(map_id_, hot_keys_, key, hash, shard.seqlock, locked_get);
+    }
+  }
+
+  // Adds a flushed buffer of deltas to the maps, every map locked once.
+  auto ApplyDeltas()
+  {
+    return [this](const typename Combiner::Deltas& deltas) {
+      vector<K> keys;
+      keys.reserve(deltas.size());
+      for (const auto& entry : deltas)
+        keys.push_back(entry.first);
+      MultiUpdate(keys, [&deltas](const K& key, V& value) { value += deltas.at(key); });
+    };
+  }
+
+  size_t IndexOf(const K& key) const
+  {
+    return sharding_.ShardOf(hasher_(key));
+  }
+
+  template <typename KeyAt, typename Group>
+  void ForEachGroup(size_t count, KeyAt key_at, Group group) const
+  {
+    cmap_common::ForEachShardGroup(count, sharding_.Shards(),
+      [&](size_t i) { return IndexOf(key_at(i)); },
+      group,
+      [&](size_t index_of_map) { cmap_common::PrefetchObject(shards_[index_of_map]); });
+  }
+
+  template <typename KeyAt, typename Apply>
+  void UpdateGroup(size_t index_of_map, const size_t* first, const size_t* last, KeyAt key_at, Apply apply)
+  {
+    WithMapExclusive(index_of_map, [&](ShardMap& mp) {
+      cmap_common::ForEachInGroup(mp, first, last, key_at,
+        [&](size_t i) { apply(mp, i); });
+    });
+  }
+
+  // Runs fn(map) with the map claimed exclusively, a pool mutex locked and
+  // the map's sequence counter open. The flags are declared before the
+  // guard, as in WriteAccess, so they are handed back after the unlock
+  // even when fn throws.
+  template <typename Fn>
+  decltype(auto) WithMapExclusive(size_t index_of_map, Fn fn)
+  {
+    Shard& shard = shards_[index_of_map];
+
+    acquireMapLock(index_of_map);
+    ExclusiveFlag map_flag{shard.flag, parking_lot_};
+    const size_t index_of_mutex = acquireFirstFreeMutex();
+    PooledFlag mutex_flag{*this, index_of_mutex};
+
+    WriteGuard guard(mutexes_[index_of_mutex].mutex);
+    cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+    return fn(shard.map);
+  }
+
+  template <typename Fn>
+  void VisitShard(size_t index_of_map, Fn&& fn) const
+  {
+    // busy-waiting while the required map has a writer
+    acquireSharedMapLock(index_of_map);
+    SharedFlag map_flag{shards_[index_of_map].flag, parking_lot_};
+
+    // locking of first free mutex in interleaving fashion
+    const size_t index_of_mutex = acquireFirstFreeMutex();
+    PooledFlag mutex_flag{*this, index_of_mutex};
+
+    ReadGuard guard(mutexes_[index_of_mutex].mutex);
+    fn(as_const(shards_[index_of_map].map));
+  }
+
+  // Writers keep the sequence counter for optimistic readers and for
+  // hot key replicas.
+  cmap_common::SeqLock* SeqLockOf(Shard& shard) const
+  {
+    return Storage::kOptimisticReads || hot_keys_.sample_every != 0 ? &shard.seqlock : nullptr;
+  }
+
+  // a map flag counts the readers of the map, kMapWriter marks a writer
+  static constexpr int kMapWriter = -1;
+
+  static void ReleaseExclusive(atomic<int>& flag, const ParkingLot& lot)
+  {
+    flag.store(0);
+    lot.WakeAll(flag);
+  }
+
+  static void ReleaseShared(atomic<int>& flag, const ParkingLot& lot)
+  {
+    // only the last reader can unblock a writer
+    if (flag.fetch_sub(1) == 1)
+      lot.WakeAll(flag);
+  }
+
+  void ReleaseMutex(size_t index_of_mutex) const
+  {
+    mutexes_[index_of_mutex].flag.store(0);
+    pool_releases_.count.fetch_add(1);
+    parking_lot_.WakeAll(pool_releases_.count);
+  }
+
+  // waiting per Wait: spinning, then backing off, then parking until
+  // the flag changes
   void acquireMapLock(size_t index_of_map) const
   {
+    cmap_common::Backoff<Wait> backoff;
+    cmap_common::WaitTimer timer;
     int expected = 0;
-    int desired = 1;
 
-    while(!map_table_[index_of_map].compare_exchange_weak(expected, desired));
+    while(!shards_[index_of_map].flag.compare_exchange_weak(expected, kMapWriter))
+    {
+      if (expected != 0)
+      {
+        if constexpr (kStats)
+          timer.Miss();
+        backoff.Wait(shards_[index_of_map].flag, expected, parking_lot_);
+      }
+      expected = 0;
+    }
+    shards_[index_of_map].flag_stats.RecordAcquisition(timer);
+  }
+
+  void acquireSharedMapLock(size_t index_of_map) const
+  {
+    cmap_common::Backoff<Wait> backoff;
+    cmap_common::WaitTimer timer;
+    int expected = shards_[index_of_map].flag.load();
+
+    while(expected == kMapWriter ||
+          !shards_[index_of_map].flag.compare_exchange_weak(expected, expected + 1))
+    {
+      if (expected == kMapWriter)
+      {
+        if constexpr (kStats)
+          timer.Miss();
+        backoff.Wait(shards_[index_of_map].flag, kMapWriter, parking_lot_);
+        expected = shards_[index_of_map].flag.load();
+      }
+    }
+    shards_[index_of_map].flag_stats.RecordAcquisition(timer);
   }
 
-  const size_t acquireFirstFreeMutex() const
+  // a full sweep over a busy pool counts as one failed attempt; the
+  // waiter then parks until a release newer than the sweep's start
+  size_t acquireFirstFreeMutex() const
   {
+    cmap_common::Backoff<Wait> backoff;
     size_t counter = 0;
+    int released = pool_releases_.count.load();
+    bool pool_taken = true;
 
     int expected = 0;
     int desired = 1;
 
-    while(!mutex_table_[counter].compare_exchange_weak(expected, desired))
+    while(!mutexes_[counter].flag.compare_exchange_weak(expected, desired))
     {
+      // a spurious failure leaves expected at 0: the mutex may be free
+      pool_taken = pool_taken && expected != 0;
+      expected = 0;
       counter++;
-      counter %= mutex_table_.size();
+      counter %= sharding_.Mutexes();
+      if (counter == 0)
+      {
+        if (pool_taken)
+          backoff.Wait(pool_releases_.count, released, parking_lot_);
+        released = pool_releases_.count.load();
+        pool_taken = true;
+      }
     }
 
     return counter;
   }
 
 };
+
+// At()/Has() share the map flag and take the pool mutex shared,
+// operator[] holds both exclusively.
+template <typename K, typename V, typename Hash = std::hash<K>>
+using ReadMostlyConcurrentMap = ConcurrentMap<K, V, Hash, shared_mutex>;
+
+// ShardCount maps and a pool of MutexCount mutexes, both powers of two,
+// so maps are picked and the pool sweep wraps around without a division.
+template <typename K, typename V, size_t ShardCount, size_t MutexCount, typename Hash = std::hash<K>>
+using FixedConcurrentMap = ConcurrentMap<K, V, Hash, mutex, cmap_common::NodeStorage,
+                                         cmap_common::SpinThenPark,
+                                         cmap_common::FixedSharding<ShardCount, MutexCount>>;
 }
\ No newline at end of file
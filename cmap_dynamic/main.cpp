@@ -3,6 +3,9 @@
 #include "../utils/test_runner.h"
 #include "../utils/profile.h"
 
+#include <filesystem>
+#include <fstream>
+
 using uri = std::string;
 using cMapInt = cmap_dyn::ConcurrentMap<int, int>;
 using cmap_fold = unordered_map<uri, class cmap_dyn::ConcurrentMap<int, int>>;
@@ -37,6 +40,626 @@ void TestSimple4x3()
   ASSERT_EQUAL(4, testMap.at("one").At(4).ref_to_value);
 }
 
+void TestReadMostly()
+{
+  cmap_dyn::ReadMostlyConcurrentMap<int, int> cm(3, 2, false);
+  for (int i = 0; i < 100; i++)
+  {
+    cm[i].ref_to_value = i;
+  }
+
+  // a reader holding shard 0 must not block another reader of that shard
+  future<int> reader;
+  {
+    const auto held = cm.At(0);
+    reader = async(std::launch::async, [&cm] { return cm.At(3).ref_to_value; });
+    ASSERT(reader.wait_for(chrono::seconds(5)) == future_status::ready);
+    ASSERT_EQUAL(0, held.ref_to_value);
+  }
+  ASSERT_EQUAL(3, reader.get());
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 10000; i++)
+    {
+      const int key = (i * 7 + seed) % 100;
+      if (i % 10 == 0)
+        cm[key].ref_to_value++;
+      else
+        ASSERT(cm.Has(key));
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  int total = 0;
+  for (auto& [k, v] : cm.BuildOrdinaryMap())
+  {
+    total += v - k;
+  }
+  ASSERT_EQUAL(4000, total);
+}
+
+void TestFlatStorage()
+{
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::FlatStorage> cm(4, 3, false);
+
+  auto kernel = [&cm](int seed)
+  {
+    vector<int> updates(10000);
+    iota(begin(updates), end(updates), -5000);
+    shuffle(begin(updates), end(updates), default_random_engine(seed));
+    for (auto key : updates)
+    {
+      cm[key].ref_to_value++;
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  ASSERT(cm.Has(-5000));
+  ASSERT(!cm.Has(5000));
+  ASSERT_EQUAL(4, cm.At(4999).ref_to_value);
+
+  const auto result = cm.BuildOrdinaryMap();
+  ASSERT_EQUAL(10000u, result.size());
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 4, "Key = " + to_string(k));
+  }
+}
+
+struct Twin {
+  int first;
+  int second;
+};
+
+void TestOptimisticGet()
+{
+  cmap_dyn::ConcurrentMap<int, Twin, hash<int>, mutex, cmap_common::OptimisticFlatStorage> cm(4, 3, false);
+  ASSERT(!cm.Get(0).has_value());
+
+  // writers keep growing the shards and rewriting both halves together,
+  // readers must never see a torn or half-inserted value
+  auto writer = [&cm](int seed)
+  {
+    for (int round = 1; round <= 3; round++)
+    {
+      for (int key = seed; key < 20000; key += 2)
+      {
+        auto access = cm[key];
+        access.ref_to_value.first = round;
+        access.ref_to_value.second = round;
+      }
+    }
+  };
+
+  auto reader = [&cm](int seed)
+  {
+    size_t found = 0;
+    for (int i = 0; i < 100000; i++)
+    {
+      const int key = (i * 13 + seed) % 20000;
+      if (const auto value = cm.Get(key))
+      {
+        ASSERT_EQUAL(value->first, value->second);
+        found++;
+      }
+    }
+    return found;
+  };
+
+  vector<future<void>> writers;
+  vector<future<size_t>> readers;
+  for (int i = 0; i < 2; i++)
+  {
+    writers.push_back(async(std::launch::async, writer, i));
+    readers.push_back(async(std::launch::async, reader, i));
+  }
+  for (auto& f : writers)
+  {
+    f.get();
+  }
+  for (auto& f : readers)
+  {
+    f.get();
+  }
+
+  for (int key = 0; key < 20000; key++)
+  {
+    const auto value = cm.Get(key);
+    ASSERT(value.has_value());
+    ASSERT_EQUAL(3, value->first);
+    ASSERT_EQUAL(3, value->second);
+  }
+  ASSERT(!cm.Get(20000).has_value());
+}
+
+// parks after a couple of failed attempts, so that the parking and
+// wake-up path is exercised even with few threads
+struct ParkQuickly {
+  static constexpr int kSpins = 1;
+  static constexpr int kBackoffRounds = 1;
+  static constexpr bool kPark = true;
+};
+
+void TestParkingWaiters()
+{
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::NodeStorage, ParkQuickly> cm(1, 1, false);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 10000; i++)
+    {
+      cm[i % 10].ref_to_value++;
+      if (i % 4 == 0)
+        cm.Has(seed);
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 8; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  for (int i = 0; i < 10; i++)
+  {
+    ASSERT_EQUAL(8 * 1000, cm.At(i).ref_to_value);
+  }
+}
+
+void TestParkingOnPool()
+{
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::NodeStorage, ParkQuickly> cm(2, 2, false);
+  cm[1].ref_to_value = 1;
+  cm[2].ref_to_value = 2;
+
+  promise<void> taken, release;
+  auto holder = async(std::launch::async, [&] {
+    auto first = cm.At(1);
+    taken.set_value();
+    release.get_future().wait();
+  });
+  taken.get_future().wait();
+
+  // both pool mutexes are taken, so the lookup parks; declared first
+  // so that a failed assert releases second before joining it
+  future<bool> lookup;
+  auto second = cm.At(2);
+  lookup = async(std::launch::async, [&cm] { return cm.Has(1); });
+  this_thread::sleep_for(chrono::milliseconds(50));
+
+  // releasing the first mutex, not the last one of the pool, wakes it
+  release.set_value();
+  holder.get();
+  ASSERT(lookup.wait_for(chrono::seconds(5)) == future_status::ready);
+  ASSERT(lookup.get());
+  ASSERT_EQUAL(2, second.ref_to_value);
+}
+
+void TestParkingBuckets()
+{
+  // laid out like the map flags, one per cache-line aligned shard
+  struct alignas(cmap_common::kCacheLineSize) Shard {
+    atomic<int> flag{0};
+  };
+  vector<Shard> shards(cmap_common::ParkingLot::kBuckets);
+
+  set<size_t> buckets;
+  for (const Shard& shard : shards)
+  {
+    buckets.insert(cmap_common::ParkingLot::BucketOf(shard.flag));
+  }
+  ASSERT_EQUAL(cmap_common::ParkingLot::kBuckets, buckets.size());
+}
+
+void TestBatch()
+{
+  cmap_dyn::ConcurrentMap<int, int> cm(4, 3, false);
+
+  vector<pair<int, int>> entries;
+  for (int i = 0; i < 500; i++)
+  {
+    entries.push_back({i, i * 10});
+  }
+  entries.push_back({0, -1});
+  cm.InsertBatch(entries);
+
+  ASSERT_EQUAL(-1, cm.At(0).ref_to_value);
+  ASSERT_EQUAL(4990, cm.At(499).ref_to_value);
+
+  const auto values = cm.MultiGet({499, 500, 1, -7, 1});
+  ASSERT_EQUAL(5u, values.size());
+  ASSERT_EQUAL(4990, *values[0]);
+  ASSERT(!values[1].has_value());
+  ASSERT_EQUAL(10, *values[2]);
+  ASSERT(!values[3].has_value());
+  ASSERT_EQUAL(10, *values[4]);
+
+  // concurrent batches with repeated keys, every key bumped once per mention
+  auto kernel = [&cm](int seed)
+  {
+    vector<int> batch;
+    for (int i = 0; i < 300; i++)
+    {
+      batch.push_back(1000 + (i * 7 + seed) % 100);
+    }
+    for (int round = 0; round < 100; round++)
+    {
+      cm.MultiUpdate(batch, [](const int&, int& value) { value++; });
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  vector<int> counters(100);
+  iota(begin(counters), end(counters), 1000);
+  int total = 0;
+  for (const auto& value : cm.MultiGet(counters))
+  {
+    ASSERT(value.has_value());
+    total += *value;
+  }
+  ASSERT_EQUAL(4 * 100 * 300, total);
+}
+
+void TestUpdate()
+{
+  cmap_dyn::ConcurrentMap<int, int> cm(4, 3, false);
+
+  ASSERT(!cm.Update(1, [](int& value) { value = 10; }));
+  ASSERT(!cm.Has(1));
+
+  ASSERT(cm.UpsertWith(1, 5, [](int& value) { value *= 2; }));
+  ASSERT_EQUAL(5, cm.At(1).ref_to_value);
+  ASSERT(!cm.UpsertWith(1, 5, [](int& value) { value *= 2; }));
+  ASSERT_EQUAL(10, cm.At(1).ref_to_value);
+
+  ASSERT(cm.Update(1, [](int& value) { value++; }));
+  ASSERT_EQUAL(11, cm.At(1).ref_to_value);
+}
+
+void TestFetchAdd()
+{
+  cmap_dyn::ReadMostlyConcurrentMap<int, long> cm(4, 3, false);
+
+  ASSERT_EQUAL(0l, cm.FetchAdd(7, 3));
+  ASSERT_EQUAL(3l, cm.FetchAdd(7, -1));
+  ASSERT_EQUAL(2l, cm.FetchAdd(7, 0));
+
+  // all threads bump the same counters at once, and no increment is lost
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 20000; i++)
+    {
+      cm.FetchAdd((i + seed) % 50, 1);
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  long total = 0;
+  for (int key = 0; key < 50; key++)
+  {
+    total += cm.FetchAdd(key, 0);
+  }
+  ASSERT_EQUAL(4l * 20000 + 2, total);
+
+  cmap_dyn::ConcurrentMap<int, double> sums(4, 3, false);
+  sums.FetchAdd(0, 0.5);
+  ASSERT_EQUAL(0.5, sums.FetchAdd(0, 0.25));
+  ASSERT_EQUAL(0.75, sums.At(0).ref_to_value);
+}
+
+void TestFixedSharding()
+{
+  cmap_dyn::FixedConcurrentMap<int, int, 8, 4> cm(false);
+
+  vector<pair<int, int>> entries;
+  for (int i = 0; i < 1000; i++)
+  {
+    entries.push_back({i, i * 2});
+  }
+  cm.InsertBatch(entries);
+  cm[1000].ref_to_value = 7;
+  cm.FetchAdd(1, 1);
+
+  const auto ordinary = cm.BuildOrdinaryMap();
+  ASSERT_EQUAL(1001u, ordinary.size());
+  ASSERT_EQUAL(3, ordinary.at(1));
+  ASSERT_EQUAL(7, cm.At(1000).ref_to_value);
+  ASSERT(cm.Has(999));
+  ASSERT(!cm.Has(-1));
+}
+
+void TestVisitors()
+{
+  cmap_dyn::ConcurrentMap<int, int> cm(4, 3, false);
+  for (int i = 1; i <= 1000; i++)
+  {
+    cm[i].ref_to_value = i;
+  }
+
+  long sum = 0;
+  cm.ForEach([&sum](const int& key, const int& value) { sum += key + value; });
+  ASSERT_EQUAL(1000l * 1001, sum);
+
+  size_t shards = 0, entries = 0;
+  cm.ForEachShard([&](const auto& mp) { shards++; entries += mp.size(); });
+  ASSERT_EQUAL(4u, shards);
+  ASSERT_EQUAL(1000u, entries);
+
+  ASSERT_EQUAL(1000u, cm.Count());
+  ASSERT_EQUAL(500u, cm.Count([](const int& key, const int&) { return key % 2 == 0; }));
+  ASSERT_EQUAL(1000, cm.Reduce(0, [](int acc, const int&, const int& value) { return max(acc, value); }));
+
+  atomic<long> parallel_sum{0};
+  cm.ParallelForEach(cmap_common::AsyncExecutor(3), [&](const int&, const int& value) { parallel_sum += value; });
+  ASSERT_EQUAL(500500l, parallel_sum.load());
+
+  // the first exception of a task comes back to the caller
+  bool thrown = false;
+  try
+  {
+    cm.ParallelForEach(cmap_common::AsyncExecutor(2), [](const int& key, const int&) {
+      if (key == 77)
+        throw runtime_error("77");
+    });
+  }
+  catch (const runtime_error& e)
+  {
+    thrown = string(e.what()) == "77";
+  }
+  ASSERT(thrown);
+}
+
+void TestExport()
+{
+  cmap_dyn::ConcurrentMap<int, string> cm(4, 3, false);
+  unordered_map<int, string> expected;
+  for (int i = 0; i < 1000; i++)
+  {
+    cm[i].ref_to_value = to_string(i);
+    expected[i] = to_string(i);
+  }
+
+  ASSERT(cm.BuildOrdinaryMap() == expected);
+  ASSERT(cm.BuildOrdinaryMap(cmap_common::AsyncExecutor(3)) == expected);
+
+  // moving out empties the map, which stays usable
+  ASSERT(cm.ExtractOrdinaryMap() == expected);
+  ASSERT_EQUAL(0u, cm.Count());
+  cm[5].ref_to_value = "five";
+  const auto shards = cm.ExtractShards();
+  ASSERT_EQUAL(4u, shards.size());
+  size_t entries = 0;
+  for (const auto& mp : shards)
+    entries += mp.size();
+  ASSERT_EQUAL(1u, entries);
+  ASSERT(!cm.Has(5));
+
+  // entries of FlatMap shards are moved over one by one
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::FlatStorage> flat(4, 3, false);
+  for (int i = 0; i < 100; i++)
+    flat[i].ref_to_value = i * i;
+  const auto flat_copy = flat.BuildOrdinaryMap(cmap_common::AsyncExecutor(2));
+  const auto flat_moved = flat.ExtractOrdinaryMap();
+  ASSERT_EQUAL(100u, flat_moved.size());
+  ASSERT(flat_copy == flat_moved);
+  ASSERT_EQUAL(81, flat_moved.at(9));
+  ASSERT_EQUAL(0u, flat.Count());
+}
+
+void TestSnapshot()
+{
+  using cmap_common::SnapshotStorage;
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, SnapshotStorage<>> cm(4, 3, false);
+  for (int i = 0; i < 1000; i++)
+    cm[i].ref_to_value = i;
+
+  const auto snapshot = cm.Snapshot();
+  for (int i = 0; i < 1000; i++)
+    cm[i].ref_to_value = -i;
+  cm[1000].ref_to_value = 1000;
+  cm.FetchAdd(7, 100);
+
+  // writes after the snapshot are not seen by it
+  ASSERT_EQUAL(1000u, snapshot.Size());
+  ASSERT_EQUAL(5, snapshot.Get(5).value());
+  ASSERT_EQUAL(7, snapshot.At(7));
+  ASSERT(!snapshot.Has(1000));
+  ASSERT(!snapshot.Get(1000));
+  long sum = 0;
+  snapshot.ForEach([&](const int&, const int& value) { sum += value; });
+  ASSERT_EQUAL(499500l, sum);
+  ASSERT_EQUAL(1000u, snapshot.BuildOrdinaryMap().size());
+
+  const auto later = cm.Snapshot();
+  ASSERT_EQUAL(1001u, later.Size());
+  ASSERT_EQUAL(93, later.Get(7).value());
+  ASSERT_EQUAL(-5, later.Get(5).value());
+
+  // FlatMap shards, written in rounds by one thread: a consistent view
+  // sees round r on a prefix of the keys and round r - 1 on the rest
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, SnapshotStorage<cmap_common::FlatStorage>> rounds(4, 3, false);
+  const int key_count = 200;
+  for (int k = 0; k < key_count; k++)
+    rounds[k].ref_to_value = 0;
+
+  atomic<bool> done{false};
+  auto writer = async(launch::async, [&] {
+    for (int r = 1; r <= 300; r++)
+      for (int k = 0; k < key_count; k++)
+        rounds[k].ref_to_value = r;
+    done = true;
+  });
+  size_t consistent = 0, taken = 0;
+  while (!done || taken == 0)
+  {
+    const auto view = rounds.Snapshot();
+    const int first = view.Get(0).value();
+    int k = 0;
+    while (k < key_count && view.Get(k).value() == first)
+      k++;
+    while (k < key_count && view.Get(k).value() == first - 1)
+      k++;
+    consistent += k == key_count;
+    taken++;
+  }
+  writer.get();
+  ASSERT_EQUAL(taken, consistent);
+}
+
+template <typename Storage>
+void RunPmrStorage()
+{
+  cmap_dyn::ConcurrentMap<int, string, hash<int>, mutex, Storage> cm(4, 3, false);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int key = seed * 1000; key < (seed + 1) * 1000; key++)
+      cm[key].ref_to_value = to_string(key);
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+
+  ASSERT_EQUAL(4000u, cm.Count());
+  ASSERT_EQUAL(string("3999"), cm.At(3999).ref_to_value);
+
+  const auto extracted = cm.ExtractOrdinaryMap();
+  ASSERT_EQUAL(4000u, extracted.size());
+  ASSERT_EQUAL(string("17"), extracted.at(17));
+  cm[1].ref_to_value = "one";
+  ASSERT_EQUAL(1u, cm.Count());
+}
+
+void TestPmrStorage()
+{
+  RunPmrStorage<cmap_common::PoolStorage>();
+  RunPmrStorage<cmap_common::ArenaStorage>();
+}
+
+void TestStats()
+{
+  using Instrumented = cmap_common::InstrumentedMutex<shared_mutex>;
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, Instrumented> cm(4, 3, false);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int key = 0; key < 1000; key++)
+    {
+      cm[(key + seed * 250) % 1000].ref_to_value++;
+      cm.Has(key);
+    }
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+
+  const auto stats = cm.Stats();
+  ASSERT_EQUAL(4u, stats.shards.size());
+  ASSERT_EQUAL(3u, stats.mutexes.size());
+
+  size_t entries = 0;
+  uint64_t acquisitions = 0, contended = 0, waits = 0, hold_samples = 0;
+  auto add = [&](const cmap_common::LockCounters& c) {
+    acquisitions += c.acquisitions;
+    contended += c.contended;
+    hold_samples += c.hold_samples;
+    for (auto n : c.wait_histogram)
+      waits += n;
+  };
+  for (const auto& shard : stats.shards)
+  {
+    entries += shard.entries;
+    add(shard.lock);
+  }
+  for (const auto& m : stats.mutexes)
+    add(m);
+  ASSERT_EQUAL(1000u, entries);
+  // every operation is counted once on the lock it went through
+  ASSERT(acquisitions >= 2 * 8000u);
+  ASSERT_EQUAL(contended, waits);
+  ASSERT(hold_samples > 0);
+
+  ostringstream json;
+  json << stats;
+  ASSERT(json.str().rfind("{\"shards\": [{\"entries\": ", 0) == 0);
+}
+
+void TestBoundedCache()
+{
+  cmap_dyn::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::BoundedStorage<16>> cm(4, 2, false);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 5000; i++)
+    {
+      const int key = (i * 7 + seed) % 500;
+      if (i % 10 == 0)
+        cm.Erase(key);
+      else if (!cm.Update(key, [key](int& value) { ASSERT_EQUAL(key, value); }))
+        cm[key].ref_to_value = key;
+    }
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+
+  const auto counters = cm.CacheStats();
+  ASSERT_EQUAL(18000u, counters.hits + counters.misses);
+  ASSERT(counters.evictions > 0u);
+  ASSERT(cm.Count() <= 4u * 16);
+
+  cm[1000].ref_to_value = 1;
+  ASSERT(cm.Erase(1000));
+  ASSERT(!cm.Erase(1000));
+  ASSERT(!cm.Has(1000));
+}
+
 void RunConcurrentUpdates(
     cmap_fold& cm, size_t thread_count, int key_count
 ) {
@@ -69,6 +692,104 @@ void RunConcurrentUpdates(
   }
 }
 
+void TestHotKeys()
+{
+  using Replicas = cmap_common::HotKeyReplicas<int, int, hash<int>>;
+  cmap_dyn::ReadMostlyConcurrentMap<int, int> cm(3, 2, false);
+  cm.EnableHotKeys({1, 2});
+  for (int key = 0; key < 100; key++)
+    cm[key].ref_to_value = key;
+
+  const uint64_t hits = Replicas::Local().Hits();
+  for (int i = 0; i < 10; i++)
+    ASSERT_EQUAL(7, *cm.Get(7));
+  ASSERT(Replicas::Local().Hits() > hits);
+
+  cm[7].ref_to_value = 70;
+  ASSERT_EQUAL(70, *cm.Get(7));
+  ASSERT_EQUAL(70, cm.FetchAdd(7, 1));
+  ASSERT_EQUAL(71, *cm.Get(7));
+  cm.MultiUpdate({7}, [](const int&, int& value) { value = 72; });
+  ASSERT_EQUAL(72, *cm.Get(7));
+  ASSERT(cm.Erase(7));
+  ASSERT(!cm.Get(7).has_value());
+
+  auto reader = [&cm]
+  {
+    int last = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+      const int value = *cm.Get(0);
+      ASSERT(value >= last);
+      last = value;
+    }
+  };
+  vector<future<void>> readers;
+  for (int i = 0; i < 3; i++)
+    readers.push_back(async(std::launch::async, reader));
+  for (int i = 0; i < 1000; i++)
+    cm.FetchAdd(0, 1);
+  for (auto& f : readers)
+    f.get();
+  ASSERT_EQUAL(1000, *cm.Get(0));
+}
+
+void TestWriteCombining()
+{
+  cmap_dyn::ConcurrentMap<int, long> cm(3, 2, false);
+  cm.EnableWriteCombining({4, chrono::hours(1)});
+
+  // pending deltas show to the thread that added them only
+  cm.Accumulate(1, 5);
+  cm.Accumulate(1, 2);
+  ASSERT_EQUAL(7, *cm.Get(1));
+  ASSERT(!async(std::launch::async, [&cm] { return cm.Get(1); }).get().has_value());
+  cm.Flush();
+  ASSERT_EQUAL(7, *async(std::launch::async, [&cm] { return cm.Get(1); }).get());
+  ASSERT_EQUAL(7, *cm.Get(1));
+
+  // the fourth pending key flushes the buffer
+  for (int key = 2; key <= 5; key++)
+    cm.Accumulate(key, key);
+  ASSERT_EQUAL(4, *async(std::launch::async, [&cm] { return cm.Get(4); }).get());
+
+  // deltas of exited threads wait for the next Flush
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 10000; i++)
+      cm.Accumulate((i * 7 + seed) % 3 + 10, 1);
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+  cm.Flush();
+  ASSERT_EQUAL(40000, *cm.Get(10) + *cm.Get(11) + *cm.Get(12));
+
+  // without write combining Accumulate adds at once
+  cmap_dyn::ConcurrentMap<int, long> plain(3, 2, false);
+  plain.Accumulate(1, 3);
+  plain.Flush();
+  ASSERT_EQUAL(3, *async(std::launch::async, [&plain] { return plain.Get(1); }).get());
+}
+
+void TestSnapshotFile()
+{
+  const string path = (filesystem::temp_directory_path() / "cmap_dyn_snapshot.bin").string();
+
+  cmap_dyn::ConcurrentMap<int, long> cm(4, 3, false);
+  for (int key = 0; key < 1000; key++)
+    cm[key].ref_to_value = key * 3;
+  cm.SaveSnapshot(path);
+
+  cmap_dyn::ConcurrentMap<int, long> loaded(5, 2, false);
+  loaded.LoadSnapshot(path);
+  ASSERT_EQUAL(1000u, loaded.Count());
+  ASSERT_EQUAL(2997l, loaded.At(999).ref_to_value);
+  filesystem::remove(path);
+}
+
 void TestAsync3x3()
 {
   const size_t map_count = 3;
@@ -124,6 +845,25 @@ int main() {
   TestRunner tr;
   RUN_TEST(tr, TestSimple);
   RUN_TEST(tr, TestSimple4x3);
+  RUN_TEST(tr, TestReadMostly);
+  RUN_TEST(tr, TestFlatStorage);
+  RUN_TEST(tr, TestPmrStorage);
+  RUN_TEST(tr, TestBoundedCache);
+  RUN_TEST(tr, TestHotKeys);
+  RUN_TEST(tr, TestWriteCombining);
+  RUN_TEST(tr, TestSnapshotFile);
+  RUN_TEST(tr, TestOptimisticGet);
+  RUN_TEST(tr, TestBatch);
+  RUN_TEST(tr, TestUpdate);
+  RUN_TEST(tr, TestFetchAdd);
+  RUN_TEST(tr, TestFixedSharding);
+  RUN_TEST(tr, TestVisitors);
+  RUN_TEST(tr, TestExport);
+  RUN_TEST(tr, TestSnapshot);
+  RUN_TEST(tr, TestStats);
+  RUN_TEST(tr, TestParkingWaiters);
+  RUN_TEST(tr, TestParkingOnPool);
+  RUN_TEST(tr, TestParkingBuckets);
   RUN_TEST(tr, TestAsync3x3);
   RUN_TEST(tr, TestAsync4x3);
   return 0;
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+
+#include "../cmap_one2one/cmap_o2o.hpp"
+#include "../utils/persist.h"
+#include "../utils/visit.h"
+using namespace std;
+
+namespace cmap_nested
+{
+
+// Hash of string outer keys that also accepts string_view and const char*,
+// so uris can be looked up without building a temporary string.
+// hash<string> and hash<string_view> agree on equal contents.
+struct StringHash {
+  using is_transparent = void;
+
+  size_t operator()(string_view key) const
+  {
+    return hash<string_view>{}(key);
+  }
+};
+
+template <typename K>
+struct DefaultOuterHash {
+  using type = std::hash<K>;
+};
+
+template <>
+struct DefaultOuterHash<string> {
+  using type = StringHash;
+};
+
+template <typename Hash, typename = void>
+struct is_transparent : false_type {};
+
+template <typename Hash>
+struct is_transparent<Hash, void_t<typename Hash::is_transparent>> : true_type {};
+
+// Outer container of the nested maps: OuterK (e.g. an uri) -> inner
+// ConcurrentMap<InnerK, V>. Inner maps can be registered while other
+// threads are looking up and updating already registered ones.
+//
+// Lookups never lock: they read the currently published directory, an
+// insert-only chained hash table whose nodes are immutable once linked.
+// Registration serializes on a writer mutex, links a new node at the head
+// of its bucket and, when the load factor exceeds 1, publishes a rebuilt
+// directory with twice the buckets. Replaced directories are retired, not
+// freed, because readers may still walk them; they are released with the
+// container, and doubling keeps their total size within 2x of the live one.
+//
+// Inner maps are never moved once registered, so the returned references
+// and handles stay valid for the lifetime of the container.
+//
+// With a transparent OuterHash (the default for string keys) every lookup
+// also accepts keys comparable to OuterK, e.g. string_view or const char*.
+// Otherwise such keys are converted to OuterK first.
+template <
+  typename OuterK,
+  typename InnerK,
+  typename V,
+  typename InnerMap = cmap_one2one::ConcurrentMap<InnerK, V>,
+  typename OuterHash = typename DefaultOuterHash<OuterK>::type,
+  typename OuterEqual = equal_to<>>
+class NestedConcurrentMap {
+public:
+  using InnerFactory = function<InnerMap()>;
+
+  // Outer key resolved once; caching it keeps hot loops free of
+  // outer key hashing and allocation.
+  class Handle {
+  public:
+    Handle() = default;
+
+    InnerMap& operator*() const { return *map_; }
+    InnerMap* operator->() const { return map_; }
+    explicit operator bool() const { return map_ != nullptr; }
+
+  private:
+    friend class NestedConcurrentMap;
+    explicit Handle(InnerMap* map) : map_(map) {}
+
+    InnerMap* map_ = nullptr;
+  };
+
+  explicit NestedConcurrentMap(InnerFactory make_inner = {}, size_t bucket_count = 16) :
+  make_inner_(move(make_inner)),
+  directory_(new Directory(max<size_t>(bucket_count, 1)))
+  {}
+
+  NestedConcurrentMap(const NestedConcurrentMap&) = delete;
+  NestedConcurrentMap& operator=(const NestedConcurrentMap&) = delete;
+
+  ~NestedConcurrentMap()
+  {
+    delete directory_.load();
+  }
+
+  // Registers inner under key unless the key is already present.
+  // Returns the registered map and whether the insertion took place.
+  pair<InnerMap&, bool> Insert(const OuterK& key, InnerMap inner)
+  {
+    lock_guard<mutex> guard(writer_mutex_);
+    if (InnerMap* existing = Find(key)) {
+      return {*existing, false};
+    }
+    return {Register(key, make_unique<InnerMap>(move(inner))), true};
+  }
+
+  // Returns the map registered under key, building it with the factory
+  // passed to the constructor when it is missing.
+  template <typename Q>
+  InnerMap& GetOrInsert(const Q& key)
+  {
+    if (InnerMap* existing = Find(key)) {
+      return *existing;
+    }
+
+    lock_guard<mutex> guard(writer_mutex_);
+    if (InnerMap* existing = Find(key)) {
+      return *existing;
+    }
+    if (!make_inner_) {
+      throw logic_error("NestedConcurrentMap: no inner map factory");
+    }
+    return Register(OuterK(key), make_unique<InnerMap>(make_inner_()));
+  }
+
+  template <typename Q>
+  InnerMap* Find(const Q& key) const
+  {
+    if constexpr (is_transparent<OuterHash>::value || is_same_v<Q, OuterK>) {
+      const Directory* directory = directory_.load(memory_order_acquire);
+      const size_t index = hasher_(key) % directory->buckets.size();
+
+      for (const Node* node = directory->buckets[index].load(memory_order_acquire);
+           node != nullptr;
+           node = node->next) {
+        if (equal_(node->key, key)) {
+          return node->map;
+        }
+      }
+      return nullptr;
+    } else {
+      return Find(OuterK(key));
+    }
+  }
+
+  template <typename Q>
+  InnerMap& At(const Q& key) const
+  {
+    InnerMap* found = Find(key);
+    if (found == nullptr) {
+      throw out_of_range("NestedConcurrentMap::At");
+    }
+    return *found;
+  }
+
+  template <typename Q>
+  bool Has(const Q& key) const
+  {
+    return Find(key) != nullptr;
+  }
+
+  // Empty handle when key is not registered.
+  template <typename Q>
+  Handle Resolve(const Q& key) const
+  {
+    return Handle(Find(key));
+  }
+
+  size_t Size() const
+  {
+    return size_.load(memory_order_acquire);
+  }
+
+  // Writes every registered inner map to path in the snapshot file format
+  // (see cmap_common::MappedSnapshot), one section per inner map labelled
+  // with its outer key. The inner maps are encoded in parallel by the
+  // tasks of executor, shard by shard under their locks; maps registered
+  // meanwhile may be left out. Throws runtime_error on I/O errors.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void SaveSnapshot(const string& path, const Executor& executor = Executor()) const
+  {
+    const vector<const Node*> nodes = Registered();
+    vector<cmap_common::EncodedSection> sections(nodes.size());
+    cmap_common::ParallelForIndexes(executor, nodes.size(), [&](size_t i) {
+      cmap_common::EncodeLabel(sections[i], nodes[i]->key);
+      nodes[i]->map->ForEach([&](const InnerK& key, const V& value) {
+        cmap_common::EncodeEntry<InnerK, V>(sections[i], key, value);
+      });
+    });
+    cmap_common::WriteSnapshotFile<InnerK, V>(path, sections, executor);
+  }
+
+  // Inserts the inner maps SaveSnapshot wrote to path, each into the map
+  // registered under its outer key or into one built with the factory,
+  // overwriting equal keys. The sections are decoded straight from the
+  // mapped file in parallel by the tasks of executor. Throws runtime_error
+  // when path holds no snapshot of InnerK and V, logic_error when a map
+  // is missing and there is no factory.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void LoadSnapshot(const string& path, const Executor& executor = Executor())
+  {
+    const cmap_common::MappedSnapshot snapshot(path);
+    snapshot.Expect<InnerK, V>();
+    cmap_common::ParallelForIndexes(executor, snapshot.Sections(), [&](size_t i) {
+      GetOrInsert(snapshot.Label<OuterK>(i)).InsertBatch(snapshot.Decode<InnerK, V>(i));
+    });
+  }
+
+private:
+  struct Node {
+    const OuterK key;
+    InnerMap* const map;
+    const Node* const next;
+  };
+
+  struct Directory {
+    explicit Directory(size_t bucket_count) :
+    buckets(bucket_count)
+    {}
+
+    ~Directory()
+    {
+      for (auto& head : buckets) {
+        const Node* node = head.load();
+        while (node != nullptr) {
+          const Node* next = node->next;
+          delete node;
+          node = next;
+        }
+      }
+    }
+
+    vector<atomic<const Node*>> buckets;
+  };
+
+  // Nodes of the published directory, read without locking like lookups.
+  vector<const Node*> Registered() const
+  {
+    vector<const Node*> nodes;
+    const Directory* directory = directory_.load(memory_order_acquire);
+    for (const auto& head : directory->buckets) {
+      for (const Node* node = head.load(memory_order_acquire); node != nullptr; node = node->next) {
+        nodes.push_back(node);
+      }
+    }
+    return nodes;
+  }
+
+  // writer_mutex_ must be held
+  InnerMap& Register(const OuterK& key, unique_ptr<InnerMap> inner)
+  {
+    InnerMap* map = inner.get();
+    maps_.push_back(move(inner));
+
+    Directory* directory = directory_.load(memory_order_relaxed);
+    if (maps_.size() > directory->buckets.size()) {
+      directory = Grow(directory);
+    }
+
+    Link(*directory, key, map);
+    size_.store(maps_.size(), memory_order_release);
+    return *map;
+  }
+
+  void Link(Directory& directory, const OuterK& key, InnerMap* map)
+  {
+    auto& head = directory.buckets[hasher_(key) % directory.buckets.size()];
+    head.store(new Node{key, map, head.load(memory_order_relaxed)}, memory_order_release);
+  }
+
+  Directory* Grow(Directory* current)
+  {
+    auto grown = make_unique<Directory>(current->buckets.size() * 2);
+    for (auto& head : current->buckets) {
+      for (const Node* node = head.load(memory_order_relaxed); node != nullptr; node = node->next) {
+        Link(*grown, node->key, node->map);
+      }
+    }
+
+    retired_.emplace_back(current);
+    directory_.store(grown.get(), memory_order_release);
+    return grown.release();
+  }
+
+  OuterHash hasher_;
+  OuterEqual equal_;
+  InnerFactory make_inner_;
+
+  atomic<Directory*> directory_;
+  atomic<size_t> size_{0};
+
+  mutex writer_mutex_;
+  vector<unique_ptr<InnerMap>> maps_;
+  vector<unique_ptr<Directory>> retired_;
+};
+
+}
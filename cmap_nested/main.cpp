@@ -0,0 +1,304 @@
+#include "cmap_nested.hpp"
+
+#include "../cmap_one2many/cmap_o2m.hpp"
+#include "../cmap_dynamic/cmap_dyn.hpp"
+#include "../utils/test_runner.h"
+#include "../utils/profile.h"
+
+#include <filesystem>
+#include <fstream>
+
+using uri = std::string;
+using cMapInt = cmap_one2one::ConcurrentMap<int, int>;
+using cmap_nested_fold = cmap_nested::NestedConcurrentMap<uri, int, int>;
+
+void TestSimple()
+{
+  cmap_nested_fold testMap;
+  ASSERT(testMap.Insert("one", cMapInt(1)).second);
+  ASSERT(!testMap.Insert("one", cMapInt(1)).second);
+
+  ASSERT_EQUAL(1u, testMap.Size());
+  ASSERT(testMap.Has("one"));
+  ASSERT(!testMap.Has("two"));
+  ASSERT(testMap.Find("two") == nullptr);
+
+  testMap.At("one")[1].ref_to_value = 1;
+
+  ASSERT_EQUAL(1, testMap.At("one").At(1).ref_to_value);
+
+  bool thrown = false;
+  try {
+    testMap.At("two");
+  } catch (out_of_range&) {
+    thrown = true;
+  }
+  ASSERT(thrown);
+}
+
+void TestGetOrInsert()
+{
+  cmap_nested_fold testMap([] { return cMapInt(3); });
+
+  testMap.GetOrInsert("one")[1].ref_to_value = 1;
+  testMap.GetOrInsert("one")[1].ref_to_value++;
+
+  ASSERT_EQUAL(1u, testMap.Size());
+  ASSERT_EQUAL(2, testMap.At("one").At(1).ref_to_value);
+
+  cmap_nested_fold noFactory;
+  bool thrown = false;
+  try {
+    noFactory.GetOrInsert("one");
+  } catch (logic_error&) {
+    thrown = true;
+  }
+  ASSERT(thrown);
+}
+
+void TestGrowKeepsReferences()
+{
+  cmap_nested_fold testMap([] { return cMapInt(2); }, 1);
+
+  vector<cMapInt*> registered;
+  for (int i = 0; i < 1000; i++)
+  {
+    auto& inner = testMap.GetOrInsert(to_string(i));
+    inner[i].ref_to_value = i;
+    registered.push_back(&inner);
+  }
+
+  ASSERT_EQUAL(1000u, testMap.Size());
+  for (int i = 0; i < 1000; i++)
+  {
+    ASSERT(registered[i] == &testMap.At(to_string(i)));
+    ASSERT_EQUAL(i, testMap.At(to_string(i)).At(i).ref_to_value);
+  }
+}
+
+void TestHeterogeneousLookup()
+{
+  cmap_nested_fold testMap([] { return cMapInt(2); });
+  testMap.Insert("one", cMapInt(2));
+
+  const string_view view = "one";
+  const char* chars = "one";
+  ASSERT(testMap.Has(view));
+  ASSERT(testMap.Has(chars));
+  ASSERT(!testMap.Has(string_view("two")));
+  ASSERT(&testMap.At(view) == &testMap.At(chars));
+
+  testMap.GetOrInsert(string_view("two"))[2].ref_to_value = 2;
+  ASSERT_EQUAL(2u, testMap.Size());
+  ASSERT_EQUAL(2, testMap.At(string("two")).At(2).ref_to_value);
+
+  // a hash without is_transparent still takes convertible keys
+  cmap_nested::NestedConcurrentMap<uri, int, int, cMapInt, hash<uri>> plain;
+  plain.Insert("one", cMapInt(2));
+  ASSERT(plain.Has(view));
+  ASSERT(plain.Has(chars));
+}
+
+void TestResolveHandle()
+{
+  cmap_nested_fold testMap([] { return cMapInt(2); }, 1);
+
+  ASSERT(!testMap.Resolve("one"));
+
+  auto handle = testMap.Resolve(string_view("one"));
+  ASSERT(!handle);
+
+  testMap.GetOrInsert("one");
+  handle = testMap.Resolve(string_view("one"));
+  ASSERT(static_cast<bool>(handle));
+
+  // handles survive directory growth
+  for (int i = 0; i < 100; i++)
+  {
+    testMap.GetOrInsert(to_string(i));
+  }
+  (*handle)[1].ref_to_value = 1;
+  handle->operator[](1).ref_to_value++;
+
+  ASSERT_EQUAL(2, testMap.At("one").At(1).ref_to_value);
+}
+
+// Half of the threads keep registering new uris while the other half
+// update the inner maps that are already there.
+template <typename Nested>
+void RunConcurrentRegistration(Nested& cm, size_t thread_count, int key_count)
+{
+  const int registered = 200;
+  const int added = 800;
+
+  for (int j = 0; j < registered; j++)
+  {
+    cm.GetOrInsert(to_string(j));
+  }
+
+  auto kernel_inner = [&cm, key_count](int seed)
+  {
+    vector<int> updates(key_count);
+    iota(begin(updates), end(updates), 0);
+    shuffle(begin(updates), end(updates), default_random_engine(seed));
+
+    for (int j = 0; j < registered; j++)
+    {
+      const auto inner = cm.Resolve(to_string(j));
+      for (auto key : updates)
+      {
+        (*inner)[key].ref_to_value++;
+      }
+    }
+  };
+
+  auto kernel_outer = [&cm](int seed)
+  {
+    for (int j = registered; j < registered + added; j++)
+    {
+      cm.GetOrInsert(to_string(j))[seed].ref_to_value++;
+    }
+  };
+
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; ++i)
+  {
+    if (i % 2 == 0)
+      futures.push_back(async(std::launch::async, kernel_inner, i));
+    else
+      futures.push_back(async(std::launch::async, kernel_outer, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  const int inner_threads = (thread_count + 1) / 2;
+  ASSERT_EQUAL(static_cast<size_t>(registered + added), cm.Size());
+  for (int j = 0; j < registered; j++)
+  {
+    const auto result = cm.At(to_string(j)).BuildOrdinaryMap();
+    ASSERT_EQUAL(result.size(), static_cast<size_t>(key_count));
+    for (auto& [k, v] : result) {
+      AssertEqual(v, inner_threads, "Key = " + to_string(k));
+    }
+  }
+  for (int j = registered; j < registered + added; j++)
+  {
+    const auto result = cm.At(to_string(j)).BuildOrdinaryMap();
+    ASSERT_EQUAL(result.size(), thread_count / 2);
+    for (auto& [k, v] : result) {
+      AssertEqual(v, 1, "Key = " + to_string(k));
+    }
+  }
+}
+
+void TestConcurrentOne2One()
+{
+  cmap_nested_fold cm([] { return cMapInt(4); }, 1);
+  RunConcurrentRegistration(cm, 4, 1000);
+}
+
+void TestConcurrentOne2Many()
+{
+  using inner = cmap_o2m::ConcurrentMap<int, int>;
+  cmap_nested::NestedConcurrentMap<uri, int, int, inner> cm([] { return inner(4, 3, false); }, 1);
+  RunConcurrentRegistration(cm, 4, 1000);
+}
+
+void TestConcurrentDynamic()
+{
+  using inner = cmap_dyn::ConcurrentMap<int, int>;
+  cmap_nested::NestedConcurrentMap<uri, int, int, inner> cm([] { return inner(4, 3, false); }, 1);
+  RunConcurrentRegistration(cm, 4, 1000);
+}
+
+void TestConcurrentArena()
+{
+  using inner = cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::ArenaStorage>;
+  cmap_nested::NestedConcurrentMap<uri, int, int, inner> cm([] { return inner(4); }, 1);
+  RunConcurrentRegistration(cm, 4, 1000);
+}
+
+void TestBoundedInner()
+{
+  // a bounded cache per uri
+  using inner = cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::BoundedStorage<32>>;
+  cmap_nested::NestedConcurrentMap<uri, int, int, inner> cm([] { return inner(2); });
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 2000; i++)
+    {
+      auto& cache = cm.GetOrInsert("uri" + to_string(i % 3));
+      const int key = (i * 13 + seed) % 200;
+      if (!cache.Update(key, [key](int& value) { ASSERT_EQUAL(key, value); }))
+        cache[key].ref_to_value = key;
+    }
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+
+  ASSERT_EQUAL(3u, cm.Size());
+  cmap_common::CacheCounters total;
+  for (int u = 0; u < 3; u++)
+  {
+    const auto& cache = cm.At("uri" + to_string(u));
+    ASSERT(cache.Count() <= 64u);
+    total += cache.CacheStats();
+  }
+  ASSERT_EQUAL(8000u, total.hits + total.misses);
+  ASSERT(total.evictions > 0u);
+}
+
+void TestSnapshotFile()
+{
+  const string path = (filesystem::temp_directory_path() / "cmap_nested_snapshot.bin").string();
+
+  cmap_nested_fold cm([] { return cMapInt(4); });
+  for (int u = 0; u < 20; u++)
+  {
+    auto& inner = cm.GetOrInsert("uri" + to_string(u));
+    for (int key = 0; key < u; key++)
+      inner[key].ref_to_value = u * key;
+  }
+  cm.SaveSnapshot(path);
+
+  // registered maps are filled in place, missing ones built
+  cmap_nested_fold loaded([] { return cMapInt(2); });
+  loaded.GetOrInsert("uri3")[100].ref_to_value = 1;
+  loaded.LoadSnapshot(path);
+  ASSERT_EQUAL(20u, loaded.Size());
+  ASSERT_EQUAL(0u, loaded.At("uri0").Count());
+  ASSERT_EQUAL(4u, loaded.At("uri3").Count());
+  ASSERT_EQUAL(19 * 18, loaded.At("uri19").At(18).ref_to_value);
+
+  cmap_nested_fold no_factory;
+  bool thrown = false;
+  try {
+    no_factory.LoadSnapshot(path);
+  } catch (const logic_error&) {
+    thrown = true;
+  }
+  ASSERT(thrown);
+  filesystem::remove(path);
+}
+
+int main() {
+  TestRunner tr;
+  RUN_TEST(tr, TestSimple);
+  RUN_TEST(tr, TestGetOrInsert);
+  RUN_TEST(tr, TestGrowKeepsReferences);
+  RUN_TEST(tr, TestHeterogeneousLookup);
+  RUN_TEST(tr, TestResolveHandle);
+  RUN_TEST(tr, TestConcurrentOne2One);
+  RUN_TEST(tr, TestConcurrentOne2Many);
+  RUN_TEST(tr, TestConcurrentDynamic);
+  RUN_TEST(tr, TestConcurrentArena);
+  RUN_TEST(tr, TestBoundedInner);
+  RUN_TEST(tr, TestSnapshotFile);
+  return 0;
+}
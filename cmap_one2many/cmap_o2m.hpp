@@ -10,131 +10,648 @@
 #include <utility>
 #include <algorithm>
 #include <random>
+#include <shared_mutex>
+#include <optional>
+
+#include "../utils/shard_lock.h"
+#include "../utils/flat_combining.h"
+#include "../utils/flat_map.h"
+#include "../utils/hot_keys.h"
+#include "../utils/lock_stats.h"
+#include "../utils/persist.h"
+#include "../utils/pmr_storage.h"
+#include "../utils/batch.h"
+#include "../utils/cache.h"
+#include "../utils/sharding.h"
+#include "../utils/snapshot.h"
+#include "../utils/trace.h"
+#include "../utils/visit.h"
+#include "../utils/write_combining.h"
 using namespace std;
 
 namespace cmap_o2m
 {
 
-void logMutexMapId(size_t mapId, size_t mutexId)
+// Traces which mutex handles which map, see cmap_common::Tracer.
+inline void logMutexMapId(cmap_common::TraceOp op, size_t mapId, size_t mutexId)
 {
-  stringstream ss;
-  ss << "Hello, I am mutex " << mutexId << " and I am handling map" << mapId << "\n";
-  cout << ss.str();
+  cmap_common::Tracer::Instance().Record(op, mapId, mutexId);
 }
 
-template <typename K, typename V, typename Hash = std::hash<K>>
+template <
+  typename K,
+  typename V,
+  typename Hash = std::hash<K>,
+  typename Mutex = mutex,
+  typename Storage = cmap_common::NodeStorage,
+  typename Sharding = cmap_common::RuntimeSharding>
 class ConcurrentMap {
 public:
   using MapType = unordered_map<K, V, Hash>;
+  using ShardMap = typename Storage::template Map<K, V, Hash>;
+  using SnapshotView = cmap_common::MapSnapshot<K, V, Hash, ShardMap, Sharding>;
+  using WriteGuard = cmap_common::WriteGuard<Mutex>;
+  using ReadGuard = cmap_common::ReadGuard<Mutex>;
 
   struct WriteAccess {
-    WriteAccess(const K& key, mutex& m, MapType& mp) :
+    WriteAccess(const K& key, Mutex& m, ShardMap& mp, cmap_common::SeqLock* seq) :
     guard(m),
+    window(seq),
     ref_to_value(mp[key])
     {}
 
-    lock_guard<mutex> guard;
+    WriteGuard guard;
+    cmap_common::SeqLock::WriteWindow window;
     V& ref_to_value;
   };
 
   struct ReadAccess {
-    ReadAccess(const K& key, mutex& m, const MapType& mp) :
+    ReadAccess(const K& key, Mutex& m, const ShardMap& mp) :
     guard(m),
     ref_to_value(mp.at(key))
     {}
 
-    lock_guard<mutex> guard;
+    ReadGuard guard;
     const V& ref_to_value;
   };
 
   struct ValuePresence {
-    ValuePresence(const K& key, mutex& m, const MapType& mp) :
+    ValuePresence(const K& key, Mutex& m, const ShardMap& mp) :
     guard(m),
     presence(mp.count(key))
     {}
 
-    lock_guard<mutex> guard;
+    ReadGuard guard;
     const bool presence;
   };
 
+private:
+  // Map and sequence counter of one index on their own cache lines; the
+  // mutexes, shared between maps, are padded apart in mutexes_.
+  struct alignas(cmap_common::kCacheLineSize) Shard {
+    cmap_common::SeqLock seqlock;
+    ShardMap map;
+  };
+
+public:
+  // bucket_count maps sharing mutex_number mutexes (RuntimeSharding)
+  template <typename S = Sharding, enable_if_t<!S::kFixed, int> = 0>
   explicit ConcurrentMap(
     size_t bucket_count,
     size_t mutex_number,
     bool log_flag = true
   ) :
-  buckets_(bucket_count),
-  map_collection_(bucket_count),
+  sharding_(bucket_count, mutex_number),
+  shards_(bucket_count),
   mutexes_(mutex_number),
   log_(log_flag)
   {}
 
+  // Sharding::Shards() maps sharing Sharding::Mutexes() mutexes
+  // (FixedSharding)
+  template <typename S = Sharding, enable_if_t<S::kFixed, int> = 0>
+  explicit ConcurrentMap(bool log_flag = true) :
+  shards_(Sharding::Shards()),
+  mutexes_(Sharding::Mutexes()),
+  log_(log_flag)
+  {}
+
   WriteAccess operator[](const K& key)
   {
-    size_t index = hasher_(key) % buckets_;
+    size_t index = IndexOf(key);
 
     // LOGGER
     if (log_)
-      logMutexMapId(index, ComputeIndexOfMutex(index));
+      logMutexMapId(cmap_common::TraceOp::Write, index, ComputeIndexOfMutex(index));
 
     return WriteAccess(
       key,
-      mutexes_[ComputeIndexOfMutex(index)],
-      map_collection_[index]
+      MutexOf(index),
+      shards_[index].map,
+      SeqLockOf(shards_[index])
     );
   }
 
   ReadAccess At(const K& key) const
   {
-    size_t index = hasher_(key) % buckets_;
+    size_t index = IndexOf(key);
 
     // LOGGER
     if (log_)
-      logMutexMapId(index, ComputeIndexOfMutex(index));
+      logMutexMapId(cmap_common::TraceOp::Read, index, ComputeIndexOfMutex(index));
 
     return ReadAccess(
       key,
-      mutexes_[ComputeIndexOfMutex(index)],
-      map_collection_[index]
+      MutexOf(index),
+      shards_[index].map
     );
   }
 
   bool Has(const K& key) const
   {
-    size_t index = hasher_(key) % buckets_;
+    size_t index = IndexOf(key);
 
     // LOGGER
     if (log_)
-      logMutexMapId(index, ComputeIndexOfMutex(index));
+      logMutexMapId(cmap_common::TraceOp::Has, index, ComputeIndexOfMutex(index));
 
     return ValuePresence(
       key,
-      mutexes_[ComputeIndexOfMutex(index)],
-      map_collection_[index]
+      MutexOf(index),
+      shards_[index].map
     ).presence;
   }
 
+  // Copy of the value under key. With OptimisticFlatStorage it is read
+  // without taking the mutex and validated by the map's sequence counter;
+  // with hot keys enabled, keys the calling thread reads most are served
+  // from its replicas (see EnableHotKeys); otherwise it is read under the
+  // mutex. With write combining, the deltas the calling thread has
+  // pending for key are added.
+  optional<V> Get(const K& key) const
+  {
+    if constexpr (cmap_common::is_combinable<V>::value) {
+      if (combiner_)
+        return combiner_->Read(key, [&] { return FlushedGet(key); });
+    }
+    return FlushedGet(key);
+  }
+
+  // Lets Get serve the keys each thread reads most from thread-local
+  // copies, validated against the version of their map (see
+  // cmap_common::HotKeyReplicas); call it before the map is shared. Every
+  // write then bumps the version of its map.
+  void EnableHotKeys(cmap_common::HotKeys options = {})
+  {
+    static_assert(!Storage::kOptimisticReads, "ConcurrentMap::EnableHotKeys: Get takes no lock anyway");
+    hot_keys_ = options;
+    map_id_ = cmap_common::NextMapId();
+  }
+
+  // Makes Accumulate add through per-thread buffers that are applied to
+  // the maps in batches (see cmap_common::WriteCombiner); call it before
+  // the map is shared. Get then adds the calling thread's pending deltas.
+  void EnableWriteCombining(cmap_common::WriteCombining options = {})
+  {
+    static_assert(cmap_common::is_combinable<V>::value, "ConcurrentMap::EnableWriteCombining needs V += V");
+    combiner_ = make_unique<Combiner>(options);
+  }
+
+  // Adds delta to the value under key, inserting V() first when missing,
+  // like FetchAdd. With write combining the addition waits in the calling
+  // thread's buffer until it is flushed; otherwise it is a FetchAdd.
+  void Accumulate(const K& key, V delta)
+  {
+    if (combiner_)
+      combiner_->Add(key, delta, ApplyDeltas());
+    else
+      FetchAdd(key, delta);
+  }
+
+  // Applies the deltas every thread has pending (write combining only).
+  void Flush()
+  {
+    if (combiner_)
+      combiner_->Flush(ApplyDeltas());
+  }
+
+  // Calls fn(value) under the map's mutex if key is present; missing keys
+  // are not inserted. Returns whether fn was called.
+  template <typename Fn>
+  bool Update(const K& key, Fn fn)
+  {
+    size_t index = IndexOf(key);
+    ShardMap& mp = shards_[index].map;
+    return cmap_common::RunExclusive(MutexOf(index), [&] {
+      const auto it = mp.find(key);
+      if (it == mp.end())
+        return false;
+      cmap_common::SeqLock::WriteWindow window(SeqLockOf(shards_[index]));
+      fn(it->second);
+      return true;
+    });
+  }
+
+  // Removes key (not with FlatStorage). Returns whether it was present.
+  bool Erase(const K& key)
+  {
+    size_t index = IndexOf(key);
+    return cmap_common::RunExclusive(MutexOf(index), [&] {
+      cmap_common::SeqLock::WriteWindow window(SeqLockOf(shards_[index]));
+      return shards_[index].map.erase(key) != 0;
+    });
+  }
+
+  // Inserts init if key is missing, otherwise calls fn(value).
+  // Returns whether init was inserted.
+  template <typename Fn>
+  bool UpsertWith(const K& key, const V& init, Fn fn)
+  {
+    size_t index = IndexOf(key);
+    ShardMap& mp = shards_[index].map;
+    return cmap_common::RunExclusive(MutexOf(index), [&] {
+      cmap_common::SeqLock::WriteWindow window(SeqLockOf(shards_[index]));
+      const auto it = mp.find(key);
+      if (it == mp.end()) {
+        mp[key] = init;
+        return true;
+      }
+      fn(it->second);
+      return false;
+    });
+  }
+
+  // Adds delta to the value under key, inserting V() first when missing,
+  // and returns the previous value, all under one exclusive acquisition
+  // of the map's mutex. With SnapshotStorage a value a snapshot shares is
+  // copied first.
+  V FetchAdd(const K& key, V delta)
+  {
+    static_assert(cmap_common::is_combinable<V>::value, "ConcurrentMap::FetchAdd needs V += V");
+
+    size_t index = IndexOf(key);
+    ShardMap& mp = shards_[index].map;
+    return cmap_common::RunExclusive(MutexOf(index), [&] {
+      cmap_common::SeqLock::WriteWindow window(SeqLockOf(shards_[index]));
+      V& value = mp[key];
+      const V previous = value;
+      value += delta;
+      return previous;
+    });
+  }
+
+  // Batched operations: the keys are grouped by map and every group is
+  // served under a single acquisition of the map's mutex.
+
+  // Values of keys in their order, nullopt for the missing ones.
+  vector<optional<V>> MultiGet(const vector<K>& keys) const
+  {
+    vector<optional<V>> result(keys.size());
+    ForEachGroup(keys.size(), [&](size_t i) -> const K& { return keys[i]; },
+      [&](size_t index, const size_t* first, const size_t* last) {
+        const ShardMap& mp = shards_[index].map;
+        cmap_common::RunShared(MutexOf(index), [&] {
+          cmap_common::ForEachInGroup(mp, first, last,
+            [&](size_t i) -> const K& { return keys[i]; },
+            [&](size_t i) {
+              const auto it = mp.find(keys[i]);
+              if (it != mp.end())
+                result[i] = it->second;
+            });
+        });
+      });
+    return result;
+  }
+
+  // Calls fn(key, value) for every key, inserting missing keys with a
+  // default value like operator[]. A key given twice is visited twice.
+  template <typename Fn>
+  void MultiUpdate(const vector<K>& keys, Fn fn)
+  {
+    ForEachGroup(keys.size(), [&](size_t i) -> const K& { return keys[i]; },
+      [&](size_t index, const size_t* first, const size_t* last) {
+        Shard& shard = shards_[index];
+        cmap_common::RunExclusive(MutexOf(index), [&] {
+          cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+          cmap_common::ForEachInGroup(shard.map, first, last,
+            [&](size_t i) -> const K& { return keys[i]; },
+            [&](size_t i) { fn(keys[i], shard.map[keys[i]]); });
+        });
+      });
+  }
+
+  // Inserts or overwrites every entry; later entries win on equal keys.
+  void InsertBatch(const vector<pair<K, V>>& entries)
+  {
+    ForEachGroup(entries.size(), [&](size_t i) -> const K& { return entries[i].first; },
+      [&](size_t index, const size_t* first, const size_t* last) {
+        Shard& shard = shards_[index];
+        cmap_common::RunExclusive(MutexOf(index), [&] {
+          cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+          cmap_common::ForEachInGroup(shard.map, first, last,
+            [&](size_t i) -> const K& { return entries[i].first; },
+            [&](size_t i) { shard.map[entries[i].first] = entries[i].second; });
+        });
+      });
+  }
+
+  // Visitors: the maps are walked in place, one at a time under their
+  // mutex taken shared, so fn must not call back into the map.
+
+  // Calls fn(map) for every map.
+  template <typename Fn>
+  void ForEachShard(Fn fn) const
+  {
+    for(size_t i = 0; i < sharding_.Shards(); i++){
+      VisitShard(i, fn);
+    }
+  }
+
+  // Calls fn(key, value) for every entry.
+  template <typename Fn>
+  void ForEach(Fn fn) const
+  {
+    ForEachShard([&](const ShardMap& mp) {
+      for (const auto& [key, value] : mp)
+        fn(key, value);
+    });
+  }
+
+  // ForEach with the maps spread over the tasks of executor (see
+  // cmap_common::AsyncExecutor); fn is called concurrently for entries of
+  // different maps.
+  template <typename Executor, typename Fn>
+  void ParallelForEach(const Executor& executor, Fn fn) const
+  {
+    cmap_common::ParallelForIndexes(executor, sharding_.Shards(), [&](size_t i) {
+      VisitShard(i, [&](const ShardMap& mp) {
+        for (const auto& [key, value] : mp)
+          fn(key, value);
+      });
+    });
+  }
+
+  // Folds fn(acc, key, value) over every entry.
+  template <typename T, typename Fn>
+  T Reduce(T init, Fn fn) const
+  {
+    ForEach([&](const K& key, const V& value) { init = fn(move(init), key, value); });
+    return init;
+  }
+
+  // Number of entries, summed map by map.
+  size_t Count() const
+  {
+    size_t count = 0;
+    ForEachShard([&](const ShardMap& mp) { count += mp.size(); });
+    return count;
+  }
+
+  // Number of entries for which pred(key, value) holds.
+  template <typename Pred>
+  size_t Count(Pred pred) const
+  {
+    size_t count = 0;
+    ForEach([&](const K& key, const V& value) { count += pred(key, value) ? 1 : 0; });
+    return count;
+  }
+
+  // Export into an ordinary map, reserved once for every entry instead of
+  // growing insert by insert.
+
+  // Copy of every entry.
   MapType BuildOrdinaryMap() const
   {
     MapType result;
-    for(size_t i = 0; i < buckets_; i++){
-      lock_guard<mutex> lock_guard(mutexes_[ComputeIndexOfMutex(i)]);
-      result.insert(map_collection_[i].begin(), map_collection_[i].end());
-    }
+    result.reserve(Count());
+    ForEachShard([&](const ShardMap& mp) { result.insert(mp.begin(), mp.end()); });
     return result;
   }
 
+  // BuildOrdinaryMap with the maps copied in parallel by the tasks of
+  // executor, each into a staging map of its own, which the calling thread
+  // then splices into the result without copying again.
+  template <typename Executor>
+  MapType BuildOrdinaryMap(const Executor& executor) const
+  {
+    vector<MapType> staged(sharding_.Shards());
+    cmap_common::ParallelForIndexes(executor, staged.size(), [&](size_t i) {
+      VisitShard(i, [&](const ShardMap& mp) {
+        staged[i].reserve(mp.size());
+        staged[i].insert(mp.begin(), mp.end());
+      });
+    });
+    return cmap_common::MergeShards<MapType>(staged);
+  }
+
+  // Empties the map and returns its shard maps, moved out without
+  // copying an entry. Writers racing with it land either in a returned
+  // map or in the emptied one. Not offered with OptimisticFlatStorage,
+  // whose lock-free readers may still be probing the maps moved out.
+  vector<ShardMap> ExtractShards()
+  {
+    static_assert(!Storage::kOptimisticReads,
+                  "ConcurrentMap::ExtractShards: lock-free readers may still probe the shards");
+    vector<ShardMap> shards;
+    shards.reserve(sharding_.Shards());
+    for(size_t i = 0; i < sharding_.Shards(); i++){
+      WriteGuard guard(MutexOf(i));
+      cmap_common::SeqLock::WriteWindow window(SeqLockOf(shards_[i]));
+      shards.push_back(exchange(shards_[i].map, ShardMap()));
+    }
+    return shards;
+  }
+
+  // Empties the map into an ordinary one. With NodeStorage the nodes are
+  // spliced over, so no entry is copied.
+  MapType ExtractOrdinaryMap()
+  {
+    vector<ShardMap> shards = ExtractShards();
+    return cmap_common::MergeShards<MapType>(shards);
+  }
+
+  // Hits, misses and evictions summed over the maps (BoundedStorage only).
+  cmap_common::CacheCounters CacheStats() const
+  {
+    static_assert(cmap_common::is_bounded<Storage>::value,
+                  "ConcurrentMap::CacheStats needs BoundedStorage");
+
+    cmap_common::CacheCounters counters;
+    ForEachShard([&](const ShardMap& mp) { counters += mp.Counters(); });
+    return counters;
+  }
+
+  // Entry count of every map and lock counters of every mutex
+  // (InstrumentedMutex only). The counters are read on the fly; the entry
+  // counts are taken under the mutexes, so those acquisitions show in the
+  // next call.
+  cmap_common::MapStats Stats() const
+  {
+    static_assert(cmap_common::is_instrumented<Mutex>::value,
+                  "ConcurrentMap::Stats needs an InstrumentedMutex");
+
+    cmap_common::MapStats stats;
+    for (const auto& m : mutexes_)
+      stats.mutexes.push_back(m.value.Stats());
+    stats.shards.resize(sharding_.Shards());
+    ForEachShard([&, i = size_t(0)](const ShardMap& mp) mutable {
+      stats.shards[i++].entries = mp.size();
+    });
+    return stats;
+  }
+
+  // Writes every entry to path in the snapshot file format (see
+  // cmap_common::MappedSnapshot), one section per map. The maps are
+  // encoded in parallel by the tasks of executor, each under its lock,
+  // and written in parallel; the file is synced under a temporary name
+  // and then renamed over path, so a crash while saving leaves the
+  // previous snapshot in place. Throws runtime_error on I/O errors.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void SaveSnapshot(const string& path, const Executor& executor = Executor()) const
+  {
+    vector<cmap_common::EncodedSection> sections(sharding_.Shards());
+    cmap_common::ParallelForIndexes(executor, sections.size(), [&](size_t i) {
+      VisitShard(i, [&](const ShardMap& mp) { cmap_common::EncodeEntries<K, V>(sections[i], mp); });
+    });
+    cmap_common::WriteSnapshotFile<K, V>(path, sections, executor);
+  }
+
+  // Inserts every entry SaveSnapshot wrote to path, overwriting equal
+  // keys. The file is mapped and its sections are decoded straight from
+  // the mapping in parallel by the tasks of executor, each inserted as one
+  // InsertBatch; with the map count it was saved with, every section
+  // fills exactly one map. Throws runtime_error when path holds no
+  // snapshot of K and V.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void LoadSnapshot(const string& path, const Executor& executor = Executor())
+  {
+    const cmap_common::MappedSnapshot snapshot(path);
+    snapshot.Expect<K, V>();
+    cmap_common::ParallelForIndexes(executor, snapshot.Sections(), [&](size_t i) {
+      InsertBatch(snapshot.Decode<K, V>(i));
+    });
+  }
+
+  // Point-in-time view of every entry (SnapshotStorage only), taken in
+  // O(maps): every mutex is held shared at once, but only while the
+  // current map versions are shared. Writers afterwards copy a map they
+  // touch while the snapshot still holds it.
+  SnapshotView Snapshot() const
+  {
+    static_assert(Storage::kSnapshots, "ConcurrentMap::Snapshot needs SnapshotStorage");
+
+    vector<shared_ptr<const typename SnapshotView::Map>> versions;
+    versions.reserve(sharding_.Shards());
+    for (auto& m : mutexes_)
+      cmap_common::Lock<false>(m.value);
+    auto unlock_all = [&] {
+      for (auto& m : mutexes_)
+        cmap_common::Unlock<false>(m.value);
+    };
+    try {
+      for (const Shard& shard : shards_)
+        versions.push_back(shard.map.Share());
+    } catch (...) {
+      unlock_all();
+      throw;
+    }
+    unlock_all();
+    return SnapshotView(sharding_, hasher_, move(versions));
+  }
+
+
 private:
   Hash hasher_;
 
-  size_t buckets_;
-  vector<MapType> map_collection_;
-  mutable vector<mutex> mutexes_;
+  Sharding sharding_;
+  vector<Shard> shards_;
+  mutable vector<cmap_common::CacheAligned<Mutex>> mutexes_;
 
   bool log_;
 
+  // disabled until EnableHotKeys()
+  cmap_common::HotKeys hot_keys_{0};
+  uint64_t map_id_ = 0;
+
+  using Combiner = cmap_common::WriteCombiner<K, V, Hash>;
+  // null until EnableWriteCombining()
+  unique_ptr<Combiner> combiner_;
+
+  using Replicas = cmap_common::HotKeyReplicas<K, V, Hash>;
+
+  // Get without the deltas pending in write combining buffers.
+  optional<V> FlushedGet(const K& key) const
+  {
+    const size_t hash = hasher_(key);
+    size_t index = sharding_.ShardOf(hash);
+    const Shard& shard = shards_[index];
+    const ShardMap& mp = shard.map;
+    auto locked_get = [&] {
+      return cmap_common::RunShared(MutexOf(index), [&] {
+        const auto it = mp.find(key);
+        return typename Replicas::LockedValue{
+          it != mp.end() ? optional<V>(it->second) : nullopt,
+          &shard.seqlock,
+          shard.seqlock.Version()};
+      });
+    };
+
+    if constexpr (Storage::kOptimisticReads) {
+      return shard.seqlock.ReadOptimistic(
+        [&] { return mp.OptimisticFind(key); },
+        [&] { return locked_get().value; });
+    } else {
+      if (hot_keys_.sample_every == 0)
+        return locked_get().value;
+      return Replicas::Local().Read(map_id_, hot_keys_, key, hash, shard.seqlock, locked_get);
+    }
+  }
+
+  // Adds a flushed buffer of deltas to the maps, every map locked once.
+  auto ApplyDeltas()
+  {
+    return [this](const typename Combiner::Deltas& deltas) {
+      vector<K> keys;
+      keys.reserve(deltas.size());
+      for (const auto& entry : deltas)
+        keys.push_back(entry.first);
+      MultiUpdate(keys, [&deltas](const K& key, V& value) { value += deltas.at(key); });
+    };
+  }
+
+  size_t IndexOf(const K& key) const
+  {
+    return sharding_.ShardOf(hasher_(key));
+  }
+
+  template <typename KeyAt, typename Group>
+  void ForEachGroup(size_t count, KeyAt key_at, Group group) const
+  {
+    cmap_common::ForEachShardGroup(count, sharding_.Shards(),
+      [&](size_t i) { return IndexOf(key_at(i)); },
+      group,
+      [&](size_t index) { cmap_common::PrefetchObject(shards_[index]); });
+  }
+
+  template <typename Fn>
+  void VisitShard(size_t index, Fn&& fn) const
+  {
+    ReadGuard guard(MutexOf(index));
+    fn(as_const(shards_[index].map));
+  }
+
+  // Writers keep the sequence counter for optimistic readers and for
+  // hot key replicas.
+  cmap_common::SeqLock* SeqLockOf(Shard& shard) const
+  {
+    return Storage::kOptimisticReads || hot_keys_.sample_every != 0 ? &shard.seqlock : nullptr;
+  }
+
+  Mutex& MutexOf(size_t indexOfMap) const
+  {
+    return mutexes_[ComputeIndexOfMutex(indexOfMap)].value;
+  }
+
   const size_t ComputeIndexOfMutex(size_t indexOfMap) const
   {
-    return indexOfMap + 1 <= mutexes_.size() ? indexOfMap : (indexOfMap + 1) % mutexes_.size() - 1;
+    return sharding_.MutexOf(indexOfMap);
   }
 };
+
+// At()/Has() take the mutex shared, operator[] exclusively.
+template <typename K, typename V, typename Hash = std::hash<K>>
+using ReadMostlyConcurrentMap = ConcurrentMap<K, V, Hash, shared_mutex>;
+
+// Update, UpsertWith, Erase, FetchAdd, Get and the batches hand their
+// critical sections to the thread holding the mutex, which runs them
+// all (see cmap_common::FlatCombiningMutex); for a few hot maps shared
+// by many threads.
+template <typename K, typename V, typename Hash = std::hash<K>>
+using CombiningConcurrentMap = ConcurrentMap<K, V, Hash, cmap_common::FlatCombiningMutex>;
+
+// ShardCount maps sharing MutexCount mutexes, both powers of two, indexed
+// by masks instead of divisions.
+template <typename K, typename V, size_t ShardCount, size_t MutexCount, typename Hash = std::hash<K>>
+using FixedConcurrentMap = ConcurrentMap<K, V, Hash, mutex, cmap_common::NodeStorage,
+                                         cmap_common::FixedSharding<ShardCount, MutexCount>>;
 }
\ No newline at end of file
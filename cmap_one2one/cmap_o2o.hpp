@@ -7,86 +7,939 @@
 #include <utility>
 #include <algorithm>
 #include <random>
+#include <shared_mutex>
+#include <optional>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "../utils/shard_lock.h"
+#include "../utils/flat_map.h"
+#include "../utils/hot_keys.h"
+#include "../utils/lock_stats.h"
+#include "../utils/persist.h"
+#include "../utils/pmr_storage.h"
+#include "../utils/batch.h"
+#include "../utils/cache.h"
+#include "../utils/sharding.h"
+#include "../utils/snapshot.h"
+#include "../utils/visit.h"
+#include "../utils/wal.h"
+#include "../utils/write_combining.h"
 using namespace std;
 
 namespace cmap_one2one 
 {
 
-template <typename K, typename V, typename Hash = std::hash<K>>
+// Thresholds that make a ConcurrentMap double its shard count by itself
+// (RuntimeSharding only); a zero disables a threshold.
+struct AutoResize {
+  // entries a writer finds in its shard
+  size_t max_shard_size = 0;
+  // acquisitions of one shard lock that found it taken
+  size_t max_contended_locks = 0;
+  // no automatic growth beyond this many shards
+  size_t max_shard_count = 1 << 16;
+};
+
+// The shard count can change while the map is in use, see Resize(). The
+// shards live in a table; a resize links a table with the new shard count
+// behind the current one and every operation then migrates one shard of
+// the old table into it before doing its own work. An operation whose
+// shard was migrated follows on to the next table. Once every shard moved
+// the next table becomes the current one. No operation ever waits for
+// more than one shard to migrate.
+//
+// Replaced tables are not freed, as racing operations may still hold
+// them; they are released with the map. Their shards are emptied, except
+// with OptimisticFlatStorage, where lock-free readers may still probe them.
+template <
+  typename K,
+  typename V,
+  typename Hash = std::hash<K>,
+  typename Mutex = mutex,
+  typename Storage = cmap_common::NodeStorage,
+  typename Sharding = cmap_common::RuntimeSharding>
 class ConcurrentMap {
 public:
   using MapType = unordered_map<K, V, Hash>;
+  using ShardMap = typename Storage::template Map<K, V, Hash>;
+  using SnapshotView = cmap_common::MapSnapshot<K, V, Hash, ShardMap, Sharding>;
+  using WriteGuard = cmap_common::WriteGuard<Mutex>;
+  using ReadGuard = cmap_common::ReadGuard<Mutex>;
+  using Wal = cmap_common::WriteAheadLog<K, V, Hash>;
 
+  // The access objects adopt a shard lock that is already held.
+
+  // With a write-ahead log the final value is logged under the lock and
+  // the write waits for its commit once the lock is released; neither
+  // throws, a failed log reports to the next write.
   struct WriteAccess {
-    WriteAccess(const K& key, mutex& m, MapType& mp) :
-    guard(m),
-    ref_to_value(mp[key])
+    WriteAccess(const K& key, Mutex& m, ShardMap& mp, cmap_common::SeqLock* seq, Wal* wal) :
+    wal_wait(wal),
+    guard(m, adopt_lock),
+    window(seq),
+    ref_to_value(mp[key]),
+    wal_put(wal, key, ref_to_value, wal_wait)
     {}
 
-    lock_guard<mutex> guard;
+    cmap_common::WalWait<Wal> wal_wait;
+    WriteGuard guard;
+    cmap_common::SeqLock::WriteWindow window;
     V& ref_to_value;
+    cmap_common::WalPutOnExit<Wal> wal_put;
   };
 
   struct ReadAccess {
-    ReadAccess(const K& key, mutex& m, const MapType& mp) :
-    guard(m),
+    ReadAccess(const K& key, Mutex& m, const ShardMap& mp) :
+    guard(m, adopt_lock),
     ref_to_value(mp.at(key))
     {}
 
-    lock_guard<mutex> guard;
+    ReadGuard guard;
     const V& ref_to_value;
   };
 
   struct ValuePresence {
-    ValuePresence(const K& key, mutex& m, const MapType& mp) :
-    guard(m),
+    ValuePresence(const K& key, Mutex& m, const ShardMap& mp) :
+    guard(m, adopt_lock),
     presence(mp.count(key))
     {}
 
-    lock_guard<mutex> guard;
+    ReadGuard guard;
     const bool presence;
   };
 
-  explicit ConcurrentMap(size_t bucket_count) :
-  buckets_(bucket_count),
-  map_collection_(bucket_count),
-  mutexes_(bucket_count)
+private:
+  // Everything one operation touches sits on the shard's own cache
+  // lines, and no two shards share one.
+  struct alignas(cmap_common::kCacheLineSize) Shard {
+    mutable Mutex mutex;
+    cmap_common::SeqLock seqlock;
+    ShardMap map;
+    // set once a resize moved the entries on
+    atomic<bool> migrated{false};
+    // acquisitions that found the lock taken
+    atomic<size_t> contended{0};
+  };
+
+  struct Table {
+    explicit Table(const Sharding& s) :
+    sharding(s),
+    shards(s.Shards())
+    {}
+
+    Sharding sharding;
+    vector<Shard> shards;
+
+    // set when a resize starts
+    atomic<Table*> next{nullptr};
+    // shards handed out to migrating operations, and shards migrated
+    atomic<size_t> claimed{0};
+    atomic<size_t> migrated{0};
+  };
+
+public:
+  // bucket_count shards (RuntimeSharding)
+  template <typename S = Sharding, enable_if_t<!S::kFixed, int> = 0>
+  explicit ConcurrentMap(size_t bucket_count, AutoResize auto_resize = {}) :
+  auto_resize_(auto_resize)
+  {
+    table_.store(AddTable(Sharding(bucket_count, bucket_count)));
+  }
+
+  // Sharding::Shards() shards (FixedSharding)
+  template <typename S = Sharding, enable_if_t<S::kFixed, int> = 0>
+  ConcurrentMap()
+  {
+    table_.store(AddTable(Sharding()));
+  }
+
+  // a map is only moved before it is shared
+  ConcurrentMap(ConcurrentMap&& other) noexcept :
+  hasher_(move(other.hasher_)),
+  auto_resize_(other.auto_resize_),
+  hot_keys_(other.hot_keys_),
+  map_id_(other.map_id_),
+  combiner_(move(other.combiner_)),
+  wal_(move(other.wal_)),
+  tables_(move(other.tables_)),
+  table_(other.table_.exchange(nullptr))
   {}
 
+  ConcurrentMap& operator=(ConcurrentMap&& other) noexcept
+  {
+    if (this != &other) {
+      hasher_ = move(other.hasher_);
+      auto_resize_ = other.auto_resize_;
+      hot_keys_ = other.hot_keys_;
+      map_id_ = other.map_id_;
+      combiner_ = move(other.combiner_);
+      wal_ = move(other.wal_);
+      tables_ = move(other.tables_);
+      table_.store(other.table_.exchange(nullptr));
+    }
+    return *this;
+  }
+
   WriteAccess operator[](const K& key)
   {
-    size_t index = hasher_(key) % buckets_;
-    return WriteAccess(key, mutexes_[index], map_collection_[index]);
+    Shard& shard = LockShardOf<true>(key);
+    return WriteAccess(key, shard.mutex, shard.map, SeqLockOf(shard), wal_.get());
   }
 
   ReadAccess At(const K& key) const
   {
-    size_t index = hasher_(key) % buckets_;
-    return ReadAccess(key, mutexes_[index], map_collection_[index]);
+    const Shard& shard = LockShardOf<false>(key);
+    return ReadAccess(key, shard.mutex, shard.map);
   }
 
   bool Has(const K& key) const
   {
-    size_t index = hasher_(key) % buckets_;
-    return ValuePresence(key, mutexes_[index], map_collection_[index]).presence;
+    const Shard& shard = LockShardOf<false>(key);
+    return ValuePresence(key, shard.mutex, shard.map).presence;
+  }
+
+  // Copy of the value under key. With OptimisticFlatStorage it is read
+  // without taking the shard lock and validated by the shard's sequence
+  // counter; with hot keys enabled, keys the calling thread reads most
+  // are served from its replicas (see EnableHotKeys); otherwise it is
+  // read under the shard lock. With write combining, the deltas the
+  // calling thread has pending for key are added.
+  optional<V> Get(const K& key) const
+  {
+    if constexpr (cmap_common::is_combinable<V>::value) {
+      if (combiner_)
+        return combiner_->Read(key, [&] { return FlushedGet(key); });
+    }
+    return FlushedGet(key);
+  }
+
+  // Lets Get serve the keys each thread reads most from thread-local
+  // copies, validated against the version of their shard (see
+  // cmap_common::HotKeyReplicas); call it before the map is shared. Every
+  // write then bumps the version of its shard.
+  void EnableHotKeys(cmap_common::HotKeys options = {})
+  {
+    static_assert(!Storage::kOptimisticReads, "ConcurrentMap::EnableHotKeys: Get takes no lock anyway");
+    hot_keys_ = options;
+    map_id_ = cmap_common::NextMapId();
+  }
+
+  // Makes Accumulate add through per-thread buffers that are applied to
+  // the shards in batches (see cmap_common::WriteCombiner); call it before
+  // the map is shared. Get then adds the calling thread's pending deltas.
+  void EnableWriteCombining(cmap_common::WriteCombining options = {})
+  {
+    static_assert(cmap_common::is_combinable<V>::value, "ConcurrentMap::EnableWriteCombining needs V += V");
+    combiner_ = make_unique<Combiner>(options);
+  }
+
+  // Logs every write ahead to the file at path (see
+  // cmap_common::WriteAheadLog), after replaying the writes it already
+  // holds into the map; call it before the map is shared, and after
+  // LoadSnapshot if the log continues a snapshot. operator[], Update,
+  // UpsertWith, Erase, FetchAdd, the batched writes and ExtractShards log
+  // under the shard lock and wait for the group commit, as long as
+  // options.durability asks, after releasing it. Once the log failed, the
+  // writes throw its error, except operator[], which logs from the
+  // destructor of its WriteAccess and leaves the error to the next write
+  // or SyncWal(). Throws runtime_error when path cannot be opened.
+  void EnableWal(const string& path, cmap_common::WalOptions options = {})
+  {
+    wal_.reset();
+    wal_ = make_unique<Wal>(path, options, [this](cmap_common::WalOp op, K&& key, optional<V>&& value) {
+      if (op == cmap_common::WalOp::Put)
+        (*this)[key].ref_to_value = move(*value);
+      else
+        Erase(key);
+    });
+  }
+
+  // Returns once every write so far is synced to the log (write-ahead
+  // log only). Throws the error of a failed log.
+  void SyncWal()
+  {
+    if (wal_)
+      wal_->Sync();
+  }
+
+  // Group commits of the write-ahead log so far, 0 without one.
+  uint64_t WalCommits() const
+  {
+    return wal_ ? wal_->Commits() : 0;
+  }
+
+  // Adds delta to the value under key, inserting V() first when missing,
+  // like FetchAdd. With write combining the addition waits in the calling
+  // thread's buffer until it is flushed; otherwise it is a FetchAdd.
+  void Accumulate(const K& key, V delta)
+  {
+    if (combiner_)
+      combiner_->Add(key, delta, ApplyDeltas());
+    else
+      FetchAdd(key, delta);
+  }
+
+  // Applies the deltas every thread has pending (write combining only).
+  void Flush()
+  {
+    if (combiner_)
+      combiner_->Flush(ApplyDeltas());
   }
 
+  // Calls fn(value) under the shard lock if key is present; missing keys
+  // are not inserted. Returns whether fn was called.
+  template <typename Fn>
+  bool Update(const K& key, Fn fn)
+  {
+    cmap_common::WalWait<Wal> wal_wait(wal_.get());
+    Shard& shard = LockShardOf<true>(key);
+    WriteGuard guard(shard.mutex, adopt_lock);
+    const auto it = shard.map.find(key);
+    if (it == shard.map.end())
+      return false;
+    cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+    fn(it->second);
+    if (wal_)
+      wal_wait.Hand(wal_->Put(key, it->second));
+    return true;
+  }
+
+  // Removes key (not with FlatStorage). Returns whether it was present.
+  bool Erase(const K& key)
+  {
+    cmap_common::WalWait<Wal> wal_wait(wal_.get());
+    Shard& shard = LockShardOf<true>(key);
+    WriteGuard guard(shard.mutex, adopt_lock);
+    cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+    const bool erased = shard.map.erase(key) != 0;
+    if (erased && wal_)
+      wal_wait.Hand(wal_->Erase(key));
+    return erased;
+  }
+
+  // Inserts init if key is missing, otherwise calls fn(value).
+  // Returns whether init was inserted.
+  template <typename Fn>
+  bool UpsertWith(const K& key, const V& init, Fn fn)
+  {
+    cmap_common::WalWait<Wal> wal_wait(wal_.get());
+    Shard& shard = LockShardOf<true>(key);
+    WriteGuard guard(shard.mutex, adopt_lock);
+    cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+    const auto it = shard.map.find(key);
+    const bool inserted = it == shard.map.end();
+    V& value = inserted ? (shard.map[key] = init) : it->second;
+    if (!inserted)
+      fn(value);
+    if (wal_)
+      wal_wait.Hand(wal_->Put(key, value));
+    return inserted;
+  }
+
+  // Adds delta to the value under key, inserting V() first when missing,
+  // and returns the previous value, all under one exclusive acquisition
+  // of the shard lock. With SnapshotStorage a value a snapshot shares is
+  // copied first.
+  V FetchAdd(const K& key, V delta)
+  {
+    static_assert(cmap_common::is_combinable<V>::value, "ConcurrentMap::FetchAdd needs V += V");
+
+    cmap_common::WalWait<Wal> wal_wait(wal_.get());
+    Shard& shard = LockShardOf<true>(key);
+    WriteGuard guard(shard.mutex, adopt_lock);
+    cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+    V& value = shard.map[key];
+    const V previous = value;
+    value += delta;
+    if (wal_)
+      wal_wait.Hand(wal_->Put(key, value));
+    return previous;
+  }
+
+  // Batched operations: the keys are grouped by shard and every group is
+  // served under a single acquisition of its shard lock.
+
+  // Values of keys in their order, nullopt for the missing ones.
+  vector<optional<V>> MultiGet(const vector<K>& keys) const
+  {
+    vector<optional<V>> result(keys.size());
+    ForEachGroup<false>(keys.size(), [&](size_t i) -> const K& { return keys[i]; },
+      [&](const Shard& shard, const size_t* first, const size_t* last) {
+        cmap_common::ForEachInGroup(shard.map, first, last,
+          [&](size_t i) -> const K& { return keys[i]; },
+          [&](size_t i) {
+            const auto it = shard.map.find(keys[i]);
+            if (it != shard.map.end())
+              result[i] = it->second;
+          });
+      });
+    return result;
+  }
+
+  // Calls fn(key, value) for every key, inserting missing keys with a
+  // default value like operator[]. A key given twice is visited twice.
+  template <typename Fn>
+  void MultiUpdate(const vector<K>& keys, Fn fn)
+  {
+    cmap_common::WalWait<Wal> wal_wait(wal_.get());
+    ForEachGroup<true>(keys.size(), [&](size_t i) -> const K& { return keys[i]; },
+      [&](Shard& shard, const size_t* first, const size_t* last) {
+        cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+        cmap_common::ForEachInGroup(shard.map, first, last,
+          [&](size_t i) -> const K& { return keys[i]; },
+          [&](size_t i) {
+            V& value = shard.map[keys[i]];
+            fn(keys[i], value);
+            if (wal_)
+              wal_wait.Hand(wal_->Put(keys[i], value));
+          });
+      });
+  }
+
+  // Inserts or overwrites every entry; later entries win on equal keys.
+  void InsertBatch(const vector<pair<K, V>>& entries)
+  {
+    cmap_common::WalWait<Wal> wal_wait(wal_.get());
+    ForEachGroup<true>(entries.size(), [&](size_t i) -> const K& { return entries[i].first; },
+      [&](Shard& shard, const size_t* first, const size_t* last) {
+        cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+        cmap_common::ForEachInGroup(shard.map, first, last,
+          [&](size_t i) -> const K& { return entries[i].first; },
+          [&](size_t i) {
+            shard.map[entries[i].first] = entries[i].second;
+            if (wal_)
+              wal_wait.Hand(wal_->Put(entries[i].first, entries[i].second));
+          });
+      });
+  }
+
+  // Visitors: the shards are walked in place, one at a time under their
+  // lock taken shared, so fn must not call back into the map. A resize in
+  // progress is completed first and none starts until the walk is over,
+  // so every entry is seen exactly once; writers keep going meanwhile.
+
+  // Calls fn(map) for every shard map.
+  template <typename Fn>
+  void ForEachShard(Fn fn) const
+  {
+    WithStableTable([&](const Table& table) {
+      for (size_t i = 0; i < table.sharding.Shards(); i++) {
+        ReadGuard guard(table.shards[i].mutex);
+        fn(as_const(table.shards[i].map));
+      }
+    });
+  }
+
+  // Calls fn(key, value) for every entry.
+  template <typename Fn>
+  void ForEach(Fn fn) const
+  {
+    ForEachShard([&](const ShardMap& mp) {
+      for (const auto& [key, value] : mp)
+        fn(key, value);
+    });
+  }
+
+  // ForEach with the shards spread over the tasks of executor (see
+  // cmap_common::AsyncExecutor); fn is called concurrently for entries of
+  // different shards.
+  template <typename Executor, typename Fn>
+  void ParallelForEach(const Executor& executor, Fn fn) const
+  {
+    WithStableTable([&](const Table& table) {
+      cmap_common::ParallelForIndexes(executor, table.sharding.Shards(), [&](size_t i) {
+        ReadGuard guard(table.shards[i].mutex);
+        for (const auto& [key, value] : table.shards[i].map)
+          fn(key, value);
+      });
+    });
+  }
+
+  // Folds fn(acc, key, value) over every entry.
+  template <typename T, typename Fn>
+  T Reduce(T init, Fn fn) const
+  {
+    ForEach([&](const K& key, const V& value) { init = fn(move(init), key, value); });
+    return init;
+  }
+
+  // Number of entries, summed shard by shard.
+  size_t Count() const
+  {
+    size_t count = 0;
+    ForEachShard([&](const ShardMap& mp) { count += mp.size(); });
+    return count;
+  }
+
+  // Number of entries for which pred(key, value) holds.
+  template <typename Pred>
+  size_t Count(Pred pred) const
+  {
+    size_t count = 0;
+    ForEach([&](const K& key, const V& value) { count += pred(key, value) ? 1 : 0; });
+    return count;
+  }
+
+  // Export into an ordinary map, reserved once for every entry instead of
+  // growing insert by insert.
+
+  // Copy of every entry.
   MapType BuildOrdinaryMap() const
   {
     MapType result;
-    for(size_t i = 0; i < buckets_; i++){
-      lock_guard<mutex> lock_guard(mutexes_[i]);
-      result.insert(map_collection_[i].begin(), map_collection_[i].end());
-    }
+    result.reserve(Count());
+    ForEachShard([&](const ShardMap& mp) { result.insert(mp.begin(), mp.end()); });
     return result;
   }
 
+  // BuildOrdinaryMap with the shards copied in parallel by the tasks of
+  // executor, each into a staging map of its own, which the calling thread
+  // then splices into the result without copying again.
+  template <typename Executor>
+  MapType BuildOrdinaryMap(const Executor& executor) const
+  {
+    vector<MapType> staged;
+    WithStableTable([&](const Table& table) {
+      staged.resize(table.sharding.Shards());
+      cmap_common::ParallelForIndexes(executor, staged.size(), [&](size_t i) {
+        ReadGuard guard(table.shards[i].mutex);
+        staged[i].reserve(table.shards[i].map.size());
+        staged[i].insert(table.shards[i].map.begin(), table.shards[i].map.end());
+      });
+    });
+    return cmap_common::MergeShards<MapType>(staged);
+  }
+
+  // Empties the map and returns its shard maps, moved out without
+  // copying an entry. Writers racing with it land either in a returned
+  // map or in the emptied one. Not offered with OptimisticFlatStorage,
+  // whose lock-free readers may still be probing the maps moved out.
+  vector<ShardMap> ExtractShards()
+  {
+    static_assert(!Storage::kOptimisticReads,
+                  "ConcurrentMap::ExtractShards: lock-free readers may still probe the shards");
+    cmap_common::WalWait<Wal> wal_wait(wal_.get());
+    vector<ShardMap> shards;
+    WithStableTable([&](Table& table) {
+      shards.reserve(table.shards.size());
+      for (Shard& shard : table.shards) {
+        WriteGuard guard(shard.mutex);
+        cmap_common::SeqLock::WriteWindow window(SeqLockOf(shard));
+        if (wal_) {
+          for (const auto& entry : shard.map)
+            wal_wait.Hand(wal_->Erase(entry.first));
+        }
+        shards.push_back(exchange(shard.map, ShardMap()));
+      }
+    });
+    return shards;
+  }
+
+  // Empties the map into an ordinary one. With NodeStorage the nodes are
+  // spliced over, so no entry is copied.
+  MapType ExtractOrdinaryMap()
+  {
+    vector<ShardMap> shards = ExtractShards();
+    return cmap_common::MergeShards<MapType>(shards);
+  }
+
+  // Writes every entry to path in the snapshot file format (see
+  // cmap_common::MappedSnapshot), one section per shard. The shards are
+  // encoded in parallel by the tasks of executor, each under its lock
+  // taken shared, and written in parallel; the file is synced under a
+  // temporary name and then renamed over path, so a crash while saving
+  // leaves the previous snapshot in place. Throws runtime_error on I/O
+  // errors.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void SaveSnapshot(const string& path, const Executor& executor = Executor()) const
+  {
+    vector<cmap_common::EncodedSection> sections;
+    WithStableTable([&](const Table& table) {
+      sections.resize(table.sharding.Shards());
+      cmap_common::ParallelForIndexes(executor, sections.size(), [&](size_t i) {
+        ReadGuard guard(table.shards[i].mutex);
+        cmap_common::EncodeEntries<K, V>(sections[i], table.shards[i].map);
+      });
+    });
+    cmap_common::WriteSnapshotFile<K, V>(path, sections, executor);
+  }
+
+  // Inserts every entry SaveSnapshot wrote to path, overwriting equal
+  // keys. The file is mapped and its sections are decoded straight from
+  // the mapping in parallel by the tasks of executor, each inserted as one
+  // InsertBatch; with the shard count it was saved with, every section
+  // fills exactly one shard. Throws runtime_error when path holds no
+  // snapshot of K and V.
+  template <typename Executor = cmap_common::AsyncExecutor>
+  void LoadSnapshot(const string& path, const Executor& executor = Executor())
+  {
+    const cmap_common::MappedSnapshot snapshot(path);
+    snapshot.Expect<K, V>();
+    cmap_common::ParallelForIndexes(executor, snapshot.Sections(), [&](size_t i) {
+      InsertBatch(snapshot.Decode<K, V>(i));
+    });
+  }
+
+  // Point-in-time view of every entry (SnapshotStorage only), taken in
+  // O(shards): every shard lock is held shared at once, but only while the
+  // current shard versions are shared. Writers afterwards copy a shard
+  // they touch while the snapshot still holds it.
+  SnapshotView Snapshot() const
+  {
+    static_assert(Storage::kSnapshots, "ConcurrentMap::Snapshot needs SnapshotStorage");
+
+    optional<SnapshotView> snapshot;
+    WithStableTable([&](const Table& table) {
+      vector<shared_ptr<const typename SnapshotView::Map>> versions;
+      versions.reserve(table.shards.size());
+      for (const Shard& shard : table.shards)
+        cmap_common::Lock<false>(shard.mutex);
+      auto unlock_all = [&] {
+        for (const Shard& shard : table.shards)
+          cmap_common::Unlock<false>(shard.mutex);
+      };
+      try {
+        for (const Shard& shard : table.shards)
+          versions.push_back(shard.map.Share());
+      } catch (...) {
+        unlock_all();
+        throw;
+      }
+      unlock_all();
+      snapshot.emplace(table.sharding, hasher_, move(versions));
+    });
+    return move(*snapshot);
+  }
+
+  // Starts moving the entries into shard_count shards (RuntimeSharding
+  // only) and returns at once; operations finish the migration one shard
+  // at a time. Returns false, doing nothing, while an earlier resize is
+  // still migrating or when shard_count is the current count.
+  bool Resize(size_t shard_count)
+  {
+    static_assert(!Sharding::kFixed, "ConcurrentMap::Resize needs RuntimeSharding");
+    lock_guard<mutex> guard(resize_mutex_);
+    return StartResize(shard_count);
+  }
+
+  // Migrates what is left of a resize in progress on the calling thread,
+  // e.g. a helper thread, and returns once it is complete.
+  void FinishResize()
+  {
+    CompleteResize();
+  }
+
+  // Shard count of the current table; a resize in progress counts once
+  // its migration completed.
+  size_t ShardCount() const
+  {
+    return table_.load(memory_order_acquire)->shards.size();
+  }
+
+  // Hits, misses and evictions summed over the shards (BoundedStorage
+  // only). A resize starts the counters of the new shards from zero.
+  cmap_common::CacheCounters CacheStats() const
+  {
+    static_assert(cmap_common::is_bounded<Storage>::value,
+                  "ConcurrentMap::CacheStats needs BoundedStorage");
+
+    cmap_common::CacheCounters counters;
+    ForEachShard([&](const ShardMap& mp) { counters += mp.Counters(); });
+    return counters;
+  }
+
+  // Lock counters and entry count of every shard (InstrumentedMutex
+  // only). The counters are read on the fly; the entry counts are taken
+  // under the shard locks, so those acquisitions show in the next call.
+  // A resize starts the counters of the new shards from zero.
+  cmap_common::MapStats Stats() const
+  {
+    static_assert(cmap_common::is_instrumented<Mutex>::value,
+                  "ConcurrentMap::Stats needs an InstrumentedMutex");
+
+    cmap_common::MapStats stats;
+    WithStableTable([&](const Table& table) {
+      stats.shards.resize(table.shards.size());
+      for (size_t i = 0; i < table.shards.size(); i++)
+        stats.shards[i].lock = table.shards[i].mutex.Stats();
+      for (size_t i = 0; i < table.shards.size(); i++) {
+        ReadGuard guard(table.shards[i].mutex);
+        stats.shards[i].entries = table.shards[i].map.size();
+      }
+    });
+    return stats;
+  }
+
 private:
+  using Replicas = cmap_common::HotKeyReplicas<K, V, Hash>;
+  using Combiner = cmap_common::WriteCombiner<K, V, Hash>;
+
   Hash hasher_;
+  AutoResize auto_resize_;
+  // disabled until EnableHotKeys()
+  cmap_common::HotKeys hot_keys_{0};
+  uint64_t map_id_ = 0;
+  // null until EnableWriteCombining()
+  unique_ptr<Combiner> combiner_;
+  // null until EnableWal()
+  unique_ptr<Wal> wal_;
+
+  // every table ever linked, guarded by resize_mutex_
+  mutable mutex resize_mutex_;
+  mutable vector<unique_ptr<Table>> tables_;
+  mutable atomic<Table*> table_{nullptr};
+
+  // Get without the deltas pending in write combining buffers.
+  optional<V> FlushedGet(const K& key) const
+  {
+    const size_t hash = hasher_(key);
+    const Table& table = *table_.load(memory_order_acquire);
+    const Shard& shard = table.shards[table.sharding.ShardOf(hash)];
+
+    if constexpr (Storage::kOptimisticReads) {
+      return shard.seqlock.ReadOptimistic(
+        [&] {
+          // a migrated shard is empty, its keys live in the next table
+          return shard.migrated.load(memory_order_relaxed) ? LockedGet(key) : shard.map.OptimisticFind(key);
+        },
+        [&] { return LockedGet(key); });
+    } else {
+      if (hot_keys_.sample_every == 0)
+        return LockedGet(key);
+      return Replicas::Local().Read(map_id_, hot_keys_, key, hash, shard.seqlock, [&] {
+        // a locked shard has no write window open
+        const Shard& locked = LockShardOf<false>(key);
+        ReadGuard guard(locked.mutex, adopt_lock);
+        const auto it = locked.map.find(key);
+        return typename Replicas::LockedValue{
+          it != locked.map.end() ? optional<V>(it->second) : nullopt,
+          &locked.seqlock,
+          locked.seqlock.Version()};
+      });
+    }
+  }
+
+  // Adds a flushed buffer of deltas to the shards, every shard locked
+  // once.
+  auto ApplyDeltas()
+  {
+    return [this](const typename Combiner::Deltas& deltas) {
+      vector<K> keys;
+      keys.reserve(deltas.size());
+      for (const auto& entry : deltas)
+        keys.push_back(entry.first);
+      MultiUpdate(keys, [&deltas](const K& key, V& value) { value += deltas.at(key); });
+    };
+  }
+
+  void CompleteResize() const
+  {
+    for (;;) {
+      Table* table = table_.load(memory_order_acquire);
+      if (table->next.load(memory_order_acquire) == nullptr)
+        return;
+      if (table->claimed.load(memory_order_relaxed) < table->shards.size())
+        HelpResize(table);
+      else
+        this_thread::yield();
+    }
+  }
+
+  // Runs visit(table) on the current table with no resize in progress
+  // and none starting. Automatic resizes only try to take resize_mutex_,
+  // as they run under a shard lock a visitor may be waiting for.
+  template <typename Visit>
+  void WithStableTable(Visit visit) const
+  {
+    lock_guard<mutex> guard(resize_mutex_);
+    CompleteResize();
+    visit(*table_.load(memory_order_acquire));
+  }
 
-  size_t buckets_;
-  vector<MapType> map_collection_;
-  mutable vector<mutex> mutexes_;
+  Table* AddTable(const Sharding& sharding) const
+  {
+    tables_.push_back(make_unique<Table>(sharding));
+    return tables_.back().get();
+  }
+
+  // Locks the shard holding key, exclusively for writers, following it
+  // through the tables a resize migrated it to. Helps a resize in
+  // progress by one shard first.
+  template <bool Exclusive>
+  Shard& LockShardOf(const K& key) const
+  {
+    const size_t hash = hasher_(key);
+    Table* table = table_.load(memory_order_acquire);
+    HelpResize(table);
+    for (;;) {
+      Shard& shard = table->shards[table->sharding.ShardOf(hash)];
+      if (LockUnlessMigrated<Exclusive>(*table, shard))
+        return shard;
+      table = table->next.load(memory_order_acquire);
+    }
+  }
+
+  // Locks shard, or leaves it unlocked and returns false when a resize
+  // migrated it. Contention is only counted, at the price of a try_lock,
+  // when AutoResize watches it.
+  template <bool Exclusive>
+  bool LockUnlessMigrated(const Table& table, Shard& shard) const
+  {
+    bool contended = false;
+    if (auto_resize_.max_contended_locks == 0) {
+      cmap_common::Lock<Exclusive>(shard.mutex);
+    } else if (!cmap_common::TryLock<Exclusive>(shard.mutex)) {
+      contended = true;
+      cmap_common::Lock<Exclusive>(shard.mutex);
+    }
+    if (shard.migrated.load(memory_order_relaxed)) {
+      cmap_common::Unlock<Exclusive>(shard.mutex);
+      return false;
+    }
+
+    if constexpr (!Sharding::kFixed) {
+      if (auto_resize_.max_shard_size != 0 || contended)
+        CheckThresholds(table, shard, Exclusive, contended);
+    }
+    return true;
+  }
+
+  // Starts a resize to twice the shard count when the locked shard is
+  // past an AutoResize threshold.
+  void CheckThresholds(const Table& table, Shard& shard, bool exclusive, bool contended) const
+  {
+    const bool crowded = exclusive && auto_resize_.max_shard_size != 0 &&
+      shard.map.size() >= auto_resize_.max_shard_size;
+    const bool contested = contended &&
+      shard.contended.fetch_add(1, memory_order_relaxed) + 1 >= auto_resize_.max_contended_locks;
+    if ((crowded || contested) &&
+        &table == table_.load(memory_order_relaxed) &&
+        table.next.load(memory_order_relaxed) == nullptr &&
+        table.shards.size() < auto_resize_.max_shard_count) {
+      unique_lock<mutex> guard(resize_mutex_, try_to_lock);
+      if (guard.owns_lock())
+        StartResize(min(table.shards.size() * 2, auto_resize_.max_shard_count));
+    }
+  }
+
+  // resize_mutex_ must be held
+  bool StartResize(size_t shard_count) const
+  {
+    Table* table = table_.load(memory_order_acquire);
+    if (shard_count == 0 || shard_count == table->shards.size() ||
+        table->next.load(memory_order_relaxed) != nullptr)
+      return false;
+
+    table->next.store(AddTable(Sharding(shard_count, shard_count)), memory_order_release);
+    return true;
+  }
+
+  // Migrates the next unclaimed shard of table, if it is being resized.
+  void HelpResize(Table* table) const
+  {
+    if (Table* next = table->next.load(memory_order_acquire))
+      MigrateNext(table, next);
+  }
+
+  // Publishes next after the last shard migrated.
+  void MigrateNext(Table* table, Table* next) const
+  {
+    const size_t index = table->claimed.fetch_add(1, memory_order_relaxed);
+    if (index >= table->shards.size())
+      return;
+
+    Migrate(table->shards[index], *next);
+    if (table->migrated.fetch_add(1, memory_order_acq_rel) + 1 == table->shards.size())
+      table_.store(next, memory_order_release);
+  }
+
+  // Moves the entries of from into the shards of next that own them now.
+  // The targets are locked in index order, so migrations of different
+  // shards into a shared target cannot deadlock. Their sequence counters
+  // stay untouched: optimistic readers only reach the next table once it
+  // is published, and nothing migrates into it after that.
+  void Migrate(Shard& from, Table& next) const
+  {
+    WriteGuard guard(from.mutex);
+    cmap_common::SeqLock::WriteWindow window(SeqLockOf(from));
+
+    vector<size_t> targets;
+    targets.reserve(from.map.size());
+    for (const auto& entry : from.map)
+      targets.push_back(next.sharding.ShardOf(hasher_(entry.first)));
+
+    vector<size_t> order(targets);
+    sort(order.begin(), order.end());
+    order.erase(unique(order.begin(), order.end()), order.end());
+    vector<unique_lock<Mutex>> locks;
+    for (size_t index : order)
+      locks.emplace_back(next.shards[index].mutex);
+
+    size_t i = 0;
+    for (auto& entry : from.map)
+      next.shards[targets[i++]].map[entry.first] = move(entry.second);
+
+    // optimistic readers may still be probing the old map, so with
+    // OptimisticFlatStorage it is kept, unused, until the map goes
+    if constexpr (!Storage::kOptimisticReads)
+      from.map = ShardMap();
+    from.migrated.store(true, memory_order_relaxed);
+  }
+
+  optional<V> LockedGet(const K& key) const
+  {
+    const Shard& shard = LockShardOf<false>(key);
+    ReadGuard guard(shard.mutex, adopt_lock);
+    const auto it = shard.map.find(key);
+    return it != shard.map.end() ? optional<V>(it->second) : nullopt;
+  }
+
+  // Runs group(shard, first, last) for the keys of each shard of the
+  // current table with the shard locked. A group whose shard migrated in
+  // the meantime is served one key at a time.
+  template <bool Exclusive, typename KeyAt, typename Group>
+  void ForEachGroup(size_t count, KeyAt key_at, Group group) const
+  {
+    using Guard = cmap_common::Guard<Exclusive, Mutex>;
+
+    Table* table = table_.load(memory_order_acquire);
+    HelpResize(table);
+    cmap_common::ForEachShardGroup(count, table->sharding.Shards(),
+      [&](size_t i) { return table->sharding.ShardOf(hasher_(key_at(i))); },
+      [&](size_t index, const size_t* first, const size_t* last) {
+        Shard& shard = table->shards[index];
+        if (LockUnlessMigrated<Exclusive>(*table, shard)) {
+          Guard guard(shard.mutex, adopt_lock);
+          group(shard, first, last);
+          return;
+        }
+        for (const size_t* it = first; it != last; ++it) {
+          Shard& moved = LockShardOf<Exclusive>(key_at(*it));
+          Guard guard(moved.mutex, adopt_lock);
+          group(moved, it, it + 1);
+        }
+      },
+      [&](size_t index) { cmap_common::PrefetchObject(table->shards[index]); });
+  }
+
+  // Writers keep the sequence counter for optimistic readers and for
+  // hot key replicas.
+  cmap_common::SeqLock* SeqLockOf(Shard& shard) const
+  {
+    return Storage::kOptimisticReads || hot_keys_.sample_every != 0 ? &shard.seqlock : nullptr;
+  }
 };
 
+// At()/Has() take the shard lock shared, operator[] exclusively.
+template <typename K, typename V, typename Hash = std::hash<K>>
+using ReadMostlyConcurrentMap = ConcurrentMap<K, V, Hash, shared_mutex>;
+
+// ShardCount shards, a power of two, indexed by a mask instead of a
+// division; default constructible.
+template <typename K, typename V, size_t ShardCount, typename Hash = std::hash<K>>
+using FixedConcurrentMap = ConcurrentMap<K, V, Hash, mutex, cmap_common::NodeStorage,
+                                         cmap_common::FixedSharding<ShardCount>>;
+
 }
\ No newline at end of file
@@ -1,11 +1,18 @@
 #include "cmap_o2o.hpp"
+#include "../cmap_nested/cmap_nested.hpp"
 
 #include "../utils/test_runner.h"
 #include "../utils/profile.h"
 
+#include <cstddef>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+
 using uri = std::string;
 using cMapInt = cmap_one2one::ConcurrentMap<int, int>;
 using cmap_fold = unordered_map<uri, class cmap_one2one::ConcurrentMap<int, int>>;
+using cmap_nested_fold = cmap_nested::NestedConcurrentMap<uri, int, int>;
 
 void TestSimple()
 {
@@ -19,8 +26,1143 @@ void TestSimple()
   ASSERT_EQUAL(1, testMap.at("one").At(1).ref_to_value);
 }
 
+void TestReadMostly()
+{
+  cmap_one2one::ReadMostlyConcurrentMap<int, int> cm(3);
+  for (int i = 0; i < 100; i++)
+  {
+    cm[i].ref_to_value = i;
+  }
+
+  // a reader holding shard 0 must not block another reader of that shard
+  future<int> reader;
+  {
+    const auto held = cm.At(0);
+    reader = async(std::launch::async, [&cm] { return cm.At(3).ref_to_value; });
+    ASSERT(reader.wait_for(chrono::seconds(5)) == future_status::ready);
+    ASSERT_EQUAL(0, held.ref_to_value);
+  }
+  ASSERT_EQUAL(3, reader.get());
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 10000; i++)
+    {
+      const int key = (i * 7 + seed) % 100;
+      if (i % 10 == 0)
+        cm[key].ref_to_value++;
+      else
+        ASSERT(cm.Has(key));
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  int total = 0;
+  for (auto& [k, v] : cm.BuildOrdinaryMap())
+  {
+    total += v - k;
+  }
+  ASSERT_EQUAL(4000, total);
+}
+
+void TestReaderBiasedMutex()
+{
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, cmap_common::ReaderBiasedMutex> cm(2);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 10000; i++)
+    {
+      cm[i % 10].ref_to_value++;
+      cm.Has(seed);
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  for (int i = 0; i < 10; i++)
+  {
+    ASSERT_EQUAL(4000, cm.At(i).ref_to_value);
+  }
+}
+
+void TestFlatStorage()
+{
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::FlatStorage> cm(3);
+
+  auto kernel = [&cm](int seed)
+  {
+    vector<int> updates(10000);
+    iota(begin(updates), end(updates), -5000);
+    shuffle(begin(updates), end(updates), default_random_engine(seed));
+    for (auto key : updates)
+    {
+      cm[key].ref_to_value++;
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  ASSERT(cm.Has(-5000));
+  ASSERT(!cm.Has(5000));
+  ASSERT_EQUAL(4, cm.At(4999).ref_to_value);
+
+  const auto result = cm.BuildOrdinaryMap();
+  ASSERT_EQUAL(10000u, result.size());
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 4, "Key = " + to_string(k));
+  }
+}
+
+void TestFlatMap()
+{
+  cmap_common::FlatMap<int, int> flat;
+  for (int i = 0; i < 1000; i++)
+  {
+    flat[i * 16] = i;
+  }
+
+  ASSERT_EQUAL(1000u, flat.size());
+  for (int i = 0; i < 1000; i++)
+  {
+    ASSERT_EQUAL(i, flat.at(i * 16));
+    ASSERT_EQUAL(1u, flat.count(i * 16));
+    ASSERT_EQUAL(0u, flat.count(i * 16 + 1));
+  }
+
+  bool thrown = false;
+  try {
+    flat.at(-1);
+  } catch (out_of_range&) {
+    thrown = true;
+  }
+  ASSERT(thrown);
+
+  long long sum = 0;
+  size_t visited = 0;
+  for (auto& [k, v] : flat) {
+    sum += v;
+    visited++;
+    ASSERT_EQUAL(k, v * 16);
+  }
+  ASSERT_EQUAL(1000u, visited);
+  ASSERT_EQUAL(999LL * 1000 / 2, sum);
+}
+
+struct Twin {
+  int first;
+  int second;
+};
+
+void TestOptimisticGet()
+{
+  cmap_one2one::ConcurrentMap<int, Twin, hash<int>, mutex, cmap_common::OptimisticFlatStorage> cm(2);
+  ASSERT(!cm.Get(0).has_value());
+
+  // writers keep growing the shards and rewriting both halves together,
+  // readers must never see a torn or half-inserted value
+  auto writer = [&cm](int seed)
+  {
+    for (int round = 1; round <= 3; round++)
+    {
+      for (int key = seed; key < 20000; key += 2)
+      {
+        auto access = cm[key];
+        access.ref_to_value.first = round;
+        access.ref_to_value.second = round;
+      }
+    }
+  };
+
+  auto reader = [&cm](int seed)
+  {
+    size_t found = 0;
+    for (int i = 0; i < 100000; i++)
+    {
+      const int key = (i * 13 + seed) % 20000;
+      if (const auto value = cm.Get(key))
+      {
+        ASSERT_EQUAL(value->first, value->second);
+        found++;
+      }
+    }
+    return found;
+  };
+
+  vector<future<void>> writers;
+  vector<future<size_t>> readers;
+  for (int i = 0; i < 2; i++)
+  {
+    writers.push_back(async(std::launch::async, writer, i));
+    readers.push_back(async(std::launch::async, reader, i));
+  }
+  for (auto& f : writers)
+  {
+    f.get();
+  }
+  for (auto& f : readers)
+  {
+    f.get();
+  }
+
+  for (int key = 0; key < 20000; key++)
+  {
+    const auto value = cm.Get(key);
+    ASSERT(value.has_value());
+    ASSERT_EQUAL(3, value->first);
+    ASSERT_EQUAL(3, value->second);
+  }
+  ASSERT(!cm.Get(20000).has_value());
+}
+
+void TestBatch()
+{
+  cmap_one2one::ConcurrentMap<int, int> cm(3);
+
+  vector<pair<int, int>> entries;
+  for (int i = 0; i < 500; i++)
+  {
+    entries.push_back({i, i * 10});
+  }
+  entries.push_back({0, -1});
+  cm.InsertBatch(entries);
+
+  ASSERT_EQUAL(-1, cm.At(0).ref_to_value);
+  ASSERT_EQUAL(4990, cm.At(499).ref_to_value);
+
+  const auto values = cm.MultiGet({499, 500, 1, -7, 1});
+  ASSERT_EQUAL(5u, values.size());
+  ASSERT_EQUAL(4990, *values[0]);
+  ASSERT(!values[1].has_value());
+  ASSERT_EQUAL(10, *values[2]);
+  ASSERT(!values[3].has_value());
+  ASSERT_EQUAL(10, *values[4]);
+
+  // concurrent batches with repeated keys, every key bumped once per mention
+  auto kernel = [&cm](int seed)
+  {
+    vector<int> batch;
+    for (int i = 0; i < 300; i++)
+    {
+      batch.push_back(1000 + (i * 7 + seed) % 100);
+    }
+    for (int round = 0; round < 100; round++)
+    {
+      cm.MultiUpdate(batch, [](const int&, int& value) { value++; });
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  vector<int> counters(100);
+  iota(begin(counters), end(counters), 1000);
+  int total = 0;
+  for (const auto& value : cm.MultiGet(counters))
+  {
+    ASSERT(value.has_value());
+    total += *value;
+  }
+  ASSERT_EQUAL(4 * 100 * 300, total);
+}
+
+void TestUpdate()
+{
+  cmap_one2one::ConcurrentMap<int, int> cm(3);
+
+  ASSERT(!cm.Update(1, [](int& value) { value = 10; }));
+  ASSERT(!cm.Has(1));
+
+  ASSERT(cm.UpsertWith(1, 5, [](int& value) { value *= 2; }));
+  ASSERT_EQUAL(5, cm.At(1).ref_to_value);
+  ASSERT(!cm.UpsertWith(1, 5, [](int& value) { value *= 2; }));
+  ASSERT_EQUAL(10, cm.At(1).ref_to_value);
+
+  ASSERT(cm.Update(1, [](int& value) { value++; }));
+  ASSERT_EQUAL(11, cm.At(1).ref_to_value);
+}
+
+void TestFetchAdd()
+{
+  cmap_one2one::ReadMostlyConcurrentMap<int, long> cm(3);
+
+  ASSERT_EQUAL(0l, cm.FetchAdd(7, 3));
+  ASSERT_EQUAL(3l, cm.FetchAdd(7, -1));
+  ASSERT_EQUAL(2l, cm.FetchAdd(7, 0));
+
+  // all threads bump the same counters at once, and no increment is lost
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 20000; i++)
+    {
+      cm.FetchAdd((i + seed) % 50, 1);
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+  {
+    futures.push_back(async(std::launch::async, kernel, i));
+  }
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+
+  long total = 0;
+  for (int key = 0; key < 50; key++)
+  {
+    total += cm.FetchAdd(key, 0);
+  }
+  ASSERT_EQUAL(4l * 20000 + 2, total);
+
+  cmap_one2one::ConcurrentMap<int, double> sums(3);
+  sums.FetchAdd(0, 0.5);
+  ASSERT_EQUAL(0.5, sums.FetchAdd(0, 0.25));
+  ASSERT_EQUAL(0.75, sums.At(0).ref_to_value);
+}
+
+void TestFixedSharding()
+{
+  cmap_one2one::FixedConcurrentMap<int, int, 16> cm;
+
+  vector<pair<int, int>> entries;
+  for (int i = 0; i < 1000; i++)
+  {
+    entries.push_back({i, i * 2});
+  }
+  cm.InsertBatch(entries);
+  cm[1000].ref_to_value = 7;
+  cm.FetchAdd(1, 1);
+
+  const auto ordinary = cm.BuildOrdinaryMap();
+  ASSERT_EQUAL(1001u, ordinary.size());
+  ASSERT_EQUAL(3, ordinary.at(1));
+  ASSERT_EQUAL(7, cm.At(1000).ref_to_value);
+  ASSERT(cm.Has(999));
+  ASSERT(!cm.Has(-1));
+}
+
+void TestShardingPolicies()
+{
+  cmap_common::RuntimeSharding runtime(6, 4);
+  ASSERT_EQUAL(5u, runtime.ShardOf(11));
+  ASSERT_EQUAL(1u, runtime.MutexOf(5));
+
+  // sequential integers, whose std::hash is the identity, spread evenly
+  using Fixed = cmap_common::FixedSharding<16, 4>;
+  vector<int> per_shard(Fixed::Shards());
+  for (size_t key = 0; key < 16000; key++)
+  {
+    const size_t shard = Fixed::ShardOf(hash<size_t>{}(key));
+    ASSERT(shard < Fixed::Shards());
+    per_shard[shard]++;
+  }
+  for (int count : per_shard)
+  {
+    ASSERT(count > 800 && count < 1200);
+  }
+  ASSERT_EQUAL(3u, Fixed::MutexOf(15));
+  ASSERT_EQUAL(0u, cmap_common::FixedSharding<1>::ShardOf(12345));
+}
+
+void TestResize()
+{
+  cmap_one2one::ConcurrentMap<int, int> cm(4);
+  for (int i = 0; i < 1000; i++)
+  {
+    cm[i].ref_to_value = i;
+  }
+
+  ASSERT(cm.Resize(16));
+  ASSERT(!cm.Resize(8));
+  ASSERT_EQUAL(4u, cm.ShardCount());
+
+  // operations keep working while the shards migrate one at a time
+  cm[1000].ref_to_value = 1000;
+  ASSERT_EQUAL(7, cm.At(7).ref_to_value);
+  ASSERT_EQUAL(500, cm.FetchAdd(500, 1));
+  cm.FinishResize();
+  ASSERT_EQUAL(16u, cm.ShardCount());
+
+  ASSERT(cm.Resize(3));
+  cm.FinishResize();
+  ASSERT_EQUAL(3u, cm.ShardCount());
+
+  const auto ordinary = cm.BuildOrdinaryMap();
+  ASSERT_EQUAL(1001u, ordinary.size());
+  for (const auto& [key, value] : ordinary)
+  {
+    ASSERT_EQUAL(key == 500 ? 501 : key, value);
+  }
+}
+
+void TestResizeConcurrent()
+{
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::OptimisticFlatStorage> cm(2);
+
+  auto writer = [&cm](int seed)
+  {
+    vector<int> batch(10);
+    for (int i = 0; i < 20000; i++)
+    {
+      if (i % 100 == 0)
+      {
+        iota(begin(batch), end(batch), (i + seed) % 190);
+        cm.MultiUpdate(batch, [](const int&, int& value) { value++; });
+      }
+      else
+      {
+        cm.FetchAdd((i * 7 + seed) % 200, 1);
+      }
+    }
+  };
+
+  auto resizer = [&cm]()
+  {
+    for (size_t shards : {8, 3, 32, 5, 16})
+    {
+      while (!cm.Resize(shards))
+      {
+        cm.FinishResize();
+      }
+      for (int key = 0; key < 200; key += 13)
+      {
+        cm.Get(key);
+      }
+    }
+  };
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 3; i++)
+  {
+    futures.push_back(async(std::launch::async, writer, i));
+  }
+  futures.push_back(async(std::launch::async, resizer));
+  for (auto& f : futures)
+  {
+    f.get();
+  }
+  cm.FinishResize();
+  ASSERT_EQUAL(16u, cm.ShardCount());
+
+  int total = 0;
+  for (int key = 0; key < 200; key++)
+  {
+    total += cm.Get(key).value_or(0);
+  }
+  ASSERT_EQUAL(3 * (19800 + 200 * 10), total);
+}
+
+void TestAutoResize()
+{
+  cmap_one2one::AutoResize thresholds;
+  thresholds.max_shard_size = 64;
+  thresholds.max_shard_count = 64;
+  cmap_one2one::ConcurrentMap<int, int> cm(2, thresholds);
+
+  for (int i = 0; i < 10000; i++)
+  {
+    cm[i].ref_to_value = -i;
+  }
+  cm.FinishResize();
+
+  ASSERT_EQUAL(64u, cm.ShardCount());
+  const auto ordinary = cm.BuildOrdinaryMap();
+  ASSERT_EQUAL(10000u, ordinary.size());
+  ASSERT_EQUAL(-9999, ordinary.at(9999));
+}
+
+void TestVisitors()
+{
+  cmap_one2one::ConcurrentMap<int, int> cm(4);
+  for (int i = 1; i <= 1000; i++)
+  {
+    cm[i].ref_to_value = i;
+  }
+
+  long sum = 0;
+  cm.ForEach([&sum](const int& key, const int& value) { sum += key + value; });
+  ASSERT_EQUAL(1000l * 1001, sum);
+
+  size_t shards = 0, entries = 0;
+  cm.ForEachShard([&](const auto& mp) { shards++; entries += mp.size(); });
+  ASSERT_EQUAL(4u, shards);
+  ASSERT_EQUAL(1000u, entries);
+
+  ASSERT_EQUAL(1000u, cm.Count());
+  ASSERT_EQUAL(500u, cm.Count([](const int& key, const int&) { return key % 2 == 0; }));
+  ASSERT_EQUAL(1000, cm.Reduce(0, [](int acc, const int&, const int& value) { return max(acc, value); }));
+
+  atomic<long> parallel_sum{0};
+  cm.ParallelForEach(cmap_common::AsyncExecutor(3), [&](const int&, const int& value) { parallel_sum += value; });
+  ASSERT_EQUAL(500500l, parallel_sum.load());
+
+  // the first exception of a task comes back to the caller
+  bool thrown = false;
+  try
+  {
+    cm.ParallelForEach(cmap_common::AsyncExecutor(2), [](const int& key, const int&) {
+      if (key == 77)
+        throw runtime_error("77");
+    });
+  }
+  catch (const runtime_error& e)
+  {
+    thrown = string(e.what()) == "77";
+  }
+  ASSERT(thrown);
+}
+
+void TestVisitDuringResize()
+{
+  cmap_one2one::ConcurrentMap<int, int> cm(2);
+  for (int i = 0; i < 5000; i++)
+  {
+    cm[i].ref_to_value = 1;
+  }
+
+  // a walk completes a resize in progress first and sees every entry once
+  ASSERT(cm.Resize(16));
+  ASSERT_EQUAL(5000u, cm.Count());
+  ASSERT_EQUAL(16u, cm.ShardCount());
+
+  atomic<bool> done{false};
+  auto resizer = async(std::launch::async, [&]
+  {
+    for (size_t shards = 3; !done; shards = shards % 40 + 3)
+    {
+      cm.Resize(shards);
+      this_thread::yield();
+    }
+  });
+  for (int round = 0; round < 20; round++)
+  {
+    ASSERT_EQUAL(5000, cm.Reduce(0, [](int acc, const int&, const int& value) { return acc + value; }));
+  }
+  done = true;
+  resizer.get();
+}
+
+void TestExport()
+{
+  cmap_one2one::ConcurrentMap<int, string> cm(4);
+  unordered_map<int, string> expected;
+  for (int i = 0; i < 1000; i++)
+  {
+    cm[i].ref_to_value = to_string(i);
+    expected[i] = to_string(i);
+  }
+
+  ASSERT(cm.BuildOrdinaryMap() == expected);
+  ASSERT(cm.BuildOrdinaryMap(cmap_common::AsyncExecutor(3)) == expected);
+
+  // moving out empties the map, which stays usable
+  ASSERT(cm.ExtractOrdinaryMap() == expected);
+  ASSERT_EQUAL(0u, cm.Count());
+  cm[5].ref_to_value = "five";
+  const auto shards = cm.ExtractShards();
+  ASSERT_EQUAL(4u, shards.size());
+  size_t entries = 0;
+  for (const auto& mp : shards)
+    entries += mp.size();
+  ASSERT_EQUAL(1u, entries);
+  ASSERT(!cm.Has(5));
+
+  // entries of FlatMap shards are moved over one by one
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::FlatStorage> flat(4);
+  for (int i = 0; i < 100; i++)
+    flat[i].ref_to_value = i * i;
+  const auto flat_copy = flat.BuildOrdinaryMap(cmap_common::AsyncExecutor(2));
+  const auto flat_moved = flat.ExtractOrdinaryMap();
+  ASSERT_EQUAL(100u, flat_moved.size());
+  ASSERT(flat_copy == flat_moved);
+  ASSERT_EQUAL(81, flat_moved.at(9));
+  ASSERT_EQUAL(0u, flat.Count());
+}
+
+void TestSnapshot()
+{
+  using cmap_common::SnapshotStorage;
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, SnapshotStorage<>> cm(4);
+  for (int i = 0; i < 1000; i++)
+    cm[i].ref_to_value = i;
+
+  const auto snapshot = cm.Snapshot();
+  for (int i = 0; i < 1000; i++)
+    cm[i].ref_to_value = -i;
+  cm[1000].ref_to_value = 1000;
+  cm.FetchAdd(7, 100);
+  cm.Resize(8);
+  cm.FinishResize();
+
+  // writes after the snapshot are not seen by it
+  ASSERT_EQUAL(1000u, snapshot.Size());
+  ASSERT_EQUAL(5, snapshot.Get(5).value());
+  ASSERT_EQUAL(7, snapshot.At(7));
+  ASSERT(!snapshot.Has(1000));
+  ASSERT(!snapshot.Get(1000));
+  long sum = 0;
+  snapshot.ForEach([&](const int&, const int& value) { sum += value; });
+  ASSERT_EQUAL(499500l, sum);
+  ASSERT_EQUAL(1000u, snapshot.BuildOrdinaryMap().size());
+
+  const auto later = cm.Snapshot();
+  ASSERT_EQUAL(1001u, later.Size());
+  ASSERT_EQUAL(93, later.Get(7).value());
+  ASSERT_EQUAL(-5, later.Get(5).value());
+
+  // FlatMap shards, written in rounds by one thread: a consistent view
+  // sees round r on a prefix of the keys and round r - 1 on the rest
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, SnapshotStorage<cmap_common::FlatStorage>> rounds(4);
+  const int key_count = 200;
+  for (int k = 0; k < key_count; k++)
+    rounds[k].ref_to_value = 0;
+
+  atomic<bool> done{false};
+  auto writer = async(launch::async, [&] {
+    for (int r = 1; r <= 300; r++)
+      for (int k = 0; k < key_count; k++)
+        rounds[k].ref_to_value = r;
+    done = true;
+  });
+  size_t consistent = 0, taken = 0;
+  while (!done || taken == 0)
+  {
+    const auto view = rounds.Snapshot();
+    const int first = view.Get(0).value();
+    int k = 0;
+    while (k < key_count && view.Get(k).value() == first)
+      k++;
+    while (k < key_count && view.Get(k).value() == first - 1)
+      k++;
+    consistent += k == key_count;
+    taken++;
+  }
+  writer.get();
+  ASSERT_EQUAL(taken, consistent);
+}
+
+template <typename Storage>
+void RunPmrStorage()
+{
+  cmap_one2one::ConcurrentMap<int, string, hash<int>, mutex, Storage> cm(3);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int key = seed * 1000; key < (seed + 1) * 1000; key++)
+      cm[key].ref_to_value = to_string(key);
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+
+  // migration moves the entries between the resources of the shards
+  ASSERT(cm.Resize(8));
+  cm.FinishResize();
+  ASSERT_EQUAL(4000u, cm.Count());
+  ASSERT_EQUAL(string("3999"), cm.At(3999).ref_to_value);
+
+  const auto extracted = cm.ExtractOrdinaryMap();
+  ASSERT_EQUAL(4000u, extracted.size());
+  ASSERT_EQUAL(string("17"), extracted.at(17));
+  cm[1].ref_to_value = "one";
+  ASSERT_EQUAL(1u, cm.Count());
+}
+
+void TestPmrStorage()
+{
+  RunPmrStorage<cmap_common::PoolStorage>();
+  RunPmrStorage<cmap_common::ArenaStorage>();
+
+  // copies on write take a resource of their own
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex,
+                              cmap_common::SnapshotStorage<cmap_common::PoolStorage>> cm(2);
+  cm[1].ref_to_value = 1;
+  const auto snapshot = cm.Snapshot();
+  cm[1].ref_to_value = 2;
+  ASSERT_EQUAL(1, snapshot.At(1));
+  ASSERT_EQUAL(2, cm.At(1).ref_to_value);
+}
+
+void TestStats()
+{
+  using Instrumented = cmap_common::InstrumentedMutex<shared_mutex>;
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, Instrumented> cm(4);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int key = 0; key < 1000; key++)
+    {
+      cm[(key + seed * 250) % 1000].ref_to_value++;
+      cm.Has(key);
+    }
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+
+  const auto stats = cm.Stats();
+  ASSERT_EQUAL(4u, stats.shards.size());
+  ASSERT_EQUAL(0u, stats.mutexes.size());
+
+  size_t entries = 0;
+  uint64_t acquisitions = 0, contended = 0, waits = 0, hold_samples = 0;
+  auto add = [&](const cmap_common::LockCounters& c) {
+    acquisitions += c.acquisitions;
+    contended += c.contended;
+    hold_samples += c.hold_samples;
+    for (auto n : c.wait_histogram)
+      waits += n;
+  };
+  for (const auto& shard : stats.shards)
+  {
+    entries += shard.entries;
+    add(shard.lock);
+  }
+  for (const auto& m : stats.mutexes)
+    add(m);
+  ASSERT_EQUAL(1000u, entries);
+  // every operation is counted once on the lock it went through
+  ASSERT(acquisitions >= 8000u);
+  ASSERT_EQUAL(contended, waits);
+  ASSERT(hold_samples > 0);
+
+  ostringstream json;
+  json << stats;
+  ASSERT(json.str().rfind("{\"shards\": [{\"entries\": ", 0) == 0);
+}
+
+void TestProfiler()
+{
+  cmap_one2one::ConcurrentMap<int, int> cm(4);
+
+  auto kernel = [&cm](int seed)
+  {
+    for (int key = 0; key < 1000; key++)
+    {
+      LOG_DURATION("TestProfiler: operator[]");
+      cm[(key + seed * 250) % 1000].ref_to_value++;
+    }
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+  {
+    LogDuration duration("TestProfiler: sleep");
+    this_thread::sleep_for(chrono::milliseconds(2));
+  }
+
+  auto& profiler = Profiler::Instance();
+  const auto summaries = profiler.Summaries();
+  auto find = [&summaries](const string& name) {
+    return find_if(summaries.begin(), summaries.end(),
+                   [&name](const auto& s) { return s.name == name; });
+  };
+
+  const auto op = find("TestProfiler: operator[]");
+  ASSERT(op != summaries.end());
+  ASSERT_EQUAL(4000u, op->count);
+  ASSERT(op->min_ns <= op->p50_ns);
+  ASSERT(op->p50_ns <= op->p99_ns);
+  ASSERT(op->p99_ns <= op->p999_ns);
+  ASSERT(op->p999_ns <= op->max_ns);
+  ASSERT(op->min_ns * op->count <= op->total_ns);
+
+  const auto sleep = find("TestProfiler: sleep");
+  ASSERT(sleep != summaries.end());
+  ASSERT_EQUAL(1u, sleep->count);
+  // within the histogram's and the calibration's error
+  ASSERT(sleep->p50_ns > 1.5e6);
+  ASSERT(sleep->max_ns > 1.8e6);
+
+  ostringstream out;
+  profiler.Dump(out);
+  ASSERT(out.str().find("TestProfiler: operator[]: count=4000 ") != string::npos);
+
+  // nothing left for the dump at exit
+  profiler.Reset();
+  ASSERT(profiler.Summaries().empty());
+}
+
+void TestBoundedCache()
+{
+  // one shard of 8 entries, so the clock hand is predictable
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, mutex, cmap_common::BoundedStorage<8>> cm(1);
+  for (int key = 0; key < 8; key++)
+    cm[key].ref_to_value = key;
+  ASSERT_EQUAL(8u, cm.Count());
+
+  // a full sweep clears every reference bit and evicts the oldest key
+  cm[8].ref_to_value = 8;
+  ASSERT(!cm.Has(0));
+  // keys looked up since survive the next sweep, 4 is the first that was not
+  ASSERT(cm.Has(1) && cm.Has(2) && cm.Has(3));
+  cm[9].ref_to_value = 9;
+  ASSERT(!cm.Has(4));
+  ASSERT(cm.Has(1) && cm.Has(2) && cm.Has(3));
+  ASSERT_EQUAL(8u, cm.Count());
+
+  ASSERT(cm.Erase(9));
+  ASSERT(!cm.Erase(9));
+  // the erased slot is reused before anything is evicted
+  cm[10].ref_to_value = 10;
+  ASSERT_EQUAL(8u, cm.Count());
+  ASSERT_EQUAL(10, cm.At(10).ref_to_value);
+
+  auto counters = cm.CacheStats();
+  ASSERT_EQUAL(2u, counters.evictions);
+  // hits: Has of 1-3 twice, At(10); misses: Has(0), Has(4)
+  ASSERT_EQUAL(7u, counters.hits);
+  ASSERT_EQUAL(2u, counters.misses);
+
+  // a cache in front of a slower store: look up, fill on a miss, both
+  // under one lock so that every miss inserts exactly one entry
+  cmap_one2one::ConcurrentMap<int, int, hash<int>, shared_mutex, cmap_common::BoundedStorage<64>> cache(4);
+  auto kernel = [&cache](int seed)
+  {
+    for (int i = 0; i < 5000; i++)
+    {
+      const int key = (i * 7 + seed) % 1000;
+      cache.UpsertWith(key, key, [key](int& value) { ASSERT_EQUAL(key, value); });
+    }
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+
+  counters = cache.CacheStats();
+  ASSERT_EQUAL(20000u, counters.hits + counters.misses);
+  ASSERT(cache.Count() <= 4u * 64);
+  // every miss filled a key, and all but the keys still held were evicted
+  ASSERT_EQUAL(counters.misses, counters.evictions + cache.Count());
+  ASSERT(counters.HitRate() < 1.0);
+  cache.ForEach([](const int& key, const int& value) { ASSERT_EQUAL(key, value); });
+}
+
+void TestHotKeys()
+{
+  using Replicas = cmap_common::HotKeyReplicas<int, int, hash<int>>;
+  cmap_one2one::ReadMostlyConcurrentMap<int, int> cm(4);
+  cm.EnableHotKeys({1, 2});
+  for (int key = 0; key < 100; key++)
+    cm[key].ref_to_value = key;
+
+  const uint64_t hits = Replicas::Local().Hits();
+  for (int i = 0; i < 10; i++)
+    ASSERT_EQUAL(7, *cm.Get(7));
+  ASSERT(Replicas::Local().Hits() > hits);
+
+  // every kind of write to the shard invalidates the replica
+  cm[7].ref_to_value = 70;
+  ASSERT_EQUAL(70, *cm.Get(7));
+  ASSERT_EQUAL(70, cm.FetchAdd(7, 1));
+  ASSERT_EQUAL(71, *cm.Get(7));
+  ASSERT(cm.Update(7, [](int& value) { value = 72; }));
+  ASSERT_EQUAL(72, *cm.Get(7));
+  cm.Resize(8);
+  ASSERT_EQUAL(72, *cm.Get(7));
+  cm.MultiUpdate({7}, [](const int&, int& value) { value = 73; });
+  ASSERT_EQUAL(73, *cm.Get(7));
+  ASSERT(cm.Erase(7));
+  ASSERT(!cm.Get(7).has_value());
+  ASSERT(!cm.Get(7).has_value());
+
+  // readers of a hot counter never see it go back, and mostly skip the lock
+  auto reader = [&cm]
+  {
+    const uint64_t before = Replicas::Local().Hits();
+    int last = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+      const int value = *cm.Get(0);
+      ASSERT(value >= last);
+      last = value;
+      cm.Get(i % 100);
+    }
+    return Replicas::Local().Hits() - before;
+  };
+  vector<future<uint64_t>> readers;
+  for (int i = 0; i < 3; i++)
+    readers.push_back(async(std::launch::async, reader));
+  for (int i = 0; i < 1000; i++)
+    cm.FetchAdd(0, 1);
+  for (auto& f : readers)
+    ASSERT(f.get() > 0u);
+  ASSERT_EQUAL(1000, *cm.Get(0));
+}
+
+void TestWriteCombining()
+{
+  cmap_one2one::ConcurrentMap<int, long> cm(4);
+  cm.EnableWriteCombining({4, chrono::hours(1)});
+
+  // pending deltas show to the thread that added them only
+  cm.Accumulate(1, 5);
+  cm.Accumulate(1, 2);
+  ASSERT_EQUAL(7, *cm.Get(1));
+  ASSERT(!async(std::launch::async, [&cm] { return cm.Get(1); }).get().has_value());
+  cm.Flush();
+  ASSERT_EQUAL(7, *async(std::launch::async, [&cm] { return cm.Get(1); }).get());
+  ASSERT_EQUAL(7, *cm.Get(1));
+
+  // the fourth pending key flushes the buffer
+  for (int key = 2; key <= 5; key++)
+    cm.Accumulate(key, key);
+  ASSERT_EQUAL(4, *async(std::launch::async, [&cm] { return cm.Get(4); }).get());
+
+  // deltas of exited threads wait for the next Flush
+  auto kernel = [&cm](int seed)
+  {
+    for (int i = 0; i < 10000; i++)
+      cm.Accumulate((i * 7 + seed) % 3 + 10, 1);
+  };
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; i++)
+    futures.push_back(async(std::launch::async, kernel, i));
+  for (auto& f : futures)
+    f.get();
+  cm.Flush();
+  ASSERT_EQUAL(40000, *cm.Get(10) + *cm.Get(11) + *cm.Get(12));
+
+  // without write combining Accumulate adds at once
+  cmap_one2one::ConcurrentMap<int, long> plain(4);
+  plain.Accumulate(1, 3);
+  plain.Flush();
+  ASSERT_EQUAL(3, *async(std::launch::async, [&plain] { return plain.Get(1); }).get());
+}
+
+void TestSnapshotFile()
+{
+  const string path = (filesystem::temp_directory_path() / "cmap_o2o_snapshot.bin").string();
+
+  cmap_one2one::ConcurrentMap<int, long> cm(4);
+  for (int key = 0; key < 1000; key++)
+    cm[key].ref_to_value = key * 3;
+  cm.SaveSnapshot(path);
+  ASSERT(!filesystem::exists(path + ".tmp"));
+
+  // any shard count loads it, overwriting equal keys
+  for (size_t shards : {4, 7})
+  {
+    cmap_one2one::ConcurrentMap<int, long> loaded(shards);
+    loaded[5].ref_to_value = -1;
+    loaded[2000].ref_to_value = 1;
+    loaded.LoadSnapshot(path, cmap_common::AsyncExecutor(2));
+    ASSERT_EQUAL(1001u, loaded.Count());
+    ASSERT_EQUAL(15l, loaded.At(5).ref_to_value);
+    ASSERT_EQUAL(2997l, loaded.At(999).ref_to_value);
+  }
+
+  // strings take a length prefix
+  cmap_one2one::ConcurrentMap<string, string> names(3);
+  names["one"].ref_to_value = "eins";
+  names[""].ref_to_value = string(1000, 'x');
+  names.SaveSnapshot(path);
+  cmap_one2one::ConcurrentMap<string, string> loaded_names(2);
+  loaded_names.LoadSnapshot(path);
+  ASSERT_EQUAL(2u, loaded_names.Count());
+  ASSERT_EQUAL(string("eins"), loaded_names.At("one").ref_to_value);
+  ASSERT_EQUAL(string(1000, 'x'), loaded_names.At("").ref_to_value);
+
+  // other types and other files are refused
+  auto refused = [&path](auto& map) {
+    try {
+      map.LoadSnapshot(path);
+    } catch (const runtime_error&) {
+      return true;
+    }
+    return false;
+  };
+  cmap_one2one::ConcurrentMap<int, long> wrong_types(2);
+  ASSERT(refused(wrong_types));
+  // types of the same size as the saved ones are refused as well
+  cmap_one2one::ConcurrentMap<int, double> longs_as_doubles(2);
+  cmap_one2one::ConcurrentMap<int, long>(2).SaveSnapshot(path);
+  ASSERT(refused(longs_as_doubles));
+  // so are entry counts that do not fit the section's bytes
+  auto corrupt_entries = [&path](uint64_t entries) {
+    fstream file(path, ios::binary | ios::in | ios::out);
+    file.seekp(sizeof(cmap_common::SnapshotHeader) + offsetof(cmap_common::SnapshotSection, entries));
+    file.write(reinterpret_cast<const char*>(&entries), sizeof(entries));
+  };
+  cmap_one2one::ConcurrentMap<int, long> same_types(2);
+  cm.SaveSnapshot(path);
+  corrupt_entries(uint64_t{1} << 60);
+  ASSERT(refused(same_types));
+  names.SaveSnapshot(path);
+  corrupt_entries(uint64_t{1} << 60);
+  ASSERT(refused(loaded_names));
+  ofstream(path, ios::binary | ios::trunc) << "not a snapshot at all, really";
+  ASSERT(refused(wrong_types));
+  filesystem::remove(path);
+  ASSERT(refused(wrong_types));
+}
+
+void TestWal()
+{
+  const string path = (filesystem::temp_directory_path() / "cmap_o2o_wal.log").string();
+  filesystem::remove(path);
+
+  {
+    cmap_one2one::ConcurrentMap<int, long> cm(4);
+    cm.EnableWal(path);
+    cm[1].ref_to_value = 10;
+    cm[1].ref_to_value += 5;
+    cm.Update(1, [](long& value) { value *= 2; });
+    cm.UpsertWith(2, 7, [](long& value) { value++; });
+    cm.UpsertWith(2, 7, [](long& value) { value++; });
+    cm.FetchAdd(3, 4);
+    cm.MultiUpdate({4, 5}, [](int key, long& value) { value = key * 100; });
+    cm.InsertBatch({{6, 60}, {7, 70}});
+    cm.Erase(7);
+    ASSERT(cm.WalCommits() > 0);
+  }
+
+  // a new map replays the log, then keeps appending to it
+  {
+    cmap_one2one::ConcurrentMap<int, long> cm(3);
+    cm.EnableWal(path, {cmap_common::WalDurability::Async});
+    ASSERT_EQUAL(6u, cm.Count());
+    ASSERT_EQUAL(30l, cm.At(1).ref_to_value);
+    ASSERT_EQUAL(8l, cm.At(2).ref_to_value);
+    ASSERT_EQUAL(4l, cm.At(3).ref_to_value);
+    ASSERT_EQUAL(500l, cm.At(5).ref_to_value);
+    ASSERT_EQUAL(60l, cm.At(6).ref_to_value);
+    ASSERT(!cm.Has(7));
+    cm.ExtractShards();
+    cm[8].ref_to_value = 80;
+    cm.SyncWal();
+  }
+
+  // a torn record at the end is cut off, and appends go on behind the rest
+  ofstream(path, ios::binary | ios::app) << "torn";
+  {
+    cmap_one2one::ConcurrentMap<int, long> cm(2);
+    cm.EnableWal(path);
+    ASSERT_EQUAL(1u, cm.Count());
+    ASSERT_EQUAL(80l, cm.At(8).ref_to_value);
+    cm[9].ref_to_value = 90;
+  }
+  {
+    cmap_one2one::ConcurrentMap<int, long> cm(2);
+    cm.EnableWal(path);
+    ASSERT_EQUAL(2u, cm.Count());
+    ASSERT_EQUAL(90l, cm.At(9).ref_to_value);
+  }
+  filesystem::remove(path);
+
+  // concurrent writers share commits, and every key keeps its last write
+  {
+    cmap_one2one::ConcurrentMap<string, int> cm(4);
+    cm.EnableWal(path, {cmap_common::WalDurability::Written});
+    vector<future<void>> writers;
+    for (int t = 0; t < 4; t++) {
+      writers.push_back(async(launch::async, [&cm, t] {
+        for (int i = 0; i < 500; i++)
+          cm[to_string(t) + ":" + to_string(i % 50)].ref_to_value = i;
+      }));
+    }
+    for (auto& writer : writers)
+      writer.get();
+    ASSERT(cm.WalCommits() <= 2000u);
+  }
+  cmap_one2one::ConcurrentMap<string, int> replayed(4);
+  replayed.EnableWal(path);
+  ASSERT_EQUAL(200u, replayed.Count());
+  for (int t = 0; t < 4; t++) {
+    for (int key = 0; key < 50; key++)
+      ASSERT_EQUAL(450 + key, replayed.At(to_string(t) + ":" + to_string(key)).ref_to_value);
+  }
+  filesystem::remove(path);
+
+  // an idle log thread wakes for the next append; a failed log throws
+  // from Put and Sync, while Wait returns
+  {
+    cmap_common::WriteAheadLog<int, long> log(path, {}, [](auto&&...) {});
+    this_thread::sleep_for(chrono::milliseconds(20));
+    log.Wait(log.Put(1, 10));
+    log.Sync();
+    const uint64_t ticket = log.Put(2, 20);
+    log.Fail(make_exception_ptr(runtime_error("disk full")));
+    log.Wait(ticket);
+    auto throws = [](auto fn) {
+      try {
+        fn();
+      } catch (const runtime_error&) {
+        return true;
+      }
+      return false;
+    };
+    ASSERT(throws([&log] { log.Put(3, 30); }));
+    ASSERT(throws([&log] { log.Sync(); }));
+  }
+  filesystem::remove(path);
+
+  // a write that fails (ENOSPC on /dev/full) fails the log, and its
+  // thread parks instead of retrying the requests that cannot be met
+  if (filesystem::exists("/dev/full"))
+  {
+    cmap_one2one::ConcurrentMap<int, long> cm(2);
+    cm.EnableWal("/dev/full");
+    cm[1].ref_to_value = 10;
+    bool thrown = false;
+    try {
+      cm.SyncWal();
+    } catch (const runtime_error&) {
+      thrown = true;
+    }
+    ASSERT(thrown);
+    ASSERT_EQUAL(10l, cm.At(1).ref_to_value);
+
+    const auto cpu_start = clock();
+    this_thread::sleep_for(chrono::milliseconds(200));
+    ASSERT(clock() - cpu_start < CLOCKS_PER_SEC / 20);
+  }
+}
+
 void RunConcurrentUpdates(
-    cmap_fold& cm, size_t thread_count, int key_count
+    cmap_nested_fold& cm, size_t thread_count, int key_count
 )
 {
   auto kernel_inner = [&cm, key_count](int seed)
@@ -32,11 +1174,12 @@ void RunConcurrentUpdates(
 
     for (int j = 0; j < 1000; j++)
     {
+      const auto inner = cm.Resolve(std::to_string(j));
       for (int i = 0; i < 2; ++i)
       {
         for (auto key : updates)
         {
-          cm.at(std::to_string(j))[key].ref_to_value++;
+          (*inner)[key].ref_to_value++;
         }
       }
     }
@@ -52,9 +1195,7 @@ void RunConcurrentUpdates(
 
     for (int j = 1000; j < 1500; j++)
     {
-      cm.insert(
-        {std::to_string(j), cMapInt(thread_count)}
-      );
+      cm.Insert(std::to_string(j), cMapInt(thread_count));
     }
 
     ss << "I am thread " << this_thread::get_id() << "\n";
@@ -80,17 +1221,17 @@ void TestAsync()
   const size_t key_count    = 50000;
   const size_t experiments  = 1000;
 
-  cmap_fold cm;
+  cmap_nested_fold cm;
   for (int i = 0; i < experiments; i++)
   {
-    cm.insert({std::to_string(i), cMapInt(thread_count)});
+    cm.Insert(std::to_string(i), cMapInt(thread_count));
   }
   
   RunConcurrentUpdates(cm, thread_count, key_count);
 
   for (int i = 0; i < experiments; i++)
   {
-    const auto result = std::as_const(cm.at(std::to_string(i))).BuildOrdinaryMap();
+    const auto result = std::as_const(cm.At(std::to_string(i))).BuildOrdinaryMap();
     ASSERT_EQUAL(result.size(), key_count);
 
     for (auto& [k, v] : result) {
@@ -101,7 +1242,7 @@ void TestAsync()
 
   for (int i = experiments; i < experiments+500; i++)
   {
-    const auto result = std::as_const(cm.at(std::to_string(i))).BuildOrdinaryMap();
+    const auto result = std::as_const(cm.At(std::to_string(i))).BuildOrdinaryMap();
     ASSERT_EQUAL(result.size(), 0);
 
     for (auto& [k, v] : result) {
@@ -113,6 +1254,31 @@ void TestAsync()
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestSimple);
+  RUN_TEST(tr, TestReadMostly);
+  RUN_TEST(tr, TestReaderBiasedMutex);
+  RUN_TEST(tr, TestFlatMap);
+  RUN_TEST(tr, TestFlatStorage);
+  RUN_TEST(tr, TestPmrStorage);
+  RUN_TEST(tr, TestBoundedCache);
+  RUN_TEST(tr, TestHotKeys);
+  RUN_TEST(tr, TestWriteCombining);
+  RUN_TEST(tr, TestSnapshotFile);
+  RUN_TEST(tr, TestWal);
+  RUN_TEST(tr, TestOptimisticGet);
+  RUN_TEST(tr, TestBatch);
+  RUN_TEST(tr, TestUpdate);
+  RUN_TEST(tr, TestFetchAdd);
+  RUN_TEST(tr, TestFixedSharding);
+  RUN_TEST(tr, TestShardingPolicies);
+  RUN_TEST(tr, TestResize);
+  RUN_TEST(tr, TestResizeConcurrent);
+  RUN_TEST(tr, TestAutoResize);
+  RUN_TEST(tr, TestVisitors);
+  RUN_TEST(tr, TestVisitDuringResize);
+  RUN_TEST(tr, TestExport);
+  RUN_TEST(tr, TestSnapshot);
+  RUN_TEST(tr, TestStats);
+  RUN_TEST(tr, TestProfiler);
   RUN_TEST(tr, TestAsync);
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,28 @@
+#include "../utils/trace.h"
+
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+// ./bin/main trace.bin, decodes a trace written by cmap_common::Tracer
+// (CMAP_TRACE_FILE=trace.bin) to one text line per record, in time order.
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    cerr << "usage: " << argv[0] << " <trace file>" << endl;
+    return 1;
+  }
+
+  ifstream in(argv[1], ios::binary);
+  if (!in) {
+    cerr << "cannot open " << argv[1] << endl;
+    return 1;
+  }
+  try {
+    cmap_common::DecodeTrace(cmap_common::ReadTrace(in), cout);
+  } catch (const runtime_error& e) {
+    cerr << argv[1] << ": " << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
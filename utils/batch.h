@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Keys looked up ahead of the current one inside a shard group.
+inline constexpr size_t kPrefetchDistance = 4;
+
+template <typename Map, typename K, typename = void>
+struct has_prefetch : false_type {};
+
+template <typename Map, typename K>
+struct has_prefetch<Map, K, void_t<decltype(declval<const Map&>().prefetch(declval<const K&>()))>> : true_type {};
+
+// Prefetches the slot of key where the shard map can tell where it is
+// (FlatMap); node-based maps have nothing worth fetching ahead.
+template <typename Map, typename K>
+void PrefetchKey(const Map& map, const K& key)
+{
+  if constexpr (has_prefetch<Map, K>::value) {
+    map.prefetch(key);
+  }
+}
+
+// Hints the shard object itself into the cache.
+template <typename T>
+void PrefetchObject(const T& object)
+{
+#if defined(__GNUC__)
+  __builtin_prefetch(&object);
+#endif
+}
+
+// Groups the positions 0..key_count-1 of a batch by shard with a counting
+// sort and calls group(shard, first, last) once per shard that got keys,
+// with [first, last) the batch positions in their original order. The
+// shard of the next group is passed to prefetch(shard) before the current
+// group runs, so its lock and map header are warm when it is reached.
+template <typename ShardOf, typename Group, typename Prefetch>
+void ForEachShardGroup(
+  size_t key_count,
+  size_t shard_count,
+  ShardOf shard_of,
+  Group group,
+  Prefetch prefetch
+) {
+  vector<size_t> shard_of_key(key_count);
+  vector<size_t> offsets(shard_count + 1, 0);
+  for (size_t i = 0; i < key_count; i++) {
+    shard_of_key[i] = shard_of(i);
+    offsets[shard_of_key[i] + 1]++;
+  }
+  for (size_t s = 0; s < shard_count; s++) {
+    offsets[s + 1] += offsets[s];
+  }
+
+  vector<size_t> order(key_count);
+  vector<size_t> cursor(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < key_count; i++) {
+    order[cursor[shard_of_key[i]]++] = i;
+  }
+
+  size_t next = 0;
+  while (next < shard_count && offsets[next] == offsets[next + 1]) {
+    next++;
+  }
+  while (next < shard_count) {
+    const size_t current = next++;
+    while (next < shard_count && offsets[next] == offsets[next + 1]) {
+      next++;
+    }
+    if (next < shard_count) {
+      prefetch(next);
+    }
+    group(current, order.data() + offsets[current], order.data() + offsets[current + 1]);
+  }
+}
+
+// Runs fn(position) over one shard group, prefetching the slot of the key
+// kPrefetchDistance positions ahead while the current one is served.
+template <typename Map, typename KeyAt, typename Fn>
+void ForEachInGroup(const Map& map, const size_t* first, const size_t* last, KeyAt key_at, Fn fn)
+{
+  for (const size_t* it = first; it != last; ++it) {
+    if (static_cast<size_t>(last - it) > kPrefetchDistance) {
+      PrefetchKey(map, key_at(it[kPrefetchDistance]));
+    }
+    fn(*it);
+  }
+}
+
+}
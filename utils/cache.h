@@ -0,0 +1,341 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Lookup counters of a bounded map, summed over its shards by
+// ConcurrentMap::CacheStats(). Lookups are At, Has, Get, Update,
+// FetchAdd, MultiGet and the like; inserting writes through operator[]
+// are not, so a miss followed by filling the key counts once.
+struct CacheCounters {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+
+  double HitRate() const
+  {
+    return hits + misses == 0 ? 0 : static_cast<double>(hits) / (hits + misses);
+  }
+
+  CacheCounters& operator+=(const CacheCounters& other)
+  {
+    hits += other.hits;
+    misses += other.misses;
+    evictions += other.evictions;
+    return *this;
+  }
+};
+
+// Shard map of BoundedStorage: holds at most Capacity entries and, when
+// full, makes room for a new key by evicting one picked by CLOCK. Entries
+// sit in slots swept by a clock hand; every lookup sets the slot's
+// reference bit, and the hand clears set bits until it meets a slot whose
+// bit is clear, which it evicts. That approximates LRU with no list to
+// maintain, so eviction only needs the shard lock the insert holds anyway.
+//
+// Lookups may run under the shard lock taken shared: the reference bits
+// and counters are relaxed atomics. Slot storage is reserved in full on
+// the first insert, so references to values stay valid until their entry
+// is erased or evicted. Offers the subset of the unordered_map interface
+// the shards use, plus erase.
+template <typename K, typename V, typename Hash, size_t Capacity>
+class ClockMap {
+  static_assert(Capacity > 0, "ClockMap: Capacity must be positive");
+
+  struct Slot {
+    Slot() = default;
+
+    // only for the vector interface; slots never move, as they are
+    // reserved up front
+    Slot(Slot&& other) :
+    entry(move(other.entry)),
+    referenced(other.referenced.load(memory_order_relaxed))
+    {}
+
+    Slot(const Slot& other) :
+    entry(other.entry),
+    referenced(other.referenced.load(memory_order_relaxed))
+    {}
+
+    optional<pair<const K, V>> entry;
+    mutable atomic<bool> referenced{false};
+  };
+
+public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = pair<const K, V>;
+
+  template <bool Const>
+  class Iterator {
+  public:
+    using SlotT = conditional_t<Const, const Slot, Slot>;
+    using Value = conditional_t<Const, const value_type, value_type>;
+
+    Iterator(SlotT* slot, SlotT* end) :
+    slot_(slot),
+    end_(end)
+    {
+      SkipFree();
+    }
+
+    Value& operator*() const { return *slot_->entry; }
+    Value* operator->() const { return &*slot_->entry; }
+
+    Iterator& operator++()
+    {
+      ++slot_;
+      SkipFree();
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const { return slot_ == other.slot_; }
+    bool operator!=(const Iterator& other) const { return slot_ != other.slot_; }
+
+  private:
+    void SkipFree()
+    {
+      while (slot_ != end_ && !slot_->entry) {
+        ++slot_;
+      }
+    }
+
+    SlotT* slot_;
+    SlotT* end_;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  ClockMap() = default;
+
+  // SnapshotStorage copies shards this way; the counters carry over
+  ClockMap(const ClockMap& other) :
+  index_(other.index_),
+  free_(other.free_),
+  hand_(other.hand_)
+  {
+    if (!other.slots_.empty()) {
+      slots_.reserve(Capacity);
+      for (const Slot& slot : other.slots_) {
+        slots_.push_back(slot);
+      }
+    }
+    CopyCounters(other);
+  }
+
+  ClockMap(ClockMap&& other) noexcept :
+  slots_(move(other.slots_)),
+  index_(move(other.index_)),
+  free_(move(other.free_)),
+  hand_(exchange(other.hand_, 0))
+  {
+    CopyCounters(other);
+  }
+
+  ClockMap& operator=(ClockMap&& other) noexcept
+  {
+    if (this != &other) {
+      slots_ = move(other.slots_);
+      index_ = move(other.index_);
+      free_ = move(other.free_);
+      hand_ = exchange(other.hand_, 0);
+      CopyCounters(other);
+    }
+    return *this;
+  }
+
+  V& operator[](const K& key)
+  {
+    const auto it = index_.find(key);
+    if (it != index_.end()) {
+      Touch(slots_[it->second]);
+      return slots_[it->second].entry->second;
+    }
+
+    const size_t s = FreeSlot();
+    Slot& slot = slots_[s];
+    slot.entry.emplace(piecewise_construct, forward_as_tuple(key), forward_as_tuple());
+    try {
+      index_.emplace(key, s);
+    } catch (...) {
+      slot.entry.reset();
+      free_.push_back(s);
+      throw;
+    }
+    slot.referenced.store(true, memory_order_relaxed);
+    return slot.entry->second;
+  }
+
+  const V& at(const K& key) const { return AtSlot(key).entry->second; }
+  V& at(const K& key) { return const_cast<Slot&>(AtSlot(key)).entry->second; }
+
+  iterator find(const K& key)
+  {
+    const auto it = Lookup(key);
+    return it == index_.end() ? end() : iterator(&slots_[it->second], SlotsEnd());
+  }
+
+  const_iterator find(const K& key) const
+  {
+    const auto it = Lookup(key);
+    return it == index_.end() ? end() : const_iterator(&slots_[it->second], SlotsEnd());
+  }
+
+  size_t count(const K& key) const { return Lookup(key) != index_.end(); }
+  size_t size() const { return index_.size(); }
+  bool empty() const { return index_.empty(); }
+
+  // nothing is ever kept beyond Capacity entries
+  void reserve(size_t count) { index_.reserve(min(count, Capacity)); }
+
+  size_t erase(const K& key)
+  {
+    const auto it = index_.find(key);
+    if (it == index_.end()) {
+      return 0;
+    }
+    Slot& slot = slots_[it->second];
+    slot.entry.reset();
+    slot.referenced.store(false, memory_order_relaxed);
+    free_.push_back(it->second);
+    index_.erase(it);
+    return 1;
+  }
+
+  iterator begin() { return iterator(slots_.data(), SlotsEnd()); }
+  iterator end() { return iterator(SlotsEnd(), SlotsEnd()); }
+  const_iterator begin() const { return const_iterator(slots_.data(), SlotsEnd()); }
+  const_iterator end() const { return const_iterator(SlotsEnd(), SlotsEnd()); }
+
+  CacheCounters Counters() const
+  {
+    CacheCounters counters;
+    counters.hits = hits_.load(memory_order_relaxed);
+    counters.misses = misses_.load(memory_order_relaxed);
+    counters.evictions = evictions_.load(memory_order_relaxed);
+    return counters;
+  }
+
+private:
+  using Index = unordered_map<K, size_t, Hash>;
+
+  Slot* SlotsEnd() { return slots_.data() + slots_.size(); }
+  const Slot* SlotsEnd() const { return slots_.data() + slots_.size(); }
+
+  // the bit is only written when clear, so hot keys do not keep
+  // dirtying their slot
+  static void Touch(const Slot& slot)
+  {
+    if (!slot.referenced.load(memory_order_relaxed)) {
+      slot.referenced.store(true, memory_order_relaxed);
+    }
+  }
+
+  typename Index::const_iterator Lookup(const K& key) const
+  {
+    const auto it = index_.find(key);
+    if (it == index_.end()) {
+      misses_.fetch_add(1, memory_order_relaxed);
+    } else {
+      hits_.fetch_add(1, memory_order_relaxed);
+      Touch(slots_[it->second]);
+    }
+    return it;
+  }
+
+  const Slot& AtSlot(const K& key) const
+  {
+    const auto it = Lookup(key);
+    if (it == index_.end()) {
+      throw out_of_range("ClockMap::at");
+    }
+    return slots_[it->second];
+  }
+
+  // An empty slot for a new entry: one freed by erase, a never used
+  // one, or, when full, the victim of the clock hand.
+  size_t FreeSlot()
+  {
+    if (!free_.empty()) {
+      const size_t s = free_.back();
+      free_.pop_back();
+      return s;
+    }
+    if (slots_.size() < Capacity) {
+      if (slots_.empty()) {
+        slots_.reserve(Capacity);
+      }
+      slots_.emplace_back();
+      return slots_.size() - 1;
+    }
+
+    // full: every slot holds an entry, and the hand finds a clear bit
+    // within one sweep
+    while (true) {
+      const size_t s = hand_;
+      hand_ = (hand_ + 1) % Capacity;
+      Slot& slot = slots_[s];
+      if (slot.referenced.load(memory_order_relaxed)) {
+        slot.referenced.store(false, memory_order_relaxed);
+        continue;
+      }
+      index_.erase(slot.entry->first);
+      slot.entry.reset();
+      evictions_.fetch_add(1, memory_order_relaxed);
+      return s;
+    }
+  }
+
+  void CopyCounters(const ClockMap& other)
+  {
+    hits_.store(other.hits_.load(memory_order_relaxed), memory_order_relaxed);
+    misses_.store(other.misses_.load(memory_order_relaxed), memory_order_relaxed);
+    evictions_.store(other.evictions_.load(memory_order_relaxed), memory_order_relaxed);
+  }
+
+  vector<Slot> slots_;
+  Index index_;
+  // slots emptied by erase
+  vector<size_t> free_;
+  size_t hand_ = 0;
+
+  mutable atomic<uint64_t> hits_{0};
+  mutable atomic<uint64_t> misses_{0};
+  atomic<uint64_t> evictions_{0};
+};
+
+// Storage policy bounding every shard to ShardCapacity entries with CLOCK
+// eviction (see ClockMap), which turns a ConcurrentMap into a cache and
+// enables ConcurrentMap::CacheStats(). The map holds at most ShardCapacity
+// times its shard count entries; a one2one resize raises that bound with
+// the shard count.
+template <size_t ShardCapacity>
+struct BoundedStorage {
+  template <typename K, typename V, typename Hash>
+  using Map = ClockMap<K, V, Hash, ShardCapacity>;
+
+  static constexpr bool kOptimisticReads = false;
+  static constexpr bool kSnapshots = false;
+};
+
+template <typename Storage>
+struct is_bounded : false_type {};
+
+template <size_t ShardCapacity>
+struct is_bounded<BoundedStorage<ShardCapacity>> : true_type {};
+
+}
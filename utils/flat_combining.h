@@ -0,0 +1,239 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "shard_lock.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Shard mutex with flat combining. Besides lock()/unlock(), which
+// operator[] and At() keep using, it offers Run(fn): the thread publishes
+// fn in one of kSlots publication slots and whichever thread gets the
+// lock runs every published critical section in turn, its own included,
+// before letting go. The others only wait for their slot to be served.
+// A hot shard's data and the lock then stay in the combiner's cache
+// instead of moving to every thread that wants them, and waiting threads
+// spin on their own request rather than on the lock word.
+//
+// An uncontended Run runs fn in place, and a thread whose slot is taken
+// by another thread runs fn under the lock itself. Critical sections
+// must not call back into the map.
+class FlatCombiningMutex {
+public:
+  static constexpr size_t kSlots = 64;
+  // rescans of the slots by one combiner, for requests published while
+  // it was running others
+  static constexpr int kPasses = 3;
+  // waits for the lock or for a combiner before yielding the CPU
+  static constexpr int kSpins = 64;
+
+  void lock()
+  {
+    for (int spins = 0; !try_lock(); spins++) {
+      Pause(spins);
+    }
+  }
+
+  bool try_lock()
+  {
+    return !locked_.load(memory_order_relaxed) && !locked_.exchange(true, memory_order_acquire);
+  }
+
+  void unlock()
+  {
+    locked_.store(false, memory_order_release);
+  }
+
+  // Runs fn() with the mutex held, on this thread or on the combiner's,
+  // and returns its result; exceptions reach the caller.
+  template <typename Fn>
+  auto Run(Fn&& fn)
+  {
+    using R = invoke_result_t<Fn&>;
+    if (try_lock()) {
+      // uncontended: run in place, then serve who published meanwhile
+      CombineOnExit combine(*this);
+      return fn();
+    }
+
+    exception_ptr error;
+    if constexpr (is_void_v<R>) {
+      auto task = [&] {
+        try {
+          fn();
+        } catch (...) {
+          error = current_exception();
+        }
+      };
+      Execute(task);
+      if (error) {
+        rethrow_exception(error);
+      }
+    } else {
+      optional<R> result;
+      auto task = [&] {
+        try {
+          result.emplace(fn());
+        } catch (...) {
+          error = current_exception();
+        }
+      };
+      Execute(task);
+      if (error) {
+        rethrow_exception(error);
+      }
+      return move(*result);
+    }
+  }
+
+private:
+  // A published critical section; lives on the publisher's stack until
+  // done is set.
+  struct Request {
+    void (*invoke)(void*);
+    void* task;
+    atomic<bool> done{false};
+  };
+
+  struct alignas(kCacheLineSize) Slot {
+    atomic<Request*> request{nullptr};
+  };
+
+  class CombineOnExit {
+  public:
+    explicit CombineOnExit(FlatCombiningMutex& m) : m_(m) {}
+
+    ~CombineOnExit()
+    {
+      m_.Combine();
+      m_.unlock();
+    }
+
+  private:
+    FlatCombiningMutex& m_;
+  };
+
+  template <typename Task>
+  void Execute(Task& task)
+  {
+    Request request;
+    request.invoke = [](void* t) { (*static_cast<Task*>(t))(); };
+    request.task = &task;
+
+    Slot& slot = slots_[SlotIndex()];
+    Request* expected = nullptr;
+    pending_.fetch_add(1, memory_order_relaxed);
+    if (!slot.request.compare_exchange_strong(expected, &request, memory_order_release, memory_order_relaxed)) {
+      pending_.fetch_sub(1, memory_order_relaxed);
+      lock();
+      task();
+      unlock();
+      return;
+    }
+
+    for (int spins = 0; !request.done.load(memory_order_acquire); spins++) {
+      if (try_lock()) {
+        Combine();
+        unlock();
+        // a combiner that took the request before us may still be on it
+        spins = 0;
+      } else {
+        Pause(spins);
+      }
+    }
+  }
+
+  // Serves the published requests; the lock must be held.
+  void Combine()
+  {
+    for (int pass = 0; pass < kPasses; pass++) {
+      // a request published too late for this check is served by its
+      // own thread once the lock is free
+      if (pending_.load(memory_order_relaxed) == 0) {
+        return;
+      }
+      bool served = false;
+      for (Slot& slot : slots_) {
+        if (slot.request.load(memory_order_relaxed) == nullptr) {
+          continue;
+        }
+        Request* request = slot.request.exchange(nullptr, memory_order_acquire);
+        if (request == nullptr) {
+          continue;
+        }
+        pending_.fetch_sub(1, memory_order_relaxed);
+        request->invoke(request->task);
+        // the publisher may return, destroying request, from here on
+        request->done.store(true, memory_order_release);
+        served = true;
+      }
+      if (!served) {
+        return;
+      }
+    }
+  }
+
+  static void Pause(int spins)
+  {
+    if (spins < kSpins) {
+      CpuRelax();
+    } else {
+      this_thread::yield();
+    }
+  }
+
+  // threads get consecutive slots, so up to kSlots threads never collide
+  static size_t SlotIndex()
+  {
+    static atomic<size_t> next{0};
+    static thread_local const size_t index = next.fetch_add(1, memory_order_relaxed) % kSlots;
+    return index;
+  }
+
+  Slot slots_[kSlots];
+  alignas(kCacheLineSize) atomic<bool> locked_{false};
+  // requests published and not yet taken; spares idle combiners the scan
+  alignas(kCacheLineSize) atomic<size_t> pending_{0};
+};
+
+template <typename M>
+struct is_combining : false_type {};
+
+template <>
+struct is_combining<FlatCombiningMutex> : true_type {};
+
+// Runs fn() holding m exclusively: handed to the combiner of a
+// FlatCombiningMutex, under a WriteGuard otherwise.
+template <typename M, typename Fn>
+auto RunExclusive(M& m, Fn&& fn)
+{
+  if constexpr (is_combining<M>::value) {
+    return m.Run(fn);
+  } else {
+    WriteGuard<M> guard(m);
+    return fn();
+  }
+}
+
+// RunExclusive for readers: under a ReadGuard unless m combines.
+template <typename M, typename Fn>
+auto RunShared(M& m, Fn&& fn)
+{
+  if constexpr (is_combining<M>::value) {
+    return m.Run(fn);
+  } else {
+    ReadGuard<M> guard(m);
+    return fn();
+  }
+}
+
+}
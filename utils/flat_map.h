@@ -0,0 +1,395 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Open-addressing hash map for small trivially copyable keys and values,
+// laid out like a Swiss table: one control byte per slot holds either
+// kEmpty or the low 7 bits of the key hash (H2), and lookups compare a
+// whole group of 16 control bytes against H2 at once (SSE2 when
+// available), touching the slot array only on candidate matches.
+// Entries live inline in one contiguous array, so an insert is no
+// allocation unless the table grows and a lookup chases no pointers.
+//
+// Offers the subset of the unordered_map interface the shards use.
+// References to values are invalidated when the table grows.
+//
+// With OptimisticReads, OptimisticFind() may run concurrently with a
+// writer: a table never changes size once allocated, and tables replaced
+// by growth are retired instead of freed, so a racing reader only ever
+// sees garbage contents, never freed memory. The caller validates the
+// copy it got (see cmap_common::SeqLock). Retired tables add at most the
+// size of the live one and are released with the map.
+template <typename K, typename V, typename Hash = std::hash<K>, bool OptimisticReads = false>
+class FlatMap {
+  static_assert(is_trivially_copyable_v<K> && is_trivially_copyable_v<V>,
+                "FlatMap stores trivially copyable keys and values only");
+
+public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = pair<K, V>;
+
+  template <bool Const>
+  class Iterator {
+  public:
+    using Ctrl = conditional_t<Const, const int8_t, int8_t>;
+    using Slot = conditional_t<Const, const value_type, value_type>;
+
+    Iterator(Ctrl* ctrl, Slot* slot, Ctrl* end) :
+    ctrl_(ctrl),
+    slot_(slot),
+    end_(end)
+    {
+      SkipFree();
+    }
+
+    Slot& operator*() const { return *slot_; }
+    Slot* operator->() const { return slot_; }
+
+    Iterator& operator++()
+    {
+      ++ctrl_;
+      ++slot_;
+      SkipFree();
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const { return ctrl_ == other.ctrl_; }
+    bool operator!=(const Iterator& other) const { return ctrl_ != other.ctrl_; }
+
+  private:
+    void SkipFree()
+    {
+      while (ctrl_ != end_ && *ctrl_ < 0) {
+        ++ctrl_;
+        ++slot_;
+      }
+    }
+
+    Ctrl* ctrl_;
+    Slot* slot_;
+    Ctrl* end_;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  FlatMap() { Rehash(kGroupWidth); }
+
+  // copies the live table only; SnapshotStorage copies shards this way
+  FlatMap(const FlatMap& other) :
+  hasher_(other.hasher_),
+  table_(new Table(other.Current())),
+  size_(other.size_)
+  {}
+
+  FlatMap(FlatMap&& other) noexcept :
+  hasher_(move(other.hasher_)),
+  table_(other.table_.exchange(nullptr)),
+  retired_(move(other.retired_)),
+  size_(exchange(other.size_, 0))
+  {}
+
+  FlatMap& operator=(FlatMap&& other) noexcept
+  {
+    if (this != &other) {
+      delete table_.exchange(other.table_.exchange(nullptr));
+      hasher_ = move(other.hasher_);
+      retired_ = move(other.retired_);
+      size_ = exchange(other.size_, 0);
+    }
+    return *this;
+  }
+
+  ~FlatMap()
+  {
+    delete table_.load(memory_order_relaxed);
+  }
+
+  V& operator[](const K& key)
+  {
+    const size_t hash = Mix(hasher_(key));
+    if (const size_t index = FindIndex(Current(), key, hash); index != npos) {
+      return Current().slots[index].second;
+    }
+
+    if (size_ + 1 > MaxLoad(capacity())) {
+      Rehash(capacity() * 2);
+    }
+    Table& table = Current();
+    const size_t index = FindFree(table, hash);
+    SetCtrl(table, index, H2(hash));
+    table.slots[index] = value_type(key, V());
+    ++size_;
+    return table.slots[index].second;
+  }
+
+  const V& at(const K& key) const
+  {
+    const size_t index = FindIndex(Current(), key, Mix(hasher_(key)));
+    if (index == npos) {
+      throw out_of_range("FlatMap::at");
+    }
+    return Current().slots[index].second;
+  }
+
+  V& at(const K& key)
+  {
+    return const_cast<V&>(as_const(*this).at(key));
+  }
+
+  iterator find(const K& key)
+  {
+    const size_t index = FindIndex(Current(), key, Mix(hasher_(key)));
+    return index == npos ? end() : MakeIterator<iterator>(Current(), index);
+  }
+
+  const_iterator find(const K& key) const
+  {
+    const size_t index = FindIndex(Current(), key, Mix(hasher_(key)));
+    return index == npos ? end() : MakeIterator<const_iterator>(Current(), index);
+  }
+
+  // Pulls the first probe group of key into the cache ahead of a lookup.
+  void prefetch(const K& key) const
+  {
+#if defined(__GNUC__)
+    const Table& table = Current();
+    const size_t pos = H1(Mix(hasher_(key))) & (table.slots.size() - 1);
+    __builtin_prefetch(table.ctrl.data() + pos);
+    __builtin_prefetch(table.slots.data() + pos);
+#endif
+  }
+
+  size_t count(const K& key) const
+  {
+    return FindIndex(Current(), key, Mix(hasher_(key))) != npos;
+  }
+
+  // Copy of the value under key, safe to call while a writer mutates the
+  // map. The result is only meaningful if no writer ran meanwhile.
+  optional<V> OptimisticFind(const K& key) const
+  {
+    static_assert(OptimisticReads, "FlatMap: OptimisticFind needs OptimisticReads");
+
+    const Table& table = *table_.load(memory_order_acquire);
+    const size_t index = FindIndex(table, key, Mix(hasher_(key)));
+    if (index == npos) {
+      return nullopt;
+    }
+    V value;
+    memcpy(&value, &table.slots[index].second, sizeof(V));
+    return value;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return Current().slots.size(); }
+
+  void reserve(size_t count)
+  {
+    size_t target = capacity();
+    while (MaxLoad(target) < count) {
+      target *= 2;
+    }
+    if (target != capacity()) {
+      Rehash(target);
+    }
+  }
+
+  iterator begin() { return MakeIterator<iterator>(Current(), 0); }
+  iterator end() { return MakeIterator<iterator>(Current(), capacity()); }
+  const_iterator begin() const { return MakeIterator<const_iterator>(Current(), 0); }
+  const_iterator end() const { return MakeIterator<const_iterator>(Current(), capacity()); }
+
+private:
+  // The first kGroupWidth control bytes are mirrored past the end so a
+  // group starting near the end can be loaded in one go.
+  struct Table {
+    explicit Table(size_t capacity) :
+    ctrl(capacity + kGroupWidth, kEmpty),
+    slots(capacity)
+    {}
+
+    vector<int8_t> ctrl;
+    vector<value_type> slots;
+  };
+
+  static constexpr size_t kGroupWidth = 16;
+  static constexpr int8_t kEmpty = -128;
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  // std::hash of integers is the identity; spread it before splitting
+  // into the probe start (H1) and the control byte (H2)
+  static size_t Mix(size_t hash)
+  {
+    const uint64_t product = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>(product ^ (product >> 32));
+  }
+
+  static size_t H1(size_t hash) { return hash >> 7; }
+  static int8_t H2(size_t hash) { return static_cast<int8_t>(hash & 0x7F); }
+
+  static size_t MaxLoad(size_t capacity) { return capacity - capacity / 8; }
+
+  // only the writer replaces the table, so it can read it relaxed
+  Table& Current() const { return *table_.load(memory_order_relaxed); }
+
+  template <typename It, typename T>
+  static It MakeIterator(T& table, size_t pos)
+  {
+    const size_t capacity = table.slots.size();
+    return It(table.ctrl.data() + pos, table.slots.data() + pos, table.ctrl.data() + capacity);
+  }
+
+  // bit i set when control byte pos + i equals value
+  static uint32_t MatchGroup(const Table& table, size_t pos, int8_t value)
+  {
+#if defined(__SSE2__)
+    const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table.ctrl.data() + pos));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(value))));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; i++) {
+      mask |= static_cast<uint32_t>(table.ctrl[pos + i] == value) << i;
+    }
+    return mask;
+#endif
+  }
+
+  // Triangular probing over groups visits every group once because the
+  // capacity is a power of two.
+  // Probing gives up after visiting every group once, which a racing
+  // OptimisticFind() needs: it may see a table without empty slots.
+  template <typename OnGroup>
+  static size_t Probe(const Table& table, size_t hash, OnGroup on_group)
+  {
+    const size_t mask = table.slots.size() - 1;
+    size_t pos = H1(hash) & mask;
+    for (size_t stride = kGroupWidth; stride <= table.slots.size(); stride += kGroupWidth) {
+      if (const size_t index = on_group(pos); index != npos || MatchGroup(table, pos, kEmpty) != 0) {
+        return index;
+      }
+      pos = (pos + stride) & mask;
+    }
+    return npos;
+  }
+
+  static size_t FindIndex(const Table& table, const K& key, size_t hash)
+  {
+    const size_t mask = table.slots.size() - 1;
+    return Probe(table, hash, [&](size_t pos) {
+      for (uint32_t match = MatchGroup(table, pos, H2(hash)); match != 0; match &= match - 1) {
+        const size_t index = (pos + CountTrailingZeros(match)) & mask;
+        K candidate;
+        memcpy(&candidate, &table.slots[index].first, sizeof(K));
+        if (candidate == key) {
+          return index;
+        }
+      }
+      return npos;
+    });
+  }
+
+  static size_t FindFree(const Table& table, size_t hash)
+  {
+    const size_t mask = table.slots.size() - 1;
+    return Probe(table, hash, [&](size_t pos) {
+      const uint32_t match = MatchGroup(table, pos, kEmpty);
+      return match != 0 ? (pos + CountTrailingZeros(match)) & mask : npos;
+    });
+  }
+
+  static void SetCtrl(Table& table, size_t index, int8_t value)
+  {
+    table.ctrl[index] = value;
+    if (index < kGroupWidth) {
+      table.ctrl[table.slots.size() + index] = value;
+    }
+  }
+
+  void Rehash(size_t new_capacity)
+  {
+    auto grown = make_unique<Table>(new_capacity);
+    if (Table* old = table_.load(memory_order_relaxed)) {
+      for (size_t i = 0; i < old->slots.size(); i++) {
+        if (old->ctrl[i] >= 0) {
+          const size_t hash = Mix(hasher_(old->slots[i].first));
+          const size_t index = FindFree(*grown, hash);
+          SetCtrl(*grown, index, H2(hash));
+          grown->slots[index] = old->slots[i];
+        }
+      }
+    }
+
+    Table* old = table_.exchange(grown.release(), memory_order_release);
+    if constexpr (OptimisticReads) {
+      retired_.emplace_back(old);
+    } else {
+      delete old;
+    }
+  }
+
+  static unsigned CountTrailingZeros(uint32_t mask)
+  {
+    return static_cast<unsigned>(__builtin_ctz(mask));
+  }
+
+  Hash hasher_;
+  atomic<Table*> table_{nullptr};
+  vector<unique_ptr<Table>> retired_;
+  size_t size_ = 0;
+};
+
+// Storage policies selecting the per-shard map of a ConcurrentMap.
+// NodeStorage is the unordered_map the shards always used; FlatStorage
+// is the open-addressing FlatMap above for trivially copyable K and V.
+// OptimisticFlatStorage additionally guards every shard with a SeqLock
+// and enables the lock-free ConcurrentMap::Get(). SnapshotStorage (see
+// snapshot.h) makes shards copy-on-write for ConcurrentMap::Snapshot();
+// PoolStorage and ArenaStorage (see pmr_storage.h) give every shard a
+// memory resource of its own.
+struct NodeStorage {
+  template <typename K, typename V, typename Hash>
+  using Map = unordered_map<K, V, Hash>;
+
+  static constexpr bool kOptimisticReads = false;
+  static constexpr bool kSnapshots = false;
+};
+
+struct FlatStorage {
+  template <typename K, typename V, typename Hash>
+  using Map = FlatMap<K, V, Hash>;
+
+  static constexpr bool kOptimisticReads = false;
+  static constexpr bool kSnapshots = false;
+};
+
+struct OptimisticFlatStorage {
+  template <typename K, typename V, typename Hash>
+  using Map = FlatMap<K, V, Hash, true>;
+
+  static constexpr bool kOptimisticReads = true;
+  static constexpr bool kSnapshots = false;
+};
+
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#include "shard_lock.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Options of ConcurrentMap::EnableHotKeys().
+struct HotKeys {
+  // one in sample_every Get calls of a thread is sampled; 0 disables
+  // hot key replicas
+  size_t sample_every = 16;
+  // samples of one key, within the last HotKeyReplicas::kWindow samples
+  // of the thread, that make the key hot for the thread
+  size_t threshold = 4;
+};
+
+// Distinguishes maps in the thread-local replica tables; never reused,
+// unlike addresses.
+inline uint64_t NextMapId()
+{
+  static atomic<uint64_t> next{1};
+  return next.fetch_add(1, memory_order_relaxed);
+}
+
+// Thread-local copies of the values of the keys the thread reads most,
+// for all maps of one K, V, Hash. A thread finds its hot keys by sampling
+// its own Get calls into a few space-saving counters; once a key is hot,
+// the value is copied together with the version of the shard sequence
+// counter it was read under, and later reads return the copy for as long
+// as the shard still has that version. Every write to the shard bumps the
+// counter, which invalidates the copies of all its keys at once; a read
+// after a write therefore takes the lock once and copies afresh.
+//
+// Replicas take no lock and write nothing shared, so hot keys stop
+// contending on their shard lock as long as their shard is read-mostly.
+template <typename K, typename V, typename Hash>
+class HotKeyReplicas {
+public:
+  static constexpr size_t kSlots = 64;
+  static constexpr size_t kCandidates = 16;
+  // samples after which the candidate counts are halved, so keys that
+  // cooled down give way
+  static constexpr size_t kWindow = 1024;
+
+  // What a locked read saw: the value, if any, and the sequence counter
+  // of the shard it was read from, which no writer held open.
+  struct LockedValue {
+    optional<V> value;
+    const SeqLock* seqlock;
+    uint64_t version;
+  };
+
+  static HotKeyReplicas& Local()
+  {
+    thread_local HotKeyReplicas replicas;
+    return replicas;
+  }
+
+  // Value of key in map map_id, whose shard currently owning key is
+  // guarded by seqlock. Served from a replica when the thread has a
+  // current one, otherwise by locked_read() returning a LockedValue.
+  template <typename LockedRead>
+  optional<V> Read(uint64_t map_id, const HotKeys& options, const K& key, size_t hash,
+                   const SeqLock& seqlock, LockedRead locked_read)
+  {
+    Replica& replica = slots_[hash % kSlots];
+    const bool cached = replica.map_id == map_id && *replica.key == key;
+    if (cached && replica.seqlock == &seqlock && seqlock.Version() == replica.version) {
+      hits_++;
+      return replica.value;
+    }
+
+    const bool hot = cached || Sample(map_id, options, key);
+    LockedValue read = locked_read();
+    if (hot) {
+      replica.map_id = map_id;
+      replica.key = key;
+      replica.value = read.value;
+      replica.seqlock = read.seqlock;
+      replica.version = read.version;
+    }
+    return move(read.value);
+  }
+
+  // Reads the calling thread served from replicas, of all maps of this
+  // type.
+  uint64_t Hits() const { return hits_; }
+
+private:
+  struct Replica {
+    uint64_t map_id = 0;
+    optional<K> key;
+    optional<V> value;
+    const SeqLock* seqlock = nullptr;
+    uint64_t version = 0;
+  };
+
+  struct Candidate {
+    uint64_t map_id = 0;
+    optional<K> key;
+    size_t count = 0;
+  };
+
+  // Counts every sample_every-th call; returns whether key is hot.
+  bool Sample(uint64_t map_id, const HotKeys& options, const K& key)
+  {
+    if (++calls_ % options.sample_every != 0) {
+      return false;
+    }
+    if (++samples_ % kWindow == 0) {
+      for (Candidate& c : candidates_) {
+        c.count /= 2;
+      }
+    }
+
+    // space-saving: a new key takes over the least counted candidate
+    Candidate* least = &candidates_[0];
+    for (Candidate& c : candidates_) {
+      if (c.map_id == map_id && *c.key == key) {
+        return ++c.count >= options.threshold;
+      }
+      if (c.count < least->count) {
+        least = &c;
+      }
+    }
+    least->map_id = map_id;
+    least->key = key;
+    least->count++;
+    return least->count >= options.threshold;
+  }
+
+  Replica slots_[kSlots];
+  Candidate candidates_[kCandidates];
+  size_t calls_ = 0;
+  size_t samples_ = 0;
+  uint64_t hits_ = 0;
+};
+
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+#include "shard_lock.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Wait times are bucketed by powers of two: bucket 0 holds waits below
+// 128 ns, bucket i those in [64 << i, 128 << i) ns, the last one all the
+// longer ones.
+inline constexpr size_t kWaitBuckets = 16;
+
+// Plain copy of the counters of one lock, as returned by Stats().
+struct LockCounters {
+  uint64_t acquisitions = 0;
+  // acquisitions that found the lock taken and had to wait
+  uint64_t contended = 0;
+  uint64_t wait_ns = 0;
+  array<uint64_t, kWaitBuckets> wait_histogram = {};
+  // exclusive hold times, sampled on every kHoldSampleEvery-th acquisition
+  uint64_t hold_samples = 0;
+  uint64_t hold_ns = 0;
+};
+
+// Times a wait from its first failed attempt on, so an uncontended
+// acquisition never reads the clock.
+class WaitTimer {
+public:
+  void Miss()
+  {
+    if (!waiting_) {
+      waiting_ = true;
+      start_ = chrono::steady_clock::now();
+    }
+  }
+
+  bool Waited() const { return waiting_; }
+
+  uint64_t Nanoseconds() const
+  {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_).count();
+  }
+
+private:
+  bool waiting_ = false;
+  chrono::steady_clock::time_point start_;
+};
+
+// Counters of one lock, bumped with relaxed atomics by the threads that
+// take it; they sit next to the lock, whose cache line those threads
+// write anyway.
+class LockStats {
+public:
+  static constexpr uint64_t kHoldSampleEvery = 64;
+
+  // Returns whether the hold time of this acquisition is to be sampled.
+  bool RecordAcquisition(const WaitTimer& timer)
+  {
+    if (timer.Waited()) {
+      const uint64_t ns = timer.Nanoseconds();
+      contended_.fetch_add(1, memory_order_relaxed);
+      wait_ns_.fetch_add(ns, memory_order_relaxed);
+      wait_histogram_[BucketOf(ns)].fetch_add(1, memory_order_relaxed);
+    }
+    return acquisitions_.fetch_add(1, memory_order_relaxed) % kHoldSampleEvery == 0;
+  }
+
+  void RecordHold(uint64_t ns)
+  {
+    hold_samples_.fetch_add(1, memory_order_relaxed);
+    hold_ns_.fetch_add(ns, memory_order_relaxed);
+  }
+
+  LockCounters Read() const
+  {
+    LockCounters counters;
+    counters.acquisitions = acquisitions_.load(memory_order_relaxed);
+    counters.contended = contended_.load(memory_order_relaxed);
+    counters.wait_ns = wait_ns_.load(memory_order_relaxed);
+    for (size_t i = 0; i < kWaitBuckets; i++) {
+      counters.wait_histogram[i] = wait_histogram_[i].load(memory_order_relaxed);
+    }
+    counters.hold_samples = hold_samples_.load(memory_order_relaxed);
+    counters.hold_ns = hold_ns_.load(memory_order_relaxed);
+    return counters;
+  }
+
+private:
+  static size_t BucketOf(uint64_t ns)
+  {
+    const uint64_t scaled = ns >> 6;
+    const size_t bucket = scaled == 0 ? 0 : 63 - __builtin_clzll(scaled);
+    return bucket < kWaitBuckets ? bucket : kWaitBuckets - 1;
+  }
+
+  atomic<uint64_t> acquisitions_{0};
+  atomic<uint64_t> contended_{0};
+  atomic<uint64_t> wait_ns_{0};
+  atomic<uint64_t> wait_histogram_[kWaitBuckets] = {};
+  atomic<uint64_t> hold_samples_{0};
+  atomic<uint64_t> hold_ns_{0};
+};
+
+// Stand-in for LockStats where statistics are off; keeps no state.
+struct NoLockStats {
+  bool RecordAcquisition(const WaitTimer&) { return false; }
+  void RecordHold(uint64_t) {}
+  LockCounters Read() const { return {}; }
+};
+
+// Mutex policy recording LockStats around Mutex (mutex, shared_mutex or
+// ReaderBiasedMutex), which enables ConcurrentMap::Stats(). An
+// acquisition first tries the lock and only reads the clock when that
+// fails; shared acquisitions are counted and timed, but not their holds.
+template <typename Mutex = mutex>
+class InstrumentedMutex {
+public:
+  void lock()
+  {
+    WaitTimer timer;
+    if (!mutex_.try_lock()) {
+      timer.Miss();
+      mutex_.lock();
+    }
+    if (stats_.RecordAcquisition(timer)) {
+      held_since_ = chrono::steady_clock::now();
+      sampled_ = true;
+    }
+  }
+
+  bool try_lock()
+  {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    if (stats_.RecordAcquisition(WaitTimer())) {
+      held_since_ = chrono::steady_clock::now();
+      sampled_ = true;
+    }
+    return true;
+  }
+
+  void unlock()
+  {
+    if (sampled_) {
+      sampled_ = false;
+      stats_.RecordHold(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - held_since_).count());
+    }
+    mutex_.unlock();
+  }
+
+  template <typename M = Mutex>
+  auto lock_shared() -> decltype(declval<M&>().lock_shared())
+  {
+    WaitTimer timer;
+    if (!mutex_.try_lock_shared()) {
+      timer.Miss();
+      mutex_.lock_shared();
+    }
+    stats_.RecordAcquisition(timer);
+  }
+
+  template <typename M = Mutex>
+  auto try_lock_shared() -> decltype(declval<M&>().try_lock_shared())
+  {
+    if (!mutex_.try_lock_shared()) {
+      return false;
+    }
+    stats_.RecordAcquisition(WaitTimer());
+    return true;
+  }
+
+  template <typename M = Mutex>
+  auto unlock_shared() -> decltype(declval<M&>().unlock_shared())
+  {
+    mutex_.unlock_shared();
+  }
+
+  LockCounters Stats() const { return stats_.Read(); }
+
+private:
+  Mutex mutex_;
+  LockStats stats_;
+  // written by the exclusive holder only
+  chrono::steady_clock::time_point held_since_;
+  bool sampled_ = false;
+};
+
+template <typename M>
+struct is_instrumented : false_type {};
+
+template <typename M>
+struct is_instrumented<InstrumentedMutex<M>> : true_type {};
+
+// Statistics of a ConcurrentMap. shards[i].lock holds the counters of
+// the lock guarding shard i where it has one of its own (one2one: the
+// shard mutex, dynamic: the map flag); mutexes those of the shared mutex
+// pool (one2many, dynamic).
+struct ShardStats {
+  size_t entries = 0;
+  LockCounters lock;
+};
+
+struct MapStats {
+  vector<ShardStats> shards;
+  vector<LockCounters> mutexes;
+};
+
+inline ostream& operator<<(ostream& out, const LockCounters& c)
+{
+  out << "{\"acquisitions\": " << c.acquisitions
+      << ", \"contended\": " << c.contended
+      << ", \"wait_ns\": " << c.wait_ns
+      << ", \"wait_histogram\": [";
+  for (size_t i = 0; i < kWaitBuckets; i++) {
+    out << (i == 0 ? "" : ", ") << c.wait_histogram[i];
+  }
+  return out << "], \"hold_samples\": " << c.hold_samples
+             << ", \"hold_ns\": " << c.hold_ns << "}";
+}
+
+// Writes stats as one JSON object, for scraping.
+inline ostream& operator<<(ostream& out, const MapStats& stats)
+{
+  out << "{\"shards\": [";
+  for (size_t i = 0; i < stats.shards.size(); i++) {
+    out << (i == 0 ? "" : ", ")
+        << "{\"entries\": " << stats.shards[i].entries
+        << ", \"lock\": " << stats.shards[i].lock << "}";
+  }
+  out << "], \"mutexes\": [";
+  for (size_t i = 0; i < stats.mutexes.size(); i++) {
+    out << (i == 0 ? "" : ", ") << stats.mutexes[i];
+  }
+  return out << "]}";
+}
+
+}
@@ -0,0 +1,390 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "visit.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Encoding of keys and values in snapshot files: trivially copyable types
+// as their bytes, strings as a uint64_t length and their bytes, both in
+// host byte order. Specialize it for other types, with kSize 0 for
+// encodings of varying size.
+template <typename T, typename = void>
+struct SnapshotCodec;
+
+template <typename T>
+struct SnapshotCodec<T, enable_if_t<is_trivially_copyable_v<T>>> {
+  static constexpr size_t kSize = sizeof(T);
+
+  static void Encode(const T& value, string& out)
+  {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  static T Decode(const char*& in, const char* end)
+  {
+    if (static_cast<size_t>(end - in) < sizeof(T)) {
+      throw runtime_error("snapshot: truncated entry");
+    }
+    T value;
+    memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return value;
+  }
+};
+
+template <>
+struct SnapshotCodec<string> {
+  static constexpr size_t kSize = 0;
+
+  static void Encode(const string& value, string& out)
+  {
+    SnapshotCodec<uint64_t>::Encode(value.size(), out);
+    out.append(value);
+  }
+
+  static string Decode(const char*& in, const char* end)
+  {
+    const uint64_t size = SnapshotCodec<uint64_t>::Decode(in, end);
+    if (static_cast<uint64_t>(end - in) < size) {
+      throw runtime_error("snapshot: truncated entry");
+    }
+    string value(in, size);
+    in += size;
+    return value;
+  }
+};
+
+template <typename T, typename = void>
+struct has_snapshot_codec : false_type {};
+
+template <typename T>
+struct has_snapshot_codec<T, void_t<decltype(SnapshotCodec<T>::kSize)>> : true_type {};
+
+// Identifies T in snapshot headers, so that a snapshot of another type of
+// the same size is refused rather than loaded as garbage: the FNV-1a hash
+// of the type's name, which is stable for a given ABI.
+template <typename T>
+uint64_t SnapshotTypeTag()
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (const char* c = typeid(T).name(); *c != '\0'; c++) {
+    hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Snapshot files start with a SnapshotHeader and the SnapshotSection of
+// every section, then hold the sections, each at a kSnapshotAlignment
+// boundary. A section is its label, if any, followed by its entries,
+// every entry a key and a value as SnapshotCodec encodes them. Maps save
+// one section per shard and no labels; NestedConcurrentMap saves one per
+// inner map, labelled with the outer key.
+inline constexpr char kSnapshotMagic[8] = {'C', 'M', 'S', 'N', 'A', 'P', '0', '2'};
+inline constexpr size_t kSnapshotAlignment = 64;
+
+struct SnapshotHeader {
+  char magic[8];
+  // SnapshotCodec<K>::kSize and SnapshotCodec<V>::kSize of the writer
+  uint32_t key_size;
+  uint32_t value_size;
+  // SnapshotTypeTag<K>() and SnapshotTypeTag<V>() of the writer
+  uint64_t key_tag;
+  uint64_t value_tag;
+  uint64_t sections;
+};
+
+struct SnapshotSection {
+  uint64_t offset;
+  uint64_t label_bytes;
+  uint64_t entry_bytes;
+  uint64_t entries;
+};
+
+// One section on its way to the file.
+struct EncodedSection {
+  string label;
+  string data;
+  uint64_t entries = 0;
+};
+
+template <typename K, typename V>
+void EncodeEntry(EncodedSection& section, const K& key, const V& value)
+{
+  SnapshotCodec<K>::Encode(key, section.data);
+  SnapshotCodec<V>::Encode(value, section.data);
+  section.entries++;
+}
+
+// Appends every entry of map, reserved at once for fixed size encodings.
+template <typename K, typename V, typename Map>
+void EncodeEntries(EncodedSection& section, const Map& map)
+{
+  constexpr size_t entry_size = SnapshotCodec<K>::kSize + SnapshotCodec<V>::kSize;
+  if (SnapshotCodec<K>::kSize != 0 && SnapshotCodec<V>::kSize != 0) {
+    section.data.reserve(section.data.size() + map.size() * entry_size);
+  }
+  for (const auto& [key, value] : map) {
+    EncodeEntry<K, V>(section, key, value);
+  }
+}
+
+template <typename T>
+void EncodeLabel(EncodedSection& section, const T& label)
+{
+  section.label.clear();
+  SnapshotCodec<T>::Encode(label, section.label);
+}
+
+namespace detail
+{
+
+inline size_t AlignSnapshotOffset(size_t offset)
+{
+  return (offset + kSnapshotAlignment - 1) / kSnapshotAlignment * kSnapshotAlignment;
+}
+
+inline void WriteAt(int fd, const char* data, size_t size, uint64_t offset, const string& path)
+{
+  while (size > 0) {
+    const ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error("SaveSnapshot: cannot write " + path + ": " + strerror(errno));
+    }
+    data += written;
+    size -= static_cast<size_t>(written);
+    offset += static_cast<uint64_t>(written);
+  }
+}
+
+class FileDescriptor {
+public:
+  explicit FileDescriptor(int fd) : fd_(fd) {}
+  ~FileDescriptor()
+  {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+  int get() const { return fd_; }
+
+private:
+  int fd_;
+};
+
+}
+
+// Writes sections to path in the snapshot format, the sections in
+// parallel by the tasks of executor. The file is written and synced under
+// path + ".tmp", then renamed over path and the directory synced, so a
+// crash while saving leaves the previous snapshot in place. Throws
+// runtime_error on I/O errors.
+template <typename K, typename V, typename Executor>
+void WriteSnapshotFile(const string& path, const vector<EncodedSection>& sections, const Executor& executor)
+{
+  static_assert(has_snapshot_codec<K>::value && has_snapshot_codec<V>::value,
+                "SaveSnapshot: no encoding for K or V, specialize cmap_common::SnapshotCodec");
+
+  SnapshotHeader header = {};
+  memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+  header.key_size = static_cast<uint32_t>(SnapshotCodec<K>::kSize);
+  header.value_size = static_cast<uint32_t>(SnapshotCodec<V>::kSize);
+  header.key_tag = SnapshotTypeTag<K>();
+  header.value_tag = SnapshotTypeTag<V>();
+  header.sections = sections.size();
+
+  vector<SnapshotSection> table(sections.size());
+  size_t offset = detail::AlignSnapshotOffset(sizeof(header) + table.size() * sizeof(SnapshotSection));
+  for (size_t i = 0; i < sections.size(); i++) {
+    table[i] = {offset, sections[i].label.size(), sections[i].data.size(), sections[i].entries};
+    offset = detail::AlignSnapshotOffset(offset + sections[i].label.size() + sections[i].data.size());
+  }
+
+  const string temporary = path + ".tmp";
+  {
+    detail::FileDescriptor file(::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (file.get() < 0) {
+      throw runtime_error("SaveSnapshot: cannot open " + temporary + ": " + strerror(errno));
+    }
+
+    string head(reinterpret_cast<const char*>(&header), sizeof(header));
+    head.append(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotSection));
+    detail::WriteAt(file.get(), head.data(), head.size(), 0, temporary);
+    ParallelForIndexes(executor, sections.size(), [&](size_t i) {
+      const EncodedSection& section = sections[i];
+      detail::WriteAt(file.get(), section.label.data(), section.label.size(), table[i].offset, temporary);
+      detail::WriteAt(file.get(), section.data.data(), section.data.size(),
+                      table[i].offset + section.label.size(), temporary);
+    });
+    // empty trailing sections sit at the aligned end
+    if (::ftruncate(file.get(), static_cast<off_t>(offset)) != 0) {
+      throw runtime_error("SaveSnapshot: cannot size " + temporary + ": " + strerror(errno));
+    }
+    if (::fsync(file.get()) != 0) {
+      throw runtime_error("SaveSnapshot: cannot sync " + temporary + ": " + strerror(errno));
+    }
+  }
+  if (::rename(temporary.c_str(), path.c_str()) != 0) {
+    throw runtime_error("SaveSnapshot: cannot rename " + temporary + ": " + strerror(errno));
+  }
+
+  // the rename itself is only durable once the directory is synced
+  const size_t slash = path.rfind('/');
+  const string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+  detail::FileDescriptor parent(::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (parent.get() < 0 || ::fsync(parent.get()) != 0) {
+    throw runtime_error("SaveSnapshot: cannot sync " + directory + ": " + strerror(errno));
+  }
+}
+
+// Snapshot file mapped into memory, read-only. Entries are decoded
+// straight from the mapping, with no read buffer in between, so sections
+// can be decoded by several threads at once; with fixed size encodings
+// every entry is two memcpys. Throws runtime_error when path holds no
+// well-formed snapshot.
+class MappedSnapshot {
+public:
+  explicit MappedSnapshot(const string& path)
+  {
+    detail::FileDescriptor file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (file.get() < 0) {
+      throw runtime_error("LoadSnapshot: cannot open " + path + ": " + strerror(errno));
+    }
+    struct stat status;
+    if (::fstat(file.get(), &status) != 0) {
+      throw runtime_error("LoadSnapshot: cannot stat " + path + ": " + strerror(errno));
+    }
+    size_ = static_cast<size_t>(status.st_size);
+    if (size_ < sizeof(SnapshotHeader)) {
+      throw runtime_error("LoadSnapshot: " + path + " is not a snapshot");
+    }
+    void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file.get(), 0);
+    if (data == MAP_FAILED) {
+      throw runtime_error("LoadSnapshot: cannot map " + path + ": " + strerror(errno));
+    }
+    data_ = static_cast<const char*>(data);
+    // the sections are read front to back, each by one task
+    ::madvise(data, size_, MADV_SEQUENTIAL);
+
+    try {
+      Validate(path);
+    } catch (...) {
+      ::munmap(const_cast<char*>(data_), size_);
+      throw;
+    }
+  }
+
+  ~MappedSnapshot()
+  {
+    ::munmap(const_cast<char*>(data_), size_);
+  }
+
+  MappedSnapshot(const MappedSnapshot&) = delete;
+  MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+  size_t Sections() const { return table_.size(); }
+  size_t Entries(size_t section) const { return table_[section].entries; }
+
+  // Throws runtime_error unless the snapshot was saved with K and V.
+  template <typename K, typename V>
+  void Expect() const
+  {
+    static_assert(has_snapshot_codec<K>::value && has_snapshot_codec<V>::value,
+                  "LoadSnapshot: no encoding for K or V, specialize cmap_common::SnapshotCodec");
+    if (header_.key_size != SnapshotCodec<K>::kSize || header_.value_size != SnapshotCodec<V>::kSize ||
+        header_.key_tag != SnapshotTypeTag<K>() || header_.value_tag != SnapshotTypeTag<V>()) {
+      throw runtime_error("LoadSnapshot: snapshot of other key or value types");
+    }
+  }
+
+  template <typename T>
+  T Label(size_t section) const
+  {
+    const char* in = data_ + table_[section].offset;
+    const char* end = in + table_[section].label_bytes;
+    return SnapshotCodec<T>::Decode(in, end);
+  }
+
+  // Calls fn(key, value) for the entries of section in their order.
+  template <typename K, typename V, typename Fn>
+  void ForEach(size_t section, Fn fn) const
+  {
+    const SnapshotSection& s = table_[section];
+    const char* in = data_ + s.offset + s.label_bytes;
+    const char* end = in + s.entry_bytes;
+    for (uint64_t i = 0; i < s.entries; i++) {
+      K key = SnapshotCodec<K>::Decode(in, end);
+      V value = SnapshotCodec<V>::Decode(in, end);
+      fn(move(key), move(value));
+    }
+  }
+
+  // The entries of section, ready for InsertBatch.
+  template <typename K, typename V>
+  vector<pair<K, V>> Decode(size_t section) const
+  {
+    vector<pair<K, V>> entries;
+    entries.reserve(Entries(section));
+    ForEach<K, V>(section, [&](K&& key, V&& value) { entries.emplace_back(move(key), move(value)); });
+    return entries;
+  }
+
+private:
+  void Validate(const string& path)
+  {
+    memcpy(&header_, data_, sizeof(header_));
+    if (memcmp(header_.magic, kSnapshotMagic, sizeof(header_.magic)) != 0) {
+      throw runtime_error("LoadSnapshot: " + path + " is not a snapshot");
+    }
+    if (header_.sections > (size_ - sizeof(header_)) / sizeof(SnapshotSection)) {
+      throw runtime_error("LoadSnapshot: " + path + " is truncated");
+    }
+    table_.resize(header_.sections);
+    memcpy(table_.data(), data_ + sizeof(header_), table_.size() * sizeof(SnapshotSection));
+    // fixed size entries fill their bytes exactly, others take one byte
+    // at least, so a bad count cannot make Decode reserve too much
+    const uint64_t entry_size = header_.key_size + uint64_t{header_.value_size};
+    const bool fixed_size = header_.key_size != 0 && header_.value_size != 0;
+    for (const SnapshotSection& s : table_) {
+      if (s.offset > size_ || s.label_bytes > size_ - s.offset ||
+          s.entry_bytes > size_ - s.offset - s.label_bytes) {
+        throw runtime_error("LoadSnapshot: " + path + " is truncated");
+      }
+      if (fixed_size ? s.entry_bytes % entry_size != 0 || s.entries != s.entry_bytes / entry_size
+                     : s.entries > s.entry_bytes) {
+        throw runtime_error("LoadSnapshot: " + path + " has a bad entry count");
+      }
+    }
+  }
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  SnapshotHeader header_;
+  vector<SnapshotSection> table_;
+};
+
+}
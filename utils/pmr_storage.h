@@ -0,0 +1,97 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Shard map of PmrStorage: an unordered_map whose nodes and bucket arrays
+// come from a Resource (a std::pmr::memory_resource) owned by this map
+// alone. Only the holder of the shard lock allocates, so the resource
+// needs no synchronization, allocations of different shards never meet in
+// the global allocator, and the resource hands all its memory back at
+// once when the map goes.
+//
+// Map and resource share one heap block, which keeps moves of the shard
+// map a pointer swap; the resource's address must never change while the
+// map uses it. Offers the subset of the unordered_map interface the
+// shards use.
+template <typename K, typename V, typename Hash, typename Resource>
+class ResourceMap {
+  struct Arena;
+
+public:
+  using map_type = pmr::unordered_map<K, V, Hash>;
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = typename map_type::value_type;
+  using iterator = typename map_type::iterator;
+  using const_iterator = typename map_type::const_iterator;
+
+  ResourceMap() : arena_(make_unique<Arena>()) {}
+
+  // copies the entries into a resource of its own
+  ResourceMap(const ResourceMap& other) : arena_(make_unique<Arena>(other.arena_->map)) {}
+
+  ResourceMap(ResourceMap&&) noexcept = default;
+  ResourceMap& operator=(ResourceMap&&) noexcept = default;
+
+  V& operator[](const K& key) { return arena_->map[key]; }
+
+  const V& at(const K& key) const { return arena_->map.at(key); }
+  V& at(const K& key) { return arena_->map.at(key); }
+
+  iterator find(const K& key) { return arena_->map.find(key); }
+  const_iterator find(const K& key) const { return as_const(arena_->map).find(key); }
+
+  size_t count(const K& key) const { return arena_->map.count(key); }
+  size_t size() const { return arena_->map.size(); }
+  bool empty() const { return arena_->map.empty(); }
+
+  void reserve(size_t count) { arena_->map.reserve(count); }
+
+  size_t erase(const K& key) { return arena_->map.erase(key); }
+
+  iterator begin() { return arena_->map.begin(); }
+  iterator end() { return arena_->map.end(); }
+  const_iterator begin() const { return as_const(arena_->map).begin(); }
+  const_iterator end() const { return as_const(arena_->map).end(); }
+
+private:
+  // the map is declared after its resource, so it is destroyed first
+  struct Arena {
+    Arena() = default;
+    explicit Arena(const map_type& entries) : map(entries, &resource) {}
+
+    Resource resource;
+    map_type map{&resource};
+  };
+
+  unique_ptr<Arena> arena_;
+};
+
+// Storage policy giving every shard a node map over a memory resource of
+// its own. Resource is any default constructible memory_resource.
+template <typename Resource>
+struct PmrStorage {
+  template <typename K, typename V, typename Hash>
+  using Map = ResourceMap<K, V, Hash, Resource>;
+
+  static constexpr bool kOptimisticReads = false;
+  static constexpr bool kSnapshots = false;
+};
+
+// Nodes recycled through per-size pools: maps that also erase or rehash.
+using PoolStorage = PmrStorage<pmr::unsynchronized_pool_resource>;
+
+// Bump allocation, nothing returned before the map goes: grow-only maps
+// such as the inner maps of a cmap_nested::NestedConcurrentMap.
+using ArenaStorage = PmrStorage<pmr::monotonic_buffer_resource>;
+
+}
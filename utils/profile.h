@@ -1,35 +1,413 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 using namespace std;
 using namespace std::chrono;
 
-class LogDuration {
+// Aggregating profiler behind LOG_DURATION. Every named scope keeps a
+// count, sum, min, max and a log-linear histogram of its durations, per
+// thread and without locks or atomic read-modify-writes: a thread only
+// ever writes its own slots. The summaries over all threads are printed
+// to cerr at exit, or whenever Dump() is called.
+//
+// Durations are taken in TSC ticks where available, calibrated against
+// steady_clock when summarized, otherwise in steady_clock nanoseconds.
+class Profiler {
 public:
-  explicit LogDuration(const string& msg = "")
-    : message(msg + ": ")
-    , start(steady_clock::now())
+  static constexpr size_t kMaxScopes = 1024;
+
+  struct Summary {
+    string name;
+    uint64_t count = 0;
+    double total_ns = 0;
+    double min_ns = 0;
+    double max_ns = 0;
+    double p50_ns = 0;
+    double p90_ns = 0;
+    double p99_ns = 0;
+    double p999_ns = 0;
+
+    double MeanNs() const { return count == 0 ? 0 : total_ns / count; }
+  };
+
+  static Profiler& Instance()
+  {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  static uint64_t Now()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // Id of the scope called name; one name, one scope, wherever it is used.
+  size_t Register(const string& name)
+  {
+    lock_guard<mutex> guard(mutex_);
+    const auto [it, inserted] = ids_.emplace(name, names_.size());
+    if (inserted) {
+      if (names_.size() == kMaxScopes) {
+        ids_.erase(it);
+        throw length_error("Profiler: too many scopes");
+      }
+      names_.push_back(name);
+    }
+    return it->second;
+  }
+
+  // Adds a duration of ticks (see Now()) to scope on the calling thread.
+  void Record(size_t scope, uint64_t ticks)
+  {
+    Local().Slot(scope).Add(ticks);
+  }
+
+  // Summaries of every scope that ran, merged over all threads.
+  vector<Summary> Summaries() const
   {
+    const double ns_per_tick = NanosecondsPerTick();
+    lock_guard<mutex> guard(mutex_);
+
+    vector<Summary> result;
+    for (size_t scope = 0; scope < names_.size(); scope++) {
+      Totals totals;
+      for (const auto& profile : profiles_) {
+        if (const ScopeSlot* slot = profile->slots[scope].load(memory_order_acquire)) {
+          slot->AddTo(totals);
+        }
+      }
+      if (totals.count != 0) {
+        result.push_back(totals.Summarize(names_[scope], ns_per_tick));
+      }
+    }
+    return result;
   }
 
-  ~LogDuration() {
-    auto finish = steady_clock::now();
-    auto dur = finish - start;
-    cerr << message
-       << duration_cast<milliseconds>(dur).count()
-       << " ms" << endl;
+  void Dump(ostream& out) const
+  {
+    for (const Summary& s : Summaries()) {
+      out << s.name << ": count=" << s.count
+          << " mean=" << Format(s.MeanNs())
+          << " p50=" << Format(s.p50_ns)
+          << " p90=" << Format(s.p90_ns)
+          << " p99=" << Format(s.p99_ns)
+          << " p999=" << Format(s.p999_ns)
+          << " min=" << Format(s.min_ns)
+          << " max=" << Format(s.max_ns)
+          << " total=" << Format(s.total_ns) << endl;
+    }
   }
+
+  // Forgets every duration recorded so far. Call it while no profiled
+  // scope runs: the owners write their slots without synchronization.
+  void Reset()
+  {
+    lock_guard<mutex> guard(mutex_);
+    for (auto& profile : profiles_) {
+      for (auto& slot : profile->slots) {
+        if (ScopeSlot* s = slot.load(memory_order_acquire)) {
+          s->Clear();
+        }
+      }
+    }
+  }
+
+private:
+  // Values below kLinear get a bucket each; above, every power of two is
+  // split into kLinear buckets, which bounds the error of a percentile
+  // to 1 / kLinear.
+  static constexpr size_t kLinearBits = 3;
+  static constexpr uint64_t kLinear = 1 << kLinearBits;
+  static constexpr size_t kBuckets = (64 - kLinearBits + 1) * kLinear;
+
+  static size_t BucketOf(uint64_t ticks)
+  {
+    if (ticks < kLinear) {
+      return static_cast<size_t>(ticks);
+    }
+    const size_t exponent = 63 - __builtin_clzll(ticks);
+    const size_t sub = static_cast<size_t>(ticks >> (exponent - kLinearBits)) & (kLinear - 1);
+    return (exponent - kLinearBits + 1) * kLinear + sub;
+  }
+
+  // smallest value falling into bucket
+  static uint64_t LowerBound(size_t bucket)
+  {
+    if (bucket < kLinear) {
+      return bucket;
+    }
+    const size_t exponent = bucket / kLinear + kLinearBits - 1;
+    return (kLinear + bucket % kLinear) << (exponent - kLinearBits);
+  }
+
+  struct Totals {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    vector<uint64_t> histogram = vector<uint64_t>(kBuckets);
+
+    Summary Summarize(const string& name, double ns_per_tick) const
+    {
+      auto percentile = [&](double p) {
+        const uint64_t rank = static_cast<uint64_t>(p * (count - 1));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < kBuckets; b++) {
+          seen += histogram[b];
+          if (seen > rank) {
+            return clamp(LowerBound(b), min, max) * ns_per_tick;
+          }
+        }
+        return max * ns_per_tick;
+      };
+
+      Summary s;
+      s.name = name;
+      s.count = count;
+      s.total_ns = sum * ns_per_tick;
+      s.min_ns = min * ns_per_tick;
+      s.max_ns = max * ns_per_tick;
+      s.p50_ns = percentile(0.50);
+      s.p90_ns = percentile(0.90);
+      s.p99_ns = percentile(0.99);
+      s.p999_ns = percentile(0.999);
+      return s;
+    }
+  };
+
+  // Written by its owning thread only, with plain relaxed loads and
+  // stores; Summaries() may read it meanwhile and see a recording half
+  // done, which only skews that one summary.
+  struct ScopeSlot {
+    atomic<uint64_t> count{0};
+    atomic<uint64_t> sum{0};
+    atomic<uint64_t> min{UINT64_MAX};
+    atomic<uint64_t> max{0};
+    atomic<uint64_t> histogram[kBuckets] = {};
+
+    static void Bump(atomic<uint64_t>& counter, uint64_t delta)
+    {
+      counter.store(counter.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    void Add(uint64_t ticks)
+    {
+      Bump(count, 1);
+      Bump(sum, ticks);
+      if (ticks < min.load(memory_order_relaxed)) {
+        min.store(ticks, memory_order_relaxed);
+      }
+      if (ticks > max.load(memory_order_relaxed)) {
+        max.store(ticks, memory_order_relaxed);
+      }
+      Bump(histogram[BucketOf(ticks)], 1);
+    }
+
+    void AddTo(Totals& totals) const
+    {
+      totals.count += count.load(memory_order_relaxed);
+      totals.sum += sum.load(memory_order_relaxed);
+      totals.min = std::min(totals.min, min.load(memory_order_relaxed));
+      totals.max = std::max(totals.max, max.load(memory_order_relaxed));
+      for (size_t b = 0; b < kBuckets; b++) {
+        totals.histogram[b] += histogram[b].load(memory_order_relaxed);
+      }
+    }
+
+    void Clear()
+    {
+      count.store(0, memory_order_relaxed);
+      sum.store(0, memory_order_relaxed);
+      min.store(UINT64_MAX, memory_order_relaxed);
+      max.store(0, memory_order_relaxed);
+      for (auto& bucket : histogram) {
+        bucket.store(0, memory_order_relaxed);
+      }
+    }
+  };
+
+  // Slots of one thread, allocated on first use of each scope. A thread
+  // that exits hands its profile back for the next new thread to go on
+  // with, so short-lived threads do not pile up profiles.
+  struct ThreadProfile {
+    atomic<ScopeSlot*> slots[kMaxScopes] = {};
+
+    ~ThreadProfile()
+    {
+      for (auto& slot : slots) {
+        delete slot.load(memory_order_relaxed);
+      }
+    }
+
+    ScopeSlot& Slot(size_t scope)
+    {
+      ScopeSlot* slot = slots[scope].load(memory_order_relaxed);
+      if (slot == nullptr) {
+        slot = new ScopeSlot;
+        slots[scope].store(slot, memory_order_release);
+      }
+      return *slot;
+    }
+  };
+
+  class LocalHandle {
+  public:
+    explicit LocalHandle(Profiler& profiler) :
+    profiler_(profiler),
+    profile_(profiler.Acquire())
+    {}
+
+    ~LocalHandle() { profiler_.Release(profile_); }
+
+    ThreadProfile& profile_ref() { return *profile_; }
+
+  private:
+    Profiler& profiler_;
+    ThreadProfile* profile_;
+  };
+
+  Profiler() :
+  start_ticks_(Now()),
+  start_time_(steady_clock::now())
+  {}
+
+  ~Profiler()
+  {
+    bool recorded = false;
+    for (const Summary& s : Summaries()) {
+      recorded |= s.count != 0;
+    }
+    if (recorded) {
+      Dump(cerr);
+    }
+  }
+
+  ThreadProfile& Local()
+  {
+    thread_local LocalHandle handle(*this);
+    return handle.profile_ref();
+  }
+
+  ThreadProfile* Acquire()
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (!free_.empty()) {
+      ThreadProfile* profile = free_.back();
+      free_.pop_back();
+      return profile;
+    }
+    profiles_.push_back(make_unique<ThreadProfile>());
+    return profiles_.back().get();
+  }
+
+  void Release(ThreadProfile* profile)
+  {
+    lock_guard<mutex> guard(mutex_);
+    free_.push_back(profile);
+  }
+
+  // Ticks are calibrated over the profiler's lifetime, at least 10 ms.
+  double NanosecondsPerTick() const
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    while (steady_clock::now() - start_time_ < milliseconds(10)) {
+      this_thread::sleep_for(milliseconds(1));
+    }
+    const uint64_t ticks = Now() - start_ticks_;
+    const double ns = duration_cast<nanoseconds>(steady_clock::now() - start_time_).count();
+    return ns / ticks;
+#else
+    return 1.0;
+#endif
+  }
+
+  static string Format(double ns)
+  {
+    ostringstream out;
+    out << fixed << setprecision(1);
+    if (ns < 1e3) {
+      out << ns << "ns";
+    } else if (ns < 1e6) {
+      out << ns / 1e3 << "us";
+    } else if (ns < 1e9) {
+      out << ns / 1e6 << "ms";
+    } else {
+      out << ns / 1e9 << "s";
+    }
+    return out.str();
+  }
+
+  const uint64_t start_ticks_;
+  const steady_clock::time_point start_time_;
+
+  // guards everything below; profiles are only ever added
+  mutable mutex mutex_;
+  unordered_map<string, size_t> ids_;
+  vector<string> names_;
+  vector<unique_ptr<ThreadProfile>> profiles_;
+  vector<ThreadProfile*> free_;
+};
+
+// Id of a profiled scope, resolved once per LOG_DURATION site.
+struct ProfileScope {
+  size_t id;
+};
+
+// Adds the time from its construction to its destruction to a profiler
+// scope: a tick read at each end and a few stores into the thread's own
+// slot, cheap enough for hot paths such as operator[].
+class LogDuration {
+public:
+  explicit LogDuration(ProfileScope scope) :
+  scope_(scope.id),
+  start_(Profiler::Now())
+  {}
+
+  // looks the scope up by name, under the profiler's lock
+  explicit LogDuration(const string& name) :
+  LogDuration(ProfileScope{Profiler::Instance().Register(name)})
+  {}
+
+  ~LogDuration()
+  {
+    Profiler::Instance().Record(scope_, Profiler::Now() - start_);
+  }
+
 private:
-  string message;
-  steady_clock::time_point start;
+  size_t scope_;
+  uint64_t start_;
 };
 
 #define UNIQ_ID_IMPL(lineno) _a_local_var_##lineno
 #define UNIQ_ID(lineno) UNIQ_ID_IMPL(lineno)
+#define PROFILE_SCOPE_ID_IMPL(lineno) _a_profile_scope_##lineno
+#define PROFILE_SCOPE_ID(lineno) PROFILE_SCOPE_ID_IMPL(lineno)
 
+// Times the rest of the enclosing block under the scope message. The
+// scope is resolved the first time the line runs, so message must be
+// the same on every pass.
 #define LOG_DURATION(message) \
-  LogDuration UNIQ_ID(__LINE__){message};
-  
+  static const ProfileScope PROFILE_SCOPE_ID(__LINE__){Profiler::Instance().Register(message)}; \
+  LogDuration UNIQ_ID(__LINE__){PROFILE_SCOPE_ID(__LINE__)};
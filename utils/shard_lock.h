@@ -0,0 +1,266 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// true for lockables that also offer lock_shared()/unlock_shared(),
+// e.g. shared_mutex or ReaderBiasedMutex below.
+template <typename M, typename = void>
+struct is_shared_lockable : false_type {};
+
+template <typename M>
+struct is_shared_lockable<M, void_t<
+  decltype(declval<M&>().lock_shared()),
+  decltype(declval<M&>().unlock_shared())>> : true_type {};
+
+// Distance that keeps two objects from sharing a cache line. The value
+// of hardware_destructive_interference_size may vary with -mtune, which
+// GCC warns about in headers; every target here is built as a single
+// translation unit, so the layouts cannot disagree.
+#if defined(__cpp_lib_hardware_interference_size)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winterference-size"
+#endif
+inline constexpr size_t kCacheLineSize = hardware_destructive_interference_size;
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+inline constexpr size_t kCacheLineSize = 64;
+#endif
+
+// Wraps a lock or counter that must not share its cache line with its
+// neighbours in an array.
+template <typename T>
+struct alignas(kCacheLineSize) CacheAligned {
+  T value;
+};
+
+// Spin-wait hint: lets the sibling hyperthread run and saves power.
+inline void CpuRelax()
+{
+#if defined(__SSE2__)
+  _mm_pause();
+#else
+  this_thread::yield();
+#endif
+}
+
+// Guard taken by operator[]: always exclusive.
+template <typename M>
+using WriteGuard = lock_guard<M>;
+
+// Guard taken by At()/Has(): shared when the shard mutex supports it,
+// so lookups on a hot shard no longer queue up behind each other.
+template <typename M>
+using ReadGuard = conditional_t<is_shared_lockable<M>::value, shared_lock<M>, lock_guard<M>>;
+
+// The locks WriteGuard (Exclusive) and ReadGuard take, for shards that
+// are locked first and adopted by a guard once found to be the right ones.
+template <bool Exclusive, typename M>
+using Guard = conditional_t<Exclusive, WriteGuard<M>, ReadGuard<M>>;
+
+template <bool Exclusive, typename M>
+void Lock(M& m)
+{
+  if constexpr (Exclusive || !is_shared_lockable<M>::value) {
+    m.lock();
+  } else {
+    m.lock_shared();
+  }
+}
+
+template <bool Exclusive, typename M>
+bool TryLock(M& m)
+{
+  if constexpr (Exclusive || !is_shared_lockable<M>::value) {
+    return m.try_lock();
+  } else {
+    return m.try_lock_shared();
+  }
+}
+
+template <bool Exclusive, typename M>
+void Unlock(M& m)
+{
+  if constexpr (Exclusive || !is_shared_lockable<M>::value) {
+    m.unlock();
+  } else {
+    m.unlock_shared();
+  }
+}
+
+// Reader-biased shared mutex. Readers only touch one of kSlots
+// cache-line-padded counters chosen by thread id, so they do not bounce
+// a single reader count between cores the way shared_mutex does.
+// Writers announce themselves and wait for every slot to drain, which
+// makes them more expensive: use it for read-mostly shards only.
+class ReaderBiasedMutex {
+public:
+  static constexpr size_t kSlots = 16;
+
+  void lock()
+  {
+    writer_mutex_.lock();
+    writer_.store(true);
+    for (auto& slot : slots_) {
+      while (slot.readers.load() != 0) {
+        this_thread::yield();
+      }
+    }
+  }
+
+  bool try_lock()
+  {
+    if (!writer_mutex_.try_lock()) {
+      return false;
+    }
+    writer_.store(true);
+    for (auto& slot : slots_) {
+      if (slot.readers.load() != 0) {
+        unlock();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void unlock()
+  {
+    writer_.store(false);
+    writer_mutex_.unlock();
+  }
+
+  void lock_shared()
+  {
+    auto& slot = slots_[SlotIndex()];
+    for (;;) {
+      slot.readers.fetch_add(1);
+      if (!writer_.load()) {
+        return;
+      }
+      // back off so the writer can drain the slots
+      slot.readers.fetch_sub(1);
+      while (writer_.load()) {
+        this_thread::yield();
+      }
+    }
+  }
+
+  bool try_lock_shared()
+  {
+    auto& slot = slots_[SlotIndex()];
+    slot.readers.fetch_add(1);
+    if (!writer_.load()) {
+      return true;
+    }
+    slot.readers.fetch_sub(1);
+    return false;
+  }
+
+  void unlock_shared()
+  {
+    slots_[SlotIndex()].readers.fetch_sub(1);
+  }
+
+private:
+  struct alignas(kCacheLineSize) Slot {
+    atomic<int> readers{0};
+  };
+
+  Slot slots_[kSlots];
+  atomic<bool> writer_{false};
+  mutex writer_mutex_;
+
+  static size_t SlotIndex()
+  {
+    static thread_local const size_t index = hash<thread::id>{}(this_thread::get_id()) % kSlots;
+    return index;
+  }
+};
+
+// Sequence counter of one shard for optimistic reads. Writers, already
+// holding the shard lock exclusively, make it odd for the duration of
+// the write; readers copy what they need without locking and keep the
+// copy only if the counter was even and unchanged around it. Readers
+// never write shared memory, so they do not bounce cache lines.
+class SeqLock {
+public:
+  // Open while a WriteAccess holds the shard lock. A null lock makes it
+  // a no-op, for maps without optimistic reads.
+  class WriteWindow {
+  public:
+    explicit WriteWindow(SeqLock* lock) :
+    lock_(lock)
+    {
+      if (lock_ != nullptr) {
+        lock_->seq_.store(lock_->seq_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+      }
+    }
+
+    ~WriteWindow()
+    {
+      if (lock_ != nullptr) {
+        lock_->seq_.store(lock_->seq_.load(memory_order_relaxed) + 1, memory_order_release);
+      }
+    }
+
+    WriteWindow(const WriteWindow&) = delete;
+    WriteWindow& operator=(const WriteWindow&) = delete;
+
+  private:
+    SeqLock* lock_;
+  };
+
+  // Returns read() if it ran without a concurrent writer. After
+  // kMaxAttempts failed tries it gives up on optimism and returns
+  // locked_read(), which has to take the shard lock, so readers cannot
+  // be starved by a stream of writers.
+  template <typename Read, typename LockedRead>
+  auto ReadOptimistic(Read read, LockedRead locked_read) const
+  {
+    for (int attempt = 0; attempt < kMaxAttempts; attempt++) {
+      const uint64_t before = seq_.load(memory_order_acquire);
+      if (before & 1) {
+        CpuRelax();
+        continue;
+      }
+
+      auto result = read();
+      atomic_thread_fence(memory_order_acquire);
+      if (seq_.load(memory_order_relaxed) == before) {
+        return result;
+      }
+    }
+    return locked_read();
+  }
+
+  // Even while no write window is open; changes with every window, so
+  // a copy taken at one version is current as long as it is unchanged.
+  uint64_t Version() const { return seq_.load(memory_order_acquire); }
+
+private:
+  static constexpr int kMaxAttempts = 64;
+
+  atomic<uint64_t> seq_{0};
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Sharding policies of a ConcurrentMap: how many shards (and pooled
+// mutexes) it has and how a key hash picks a shard and a shard picks a
+// mutex. The one2one variant ignores the mutex count.
+
+// Counts chosen at construction, indexes taken modulo the counts.
+class RuntimeSharding {
+public:
+  static constexpr bool kFixed = false;
+
+  RuntimeSharding(size_t shard_count, size_t mutex_count) :
+  shards_(shard_count),
+  mutexes_(mutex_count)
+  {}
+
+  size_t Shards() const { return shards_; }
+  size_t Mutexes() const { return mutexes_; }
+
+  size_t ShardOf(size_t hash) const { return hash % shards_; }
+  size_t MutexOf(size_t shard) const { return shard % mutexes_; }
+
+private:
+  size_t shards_;
+  size_t mutexes_;
+};
+
+// Counts fixed at compile time as powers of two. A shard is picked by the
+// top bits of the hash multiplied by 2^64 / phi (Fibonacci hashing), which
+// spreads identity hashes of integers and leaves the low bits, which
+// FlatMap uses inside the shard, independent of the shard. Loops over all
+// shards get a constant trip count.
+template <size_t ShardCount, size_t MutexCount = ShardCount>
+class FixedSharding {
+  static_assert(ShardCount > 0 && (ShardCount & (ShardCount - 1)) == 0,
+                "FixedSharding: ShardCount must be a power of two");
+  static_assert(MutexCount > 0 && (MutexCount & (MutexCount - 1)) == 0,
+                "FixedSharding: MutexCount must be a power of two");
+
+public:
+  static constexpr bool kFixed = true;
+
+  static constexpr size_t Shards() { return ShardCount; }
+  static constexpr size_t Mutexes() { return MutexCount; }
+
+  static constexpr size_t ShardOf(size_t hash)
+  {
+    if constexpr (ShardCount == 1) {
+      return 0;
+    } else {
+      const uint64_t product = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+      return static_cast<size_t>(product >> (64 - kShardBits));
+    }
+  }
+
+  static constexpr size_t MutexOf(size_t shard) { return shard & (MutexCount - 1); }
+
+private:
+  static constexpr int Log2(size_t n) { return n <= 1 ? 0 : 1 + Log2(n / 2); }
+
+  static constexpr int kShardBits = Log2(ShardCount);
+};
+
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "flat_map.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Shard map of SnapshotStorage: a handle to the current version of a Map,
+// which snapshots pin. Const access reads the current version in place;
+// mutable access first copies it while a snapshot pins it, so a snapshot
+// never sees a later write and costs nothing once dropped.
+//
+// Share() and mutable access must not race, which the shard lock ensures:
+// snapshots share under the lock taken shared, writers hold it
+// exclusively. Offers the subset of the unordered_map interface the
+// shards use.
+template <typename Map>
+class CowMap {
+public:
+  using map_type = Map;
+  using key_type = typename Map::key_type;
+  using mapped_type = typename Map::mapped_type;
+  using value_type = typename Map::value_type;
+  using iterator = typename Map::iterator;
+  using const_iterator = typename Map::const_iterator;
+
+  CowMap() : version_(make_shared<Version>()) {}
+
+  CowMap(CowMap&&) noexcept = default;
+  CowMap& operator=(CowMap&&) noexcept = default;
+
+  // The current version, pinned for as long as the result lives.
+  shared_ptr<const Map> Share() const
+  {
+    version_->pins.fetch_add(1, memory_order_relaxed);
+    return shared_ptr<const Map>(&version_->map, Unpin{version_});
+  }
+
+  mapped_type& operator[](const key_type& key) { return Mutable()[key]; }
+
+  const mapped_type& at(const key_type& key) const { return version_->map.at(key); }
+  mapped_type& at(const key_type& key) { return Mutable().at(key); }
+
+  iterator find(const key_type& key) { return Mutable().find(key); }
+  const_iterator find(const key_type& key) const { return as_const(version_->map).find(key); }
+
+  size_t count(const key_type& key) const { return version_->map.count(key); }
+  size_t size() const { return version_->map.size(); }
+  bool empty() const { return version_->map.empty(); }
+
+  void reserve(size_t count) { Mutable().reserve(count); }
+
+  size_t erase(const key_type& key) { return Mutable().erase(key); }
+
+  template <typename M = Map>
+  auto prefetch(const key_type& key) const -> decltype(declval<const M&>().prefetch(key))
+  {
+    version_->map.prefetch(key);
+  }
+
+  iterator begin() { return Mutable().begin(); }
+  iterator end() { return Mutable().end(); }
+  const_iterator begin() const { return as_const(version_->map).begin(); }
+  const_iterator end() const { return as_const(version_->map).end(); }
+
+private:
+  struct Version {
+    Version() = default;
+    explicit Version(const Map& m) : map(m) {}
+
+    Map map;
+    // snapshots holding this version
+    mutable atomic<size_t> pins{0};
+  };
+
+  // Deleter of shared versions: keeps the version alive and unpins it. The
+  // release pairs with the acquire in Mutable(), so the reads of a dropped
+  // snapshot happen before writes into the version.
+  struct Unpin {
+    void operator()(const Map*) const { version->pins.fetch_sub(1, memory_order_release); }
+
+    shared_ptr<Version> version;
+  };
+
+  Map& Mutable()
+  {
+    if (version_->pins.load(memory_order_acquire) != 0) {
+      version_ = make_shared<Version>(version_->map);
+    }
+    return version_->map;
+  }
+
+  shared_ptr<Version> version_;
+};
+
+// Storage policy giving every shard a CowMap over the map of Base
+// (NodeStorage or FlatStorage) and enabling ConcurrentMap::Snapshot().
+template <typename Base = NodeStorage>
+struct SnapshotStorage {
+  static_assert(!Base::kOptimisticReads,
+                "SnapshotStorage: lock-free readers would race with the copies on write");
+
+  template <typename K, typename V, typename Hash>
+  using Map = CowMap<typename Base::template Map<K, V, Hash>>;
+
+  static constexpr bool kOptimisticReads = false;
+  static constexpr bool kSnapshots = true;
+};
+
+// Point-in-time view of a ConcurrentMap returned by its Snapshot(): the
+// shard versions current at one instant, routed to with the sharding of
+// that instant. Immutable, so it is read without any locking and may be
+// shared between threads; the versions are released with the last copy.
+template <typename K, typename V, typename Hash, typename ShardMap, typename Sharding>
+class MapSnapshot {
+public:
+  using MapType = unordered_map<K, V, Hash>;
+  using Map = typename ShardMap::map_type;
+
+  MapSnapshot(const Sharding& sharding, const Hash& hasher, vector<shared_ptr<const Map>> shards) :
+  sharding_(sharding),
+  hasher_(hasher),
+  shards_(move(shards))
+  {}
+
+  optional<V> Get(const K& key) const
+  {
+    const Map& mp = ShardOf(key);
+    const auto it = mp.find(key);
+    return it != mp.end() ? optional<V>(it->second) : nullopt;
+  }
+
+  // Throws out_of_range when key is missing.
+  const V& At(const K& key) const { return ShardOf(key).at(key); }
+
+  bool Has(const K& key) const { return ShardOf(key).count(key) != 0; }
+
+  size_t Size() const
+  {
+    size_t size = 0;
+    for (const auto& shard : shards_) {
+      size += shard->size();
+    }
+    return size;
+  }
+
+  template <typename Fn>
+  void ForEachShard(Fn fn) const
+  {
+    for (const auto& shard : shards_) {
+      fn(*shard);
+    }
+  }
+
+  template <typename Fn>
+  void ForEach(Fn fn) const
+  {
+    for (const auto& shard : shards_) {
+      for (const auto& [key, value] : *shard) {
+        fn(key, value);
+      }
+    }
+  }
+
+  MapType BuildOrdinaryMap() const
+  {
+    MapType result;
+    result.reserve(Size());
+    for (const auto& shard : shards_) {
+      result.insert(shard->begin(), shard->end());
+    }
+    return result;
+  }
+
+private:
+  const Map& ShardOf(const K& key) const
+  {
+    return *shards_[sharding_.ShardOf(hasher_(key))];
+  }
+
+  Sharding sharding_;
+  Hash hasher_;
+  vector<shared_ptr<const Map>> shards_;
+};
+
+}
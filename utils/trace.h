@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace cmap_common
+{
+
+enum class TraceOp : uint8_t {
+  Write = 0,
+  Read = 1,
+  Has = 2,
+};
+
+inline const char* TraceOpName(TraceOp op)
+{
+  switch (op) {
+    case TraceOp::Write: return "write";
+    case TraceOp::Read: return "read";
+    case TraceOp::Has: return "has";
+  }
+  return "?";
+}
+
+// One traced access: which mutex handled which map, when, on which thread
+// (the tracer's slot of it, reused once the thread is gone). Written to
+// trace files as is, in host byte order.
+struct TraceRecord {
+  uint64_t timestamp_ns;
+  uint32_t map_id;
+  uint32_t mutex_id;
+  uint32_t thread_id;
+  TraceOp op;
+  uint8_t reserved[3];
+};
+
+static_assert(sizeof(TraceRecord) == 24, "TraceRecord: unexpected padding");
+
+// trace files start with this, then hold TraceRecords up to the end
+inline constexpr char kTraceMagic[8] = {'C', 'M', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// Single-producer single-consumer ring of one thread's records. The
+// producer never waits: a record finding the ring full is dropped and
+// counted.
+class TraceRing {
+public:
+  static constexpr size_t kCapacity = 1 << 14;
+
+  explicit TraceRing(uint32_t thread_id) : thread_id_(thread_id) {}
+
+  uint32_t ThreadId() const { return thread_id_; }
+
+  void Push(const TraceRecord& record)
+  {
+    const size_t head = head_.load(memory_order_relaxed);
+    if (head - tail_.load(memory_order_acquire) == kCapacity) {
+      dropped_.store(dropped_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+      return;
+    }
+    records_[head & (kCapacity - 1)] = record;
+    head_.store(head + 1, memory_order_release);
+  }
+
+  // Hands the records pushed so far to fn, oldest first; consumer only.
+  template <typename Fn>
+  void Drain(Fn fn)
+  {
+    size_t tail = tail_.load(memory_order_relaxed);
+    const size_t head = head_.load(memory_order_acquire);
+    for (; tail != head; tail++) {
+      fn(records_[tail & (kCapacity - 1)]);
+    }
+    tail_.store(tail, memory_order_release);
+  }
+
+  uint64_t Dropped() const { return dropped_.load(memory_order_relaxed); }
+
+private:
+  const uint32_t thread_id_;
+  TraceRecord records_[kCapacity];
+  alignas(64) atomic<size_t> head_{0};
+  alignas(64) atomic<size_t> tail_{0};
+  atomic<uint64_t> dropped_{0};
+};
+
+// Tracer of the mutex-to-map assignments of cmap_o2m and cmap_dyn maps
+// built with log_flag. Recording costs a clock read and a store into the
+// calling thread's ring; a background thread drains the rings every
+// millisecond into the sink:
+//  - a binary trace file, once Open()ed or named by the environment
+//    variable CMAP_TRACE_FILE, for trace_decoder to turn into text;
+//  - else cout, one text line per record as the maps used to print.
+class Tracer {
+public:
+  static constexpr auto kDrainPeriod = chrono::milliseconds(1);
+
+  static Tracer& Instance()
+  {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  void Record(TraceOp op, size_t map_id, size_t mutex_id)
+  {
+    TraceRecord record = {};
+    record.timestamp_ns = chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+    record.map_id = static_cast<uint32_t>(map_id);
+    record.mutex_id = static_cast<uint32_t>(mutex_id);
+    TraceRing& ring = Local();
+    record.thread_id = ring.ThreadId();
+    record.op = op;
+    ring.Push(record);
+  }
+
+  // Drains what was recorded so far, then writes the trace to path
+  // instead. Throws runtime_error when path cannot be written.
+  void Open(const string& path)
+  {
+    lock_guard<mutex> guard(mutex_);
+    DrainLocked();
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file) {
+      throw runtime_error("Tracer: cannot open " + path);
+    }
+    file.write(kTraceMagic, sizeof(kTraceMagic));
+    file_ = move(file);
+  }
+
+  // Drains what was recorded so far and goes back to text on cout.
+  void Close()
+  {
+    lock_guard<mutex> guard(mutex_);
+    DrainLocked();
+    file_.close();
+  }
+
+  // Writes out everything recorded before the call.
+  void Flush()
+  {
+    lock_guard<mutex> guard(mutex_);
+    DrainLocked();
+  }
+
+  // records lost to full rings
+  uint64_t Dropped() const
+  {
+    lock_guard<mutex> guard(mutex_);
+    uint64_t dropped = 0;
+    for (const auto& ring : rings_) {
+      dropped += ring->Dropped();
+    }
+    return dropped;
+  }
+
+private:
+  // Gives the thread a ring until it exits, then hands the ring back
+  // for the next new thread: rings are only ever added, so short-lived
+  // threads do not pile them up.
+  class LocalHandle {
+  public:
+    explicit LocalHandle(Tracer& tracer) :
+    tracer_(tracer),
+    ring_(tracer.Acquire())
+    {}
+
+    ~LocalHandle() { tracer_.Release(ring_); }
+
+    TraceRing& ring_ref() { return *ring_; }
+
+  private:
+    Tracer& tracer_;
+    TraceRing* ring_;
+  };
+
+  Tracer()
+  {
+    if (const char* path = getenv("CMAP_TRACE_FILE")) {
+      try {
+        Open(path);
+      } catch (const runtime_error& e) {
+        cerr << e.what() << ", tracing to cout" << endl;
+      }
+    }
+    drainer_ = thread([this] { DrainLoop(); });
+  }
+
+  ~Tracer()
+  {
+    {
+      lock_guard<mutex> guard(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    drainer_.join();
+    lock_guard<mutex> guard(mutex_);
+    DrainLocked();
+  }
+
+  TraceRing& Local()
+  {
+    thread_local LocalHandle handle(*this);
+    return handle.ring_ref();
+  }
+
+  TraceRing* Acquire()
+  {
+    lock_guard<mutex> guard(mutex_);
+    if (!free_.empty()) {
+      TraceRing* ring = free_.back();
+      free_.pop_back();
+      return ring;
+    }
+    rings_.push_back(make_unique<TraceRing>(static_cast<uint32_t>(rings_.size())));
+    return rings_.back().get();
+  }
+
+  void Release(TraceRing* ring)
+  {
+    lock_guard<mutex> guard(mutex_);
+    free_.push_back(ring);
+  }
+
+  void DrainLoop()
+  {
+    unique_lock<mutex> lock(mutex_);
+    while (!stop_) {
+      wake_.wait_for(lock, kDrainPeriod);
+      DrainLocked();
+    }
+  }
+
+  void DrainLocked()
+  {
+    for (auto& ring : rings_) {
+      ring->Drain([this](const TraceRecord& record) {
+        if (file_.is_open()) {
+          file_.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        } else {
+          cout << "Hello, I am mutex " << record.mutex_id
+               << " and I am handling map" << record.map_id << "\n";
+        }
+      });
+    }
+    if (file_.is_open()) {
+      file_.flush();
+    } else {
+      cout.flush();
+    }
+  }
+
+  // guards everything below; rings are only ever added
+  mutable mutex mutex_;
+  condition_variable wake_;
+  bool stop_ = false;
+  ofstream file_;
+  vector<unique_ptr<TraceRing>> rings_;
+  vector<TraceRing*> free_;
+  thread drainer_;
+};
+
+// Reads a trace file Tracer wrote, records sorted by time. Throws
+// runtime_error when in does not hold a trace.
+inline vector<TraceRecord> ReadTrace(istream& in)
+{
+  char magic[sizeof(kTraceMagic)];
+  if (!in.read(magic, sizeof(magic)) || memcmp(magic, kTraceMagic, sizeof(magic)) != 0) {
+    throw runtime_error("ReadTrace: not a trace file");
+  }
+
+  vector<TraceRecord> records;
+  TraceRecord record;
+  while (in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+    records.push_back(record);
+  }
+  if (in.gcount() != 0) {
+    throw runtime_error("ReadTrace: truncated record");
+  }
+  stable_sort(records.begin(), records.end(), [](const TraceRecord& lhs, const TraceRecord& rhs) {
+    return lhs.timestamp_ns < rhs.timestamp_ns;
+  });
+  return records;
+}
+
+// Writes records as text, one line each, times relative to the first.
+inline void DecodeTrace(const vector<TraceRecord>& records, ostream& out)
+{
+  const uint64_t start = records.empty() ? 0 : records.front().timestamp_ns;
+  for (const TraceRecord& r : records) {
+    out << r.timestamp_ns - start << " ns"
+        << " thread " << r.thread_id
+        << " " << TraceOpName(r.op)
+        << " map " << r.map_id
+        << " mutex " << r.mutex_id << "\n";
+  }
+}
+
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Executor of ConcurrentMap::ParallelForEach: runs each submitted task on
+// a thread of its own through std::async. Any type with the same two
+// members, e.g. a wrapper around a thread pool, can stand in for it.
+class AsyncExecutor {
+public:
+  explicit AsyncExecutor(size_t workers = thread::hardware_concurrency()) :
+  workers_(max<size_t>(workers, 1))
+  {}
+
+  // tasks ParallelForEach submits at most
+  size_t Workers() const { return workers_; }
+
+  future<void> Submit(function<void()> task) const
+  {
+    return async(launch::async, move(task));
+  }
+
+private:
+  size_t workers_;
+};
+
+// Calls visit(i) for every i in [0, count) on up to executor.Workers()
+// tasks, which claim indexes from a shared counter so that slow shards
+// do not hold up the others. Returns once every task finished and
+// rethrows the first exception a task threw.
+template <typename Executor, typename Visit>
+void ParallelForIndexes(const Executor& executor, size_t count, Visit visit)
+{
+  atomic<size_t> next{0};
+  auto worker = [&] {
+    for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+      visit(i);
+    }
+  };
+
+  vector<future<void>> futures;
+  try {
+    for (size_t i = 0; i < min(executor.Workers(), count); i++) {
+      futures.push_back(executor.Submit(worker));
+    }
+  } catch (...) {
+    for (auto& f : futures) {
+      f.wait();
+    }
+    throw;
+  }
+
+  exception_ptr error;
+  for (auto& f : futures) {
+    try {
+      f.get();
+    } catch (...) {
+      if (!error) {
+        error = current_exception();
+      }
+    }
+  }
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+// Moves the entries of shards, which hold disjoint keys, into one
+// MapType reserved for all of them at once. Shards that are MapTypes
+// themselves are spliced node by node, so no entry is copied; the
+// entries of other shard maps are moved over one by one.
+template <typename MapType, typename ShardMap>
+MapType MergeShards(vector<ShardMap>& shards)
+{
+  size_t total = 0;
+  for (const auto& shard : shards) {
+    total += shard.size();
+  }
+
+  MapType result;
+  result.reserve(total);
+  for (auto& shard : shards) {
+    if constexpr (is_same_v<ShardMap, MapType>) {
+      result.merge(shard);
+    } else {
+      for (auto& entry : shard) {
+        result.emplace(entry.first, move(entry.second));
+      }
+    }
+  }
+  return result;
+}
+
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#if !defined(__cpp_lib_atomic_wait) && defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "shard_lock.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Wait strategies for the atomic flags of cmap_dyn. A waiter first spins
+// kSpins times with a CPU pause, then backs off exponentially for
+// kBackoffRounds rounds (2, 4, 8, ... pauses) and finally, if kPark is
+// set, parks until the flag changes, so an oversubscribed machine spends
+// its cores on the lock holders instead of on the waiters.
+struct SpinThenPark {
+  static constexpr int kSpins = 64;
+  static constexpr int kBackoffRounds = 10;
+  static constexpr bool kPark = true;
+};
+
+// Never sleeps: pauses, backs off, then keeps yielding. Lowest handover
+// latency while threads do not outnumber cores.
+struct BusySpin {
+  static constexpr int kSpins = 64;
+  static constexpr int kBackoffRounds = 10;
+  static constexpr bool kPark = false;
+};
+
+// Threads parked on the flags of one map, counted per bucket of flag
+// addresses like a futex hash table. Releasers only pay for a wake-up
+// when someone may be parked on their flag; collisions merely cost a
+// wake-up nobody needed.
+class ParkingLot {
+public:
+  ParkingLot() = default;
+
+  // a map is only moved before it is shared, nobody can be parked
+  ParkingLot(ParkingLot&&) noexcept {}
+  ParkingLot& operator=(ParkingLot&&) noexcept { return *this; }
+
+  // Sleeps while word still holds observed. May return spuriously.
+  void Park(const atomic<int>& word, int observed) const
+  {
+    atomic<int>& parked = ParkedOn(word);
+    parked.fetch_add(1);
+    if (word.load() == observed) {
+#if defined(__cpp_lib_atomic_wait)
+      word.wait(observed);
+#elif defined(__linux__)
+      syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, observed, nullptr, nullptr, 0);
+#else
+      this_thread::sleep_for(chrono::microseconds(50));
+#endif
+    }
+    parked.fetch_sub(1);
+  }
+
+  // Call after changing word.
+  void WakeAll(atomic<int>& word) const
+  {
+    if (ParkedOn(word).load() == 0) {
+      return;
+    }
+#if defined(__cpp_lib_atomic_wait)
+    word.notify_all();
+#elif defined(__linux__)
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+  }
+
+  static constexpr size_t kBuckets = 16;
+
+  // Flags sit at the same offset of cache-line aligned shards and pool
+  // entries, so the bucket is picked by the bits above the line offset.
+  static size_t BucketOf(const atomic<int>& word)
+  {
+    return (reinterpret_cast<uintptr_t>(&word) / kCacheLineSize) % kBuckets;
+  }
+
+private:
+  atomic<int>& ParkedOn(const atomic<int>& word) const
+  {
+    return parked_[BucketOf(word)];
+  }
+
+  mutable atomic<int> parked_[kBuckets] = {};
+};
+
+// Per-acquisition waiting state, advanced once per failed attempt.
+template <typename Strategy>
+class Backoff {
+public:
+  void Wait(const atomic<int>& word, int observed, const ParkingLot& lot)
+  {
+    if (round_ < Strategy::kSpins) {
+      CpuRelax();
+    } else if (round_ < Strategy::kSpins + Strategy::kBackoffRounds) {
+      for (int i = 0; i < 2 << (round_ - Strategy::kSpins); i++) {
+        CpuRelax();
+      }
+    } else if (Strategy::kPark) {
+      lot.Park(word, observed);
+      return;
+    } else {
+      this_thread::yield();
+      return;
+    }
+    round_++;
+  }
+
+private:
+  int round_ = 0;
+};
+
+}
@@ -0,0 +1,577 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "persist.h"
+#include "shard_lock.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// How long a write waits for its write-ahead log record.
+enum class WalDurability {
+  // not at all: the log thread commits every max_delay, and a crash loses
+  // the writes of the last interval
+  Async,
+  // until the record is written to the file: survives a crash of the
+  // process, not of the machine; the file is synced every max_delay
+  Written,
+  // until the record is synced to disk: survives a power loss
+  Synced,
+};
+
+// Options of ConcurrentMap::EnableWal().
+struct WalOptions {
+  WalDurability durability = WalDurability::Synced;
+  // longest time records wait for a commit, or written records for a
+  // sync, when no writer waits for them
+  chrono::microseconds max_delay{1000};
+  // append buffers, each with a lock of its own; the records of one key
+  // always go to the same lane
+  size_t lanes = 16;
+};
+
+enum class WalOp : uint8_t {
+  Put = 1,
+  Erase = 2,
+};
+
+// CRC-32 (IEEE 802.3), guarding log records against torn writes.
+inline uint32_t Crc32(const char* data, size_t size)
+{
+  static const array<uint32_t, 256> table = [] {
+    array<uint32_t, 256> t{};
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; bit++) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
+
+// Append-only log of the writes to a map, committed in groups. Writers
+// append their records to one of several lanes, picked by the hash of the
+// key, each under its own lock, so writers of different keys seldom meet;
+// appended under the shard lock, the records of one key keep the order
+// of the writes. A log thread swaps every lane's buffer for an empty one,
+// writes what it collected with a single write() and syncs the file with
+// one fdatasync(): the group commit. A writer that waits for its record
+// wakes the log thread, and every writer that appended meanwhile rides
+// along with the same sync. With nothing appended and nothing left to
+// sync the log thread sleeps until the next append.
+//
+// Every append returns a ticket, the number of the commit that will take
+// the record at the latest; Wait(ticket) blocks as long as the durability
+// level asks for. A record is its payload size and the CRC-32 of the
+// payload, both uint32_t, then the payload: the WalOp, the key and, for
+// a Put, the value, encoded by SnapshotCodec. A failed write or sync
+// fails the log: its waiters return, and Put, Erase and Sync throw the
+// error from then on.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class WriteAheadLog {
+public:
+  using Key = K;
+  using Value = V;
+
+  // Maps name Put and Erase whatever their types, but only open logs of
+  // types SnapshotCodec encodes.
+  static constexpr bool kLoggable = has_snapshot_codec<K>::value && has_snapshot_codec<V>::value;
+
+  // Calls replay(op, key, value) for every record the log at path holds,
+  // value nullopt for erasures, then opens it for appending, creating it
+  // when missing. Replay stops at the first torn or corrupt record, left
+  // by a crash in the middle of a write, and the log is cut off there.
+  // Throws runtime_error when the file cannot be read or opened.
+  template <typename Replay>
+  WriteAheadLog(const string& path, WalOptions options, Replay replay) :
+  path_(path),
+  options_(options),
+  lane_count_(max<size_t>(options.lanes, 1)),
+  lanes_(make_unique<Lane[]>(lane_count_)),
+  spare_(lane_count_)
+  {
+    static_assert(kLoggable, "WriteAheadLog: no encoding for K or V, specialize cmap_common::SnapshotCodec");
+    const uint64_t valid = ReplayFile(path, replay);
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      throw runtime_error("WriteAheadLog: cannot open " + path + ": " + strerror(errno));
+    }
+    struct stat status;
+    if (::fstat(fd_, &status) == 0 && S_ISREG(status.st_mode) && static_cast<uint64_t>(status.st_size) > valid &&
+        ::ftruncate(fd_, static_cast<off_t>(valid)) != 0) {
+      ::close(fd_);
+      throw runtime_error("WriteAheadLog: cannot truncate " + path + ": " + strerror(errno));
+    }
+    thread_ = thread([this] { Run(); });
+  }
+
+  // Commits what is left; no writer may be appending any more.
+  ~WriteAheadLog()
+  {
+    {
+      lock_guard<mutex> guard(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+    ::close(fd_);
+  }
+
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  // Appends a record; call it under the lock that orders the writes of
+  // key, and Wait for the returned ticket once that lock is released.
+  // Throws the error of a failed log.
+  uint64_t Put(const K& key, const V& value)
+  {
+    return Append(WalOp::Put, key, &value);
+  }
+
+  uint64_t Erase(const K& key)
+  {
+    return Append(WalOp::Erase, key, nullptr);
+  }
+
+  // Returns once the record of ticket is as durable as the options ask,
+  // or the log failed; it never throws, so it can run in destructors.
+  void Wait(uint64_t ticket)
+  {
+    switch (options_.durability) {
+      case WalDurability::Async: return;
+      case WalDurability::Written: WaitFor(written_, ticket); return;
+      case WalDurability::Synced: WaitFor(synced_, ticket); return;
+    }
+  }
+
+  // Returns once everything appended so far is synced, whatever the
+  // durability level. Throws the error of a failed log.
+  void Sync()
+  {
+    WaitFor(synced_, epoch_.load(memory_order_acquire));
+    ThrowIfFailed();
+  }
+
+  // Fails the log with error, unless it failed already; for appends that
+  // cannot throw, such as those of destructors.
+  void Fail(exception_ptr error)
+  {
+    {
+      lock_guard<mutex> guard(mutex_);
+      if (!error_) {
+        error_ = error;
+      }
+      failed_.store(true, memory_order_release);
+    }
+    committed_.notify_all();
+  }
+
+  // Commits that wrote anything; writes per commit tell how well the
+  // writers were grouped.
+  uint64_t Commits() const
+  {
+    return commits_.load(memory_order_relaxed);
+  }
+
+private:
+  struct alignas(kCacheLineSize) Lane {
+    mutex lock;
+    string records;
+  };
+
+  static constexpr size_t kRecordHeader = 2 * sizeof(uint32_t);
+
+  uint64_t Append(WalOp op, const K& key, const V* value)
+  {
+    if constexpr (!kLoggable) {
+      return 0;
+    } else {
+      return AppendRecord(op, key, value);
+    }
+  }
+
+  uint64_t AppendRecord(WalOp op, const K& key, const V* value)
+  {
+    ThrowIfFailed();
+    Lane& lane = lanes_[hasher_(key) % lane_count_];
+    uint64_t ticket;
+    {
+      lock_guard<mutex> guard(lane.lock);
+      string& out = lane.records;
+      const size_t start = out.size();
+      try {
+        out.append(kRecordHeader, '\0');
+        out.push_back(static_cast<char>(op));
+        SnapshotCodec<K>::Encode(key, out);
+        if (value != nullptr) {
+          SnapshotCodec<V>::Encode(*value, out);
+        }
+      } catch (...) {
+        // no half record for the log thread to write
+        out.resize(start);
+        throw;
+      }
+      const uint32_t size = static_cast<uint32_t>(out.size() - start - kRecordHeader);
+      const uint32_t crc = Crc32(out.data() + start + kRecordHeader, size);
+      memcpy(&out[start], &size, sizeof(size));
+      memcpy(&out[start + sizeof(size)], &crc, sizeof(crc));
+      // read under the lane lock: a commit that took the epoch already may
+      // still find the record, one that comes later surely does
+      ticket = epoch_.load(memory_order_acquire);
+    }
+    // a sleeping log thread checked the lanes after it set idle_, so it
+    // either saw the record or this sees idle_ set
+    if (idle_.load() && idle_.exchange(false)) {
+      lock_guard<mutex> guard(mutex_);
+      wake_.notify_one();
+    }
+    return ticket;
+  }
+
+  void ThrowIfFailed()
+  {
+    if (failed_.load(memory_order_acquire)) {
+      lock_guard<mutex> guard(mutex_);
+      rethrow_exception(error_);
+    }
+  }
+
+  void WaitFor(const atomic<uint64_t>& done, uint64_t ticket)
+  {
+    if (done.load(memory_order_acquire) >= ticket) {
+      return;
+    }
+    unique_lock<mutex> lock(mutex_);
+    uint64_t& requested = &done == &synced_ ? sync_requested_ : write_requested_;
+    if (requested < ticket) {
+      requested = ticket;
+      wake_.notify_one();
+    }
+    committed_.wait(lock, [&] {
+      return done.load(memory_order_acquire) >= ticket || failed_.load(memory_order_relaxed);
+    });
+  }
+
+  void Run()
+  {
+    unique_lock<mutex> lock(mutex_);
+    auto last_sync = chrono::steady_clock::now();
+    // the last commit wrote nothing and left nothing to sync
+    bool idle = false;
+    for (;;) {
+      if (failed_.load(memory_order_relaxed)) {
+        // the requests never come true now, only stop_ is worth waking for
+        wake_.wait(lock, [&] { return stop_; });
+        return;
+      }
+      auto requested = [&] {
+        return stop_ || write_requested_ > written_.load(memory_order_relaxed) ||
+               sync_requested_ > synced_.load(memory_order_relaxed);
+      };
+      if (idle) {
+        idle_.store(true);
+        if (LanesEmpty()) {
+          wake_.wait(lock, [&] { return requested() || !idle_.load(memory_order_relaxed); });
+        }
+        idle_.store(false);
+      } else {
+        wake_.wait_for(lock, options_.max_delay, requested);
+      }
+      const bool stop = stop_;
+      // below Synced only waiters of Sync() and the clock ask for syncs
+      const auto now = chrono::steady_clock::now();
+      const bool sync = stop || options_.durability == WalDurability::Synced ||
+                        sync_requested_ > synced_.load(memory_order_relaxed) ||
+                        now - last_sync >= options_.max_delay;
+      lock.unlock();
+      bool wrote = false;
+      if (!failed_.load(memory_order_acquire)) {
+        try {
+          wrote = Commit(sync);
+        } catch (...) {
+          Fail(current_exception());
+        }
+      }
+      idle = !wrote && !unsynced_;
+      if (sync) {
+        last_sync = now;
+      }
+      lock.lock();
+      if (stop) {
+        return;
+      }
+    }
+  }
+
+  bool LanesEmpty()
+  {
+    for (size_t i = 0; i < lane_count_; i++) {
+      lock_guard<mutex> guard(lanes_[i].lock);
+      if (!lanes_[i].records.empty()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // One group commit; runs on the log thread only. Returns whether it
+  // wrote anything, throws runtime_error on I/O errors.
+  bool Commit(bool sync)
+  {
+    const uint64_t batch = epoch_.fetch_add(1, memory_order_acq_rel);
+    batch_.clear();
+    for (size_t i = 0; i < lane_count_; i++) {
+      {
+        lock_guard<mutex> guard(lanes_[i].lock);
+        lanes_[i].records.swap(spare_[i]);
+      }
+      batch_.append(spare_[i]);
+      spare_[i].clear();
+    }
+
+    if (!batch_.empty()) {
+      WriteAll();
+      unsynced_ = true;
+      commits_.fetch_add(1, memory_order_relaxed);
+    }
+    Publish(written_, batch);
+    if (sync) {
+      if (unsynced_) {
+        if (::fdatasync(fd_) != 0) {
+          throw runtime_error("WriteAheadLog: cannot sync " + path_ + ": " + strerror(errno));
+        }
+        unsynced_ = false;
+      }
+      Publish(synced_, batch);
+    }
+    return !batch_.empty();
+  }
+
+  void WriteAll()
+  {
+    const char* data = batch_.data();
+    size_t size = batch_.size();
+    while (size > 0) {
+      const ssize_t written = ::write(fd_, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw runtime_error("WriteAheadLog: cannot write " + path_ + ": " + strerror(errno));
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+    }
+  }
+
+  void Publish(atomic<uint64_t>& done, uint64_t batch)
+  {
+    {
+      lock_guard<mutex> guard(mutex_);
+      done.store(batch, memory_order_release);
+    }
+    committed_.notify_all();
+  }
+
+  // Replays the records of path and returns the size of its intact
+  // prefix; a missing file is empty.
+  template <typename Replay>
+  static uint64_t ReplayFile(const string& path, Replay& replay)
+  {
+    string data;
+    {
+      detail::FileDescriptor file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+      if (file.get() < 0) {
+        if (errno == ENOENT) {
+          return 0;
+        }
+        throw runtime_error("WriteAheadLog: cannot open " + path + ": " + strerror(errno));
+      }
+      struct stat status;
+      if (::fstat(file.get(), &status) != 0) {
+        throw runtime_error("WriteAheadLog: cannot stat " + path + ": " + strerror(errno));
+      }
+      data.resize(static_cast<size_t>(status.st_size));
+      size_t done = 0;
+      while (done < data.size()) {
+        const ssize_t read = ::read(file.get(), &data[done], data.size() - done);
+        if (read < 0 && errno == EINTR) {
+          continue;
+        }
+        if (read < 0) {
+          throw runtime_error("WriteAheadLog: cannot read " + path + ": " + strerror(errno));
+        }
+        if (read == 0) {
+          break;
+        }
+        done += static_cast<size_t>(read);
+      }
+      data.resize(done);
+    }
+
+    const char* in = data.data();
+    const char* const end = in + data.size();
+    while (static_cast<size_t>(end - in) >= kRecordHeader) {
+      uint32_t size;
+      uint32_t crc;
+      memcpy(&size, in, sizeof(size));
+      memcpy(&crc, in + sizeof(size), sizeof(crc));
+      const char* payload = in + kRecordHeader;
+      if (size < 1 || size > static_cast<size_t>(end - payload) || Crc32(payload, size) != crc) {
+        break;
+      }
+      const char* const record_end = payload + size;
+      const WalOp op = static_cast<WalOp>(*payload++);
+      if (op != WalOp::Put && op != WalOp::Erase) {
+        break;
+      }
+      optional<K> key;
+      optional<V> value;
+      try {
+        key.emplace(SnapshotCodec<K>::Decode(payload, record_end));
+        if (op == WalOp::Put) {
+          value.emplace(SnapshotCodec<V>::Decode(payload, record_end));
+        }
+      } catch (const runtime_error&) {
+        break;
+      }
+      if (payload != record_end) {
+        break;
+      }
+      replay(op, move(*key), move(value));
+      in = record_end;
+    }
+    return static_cast<uint64_t>(in - data.data());
+  }
+
+  const string path_;
+  const WalOptions options_;
+  Hash hasher_;
+  const size_t lane_count_;
+  unique_ptr<Lane[]> lanes_;
+  int fd_ = -1;
+
+  // number of the commit that takes records appended now
+  alignas(kCacheLineSize) atomic<uint64_t> epoch_{1};
+  // the last commit written, and the last synced
+  alignas(kCacheLineSize) atomic<uint64_t> written_{0};
+  atomic<uint64_t> synced_{0};
+  atomic<uint64_t> commits_{0};
+
+  // set while the log thread sleeps for want of records
+  alignas(kCacheLineSize) atomic<bool> idle_{false};
+  atomic<bool> failed_{false};
+
+  // guards the requests, stop_ and error_; waiters sleep on it
+  mutex mutex_;
+  condition_variable wake_;
+  condition_variable committed_;
+  uint64_t write_requested_ = 0;
+  uint64_t sync_requested_ = 0;
+  bool stop_ = false;
+  exception_ptr error_;
+
+  // the log thread's own
+  vector<string> spare_;
+  string batch_;
+  bool unsynced_ = false;
+  thread thread_;
+};
+
+// Waits for the log records handed to it when it goes out of scope.
+// Declared ahead of a lock guard, it waits once the lock is released, so
+// a group commit never holds up the other writers of the shard. Tickets
+// grow with every commit, so waiting for the last one covers the rest.
+template <typename Log>
+class WalWait {
+public:
+  explicit WalWait(Log* log) : log_(log) {}
+
+  ~WalWait()
+  {
+    if (ticket_ != 0) {
+      log_->Wait(ticket_);
+    }
+  }
+
+  WalWait(const WalWait&) = delete;
+  WalWait& operator=(const WalWait&) = delete;
+
+  void Hand(uint64_t ticket)
+  {
+    ticket_ = max(ticket_, ticket);
+  }
+
+private:
+  Log* log_;
+  uint64_t ticket_ = 0;
+};
+
+// Logs a Put of key with the value it ends up with when it goes out of
+// scope. Declared after a lock guard, it logs while the lock is held.
+template <typename Log>
+class WalPutOnExit {
+public:
+  WalPutOnExit(Log* log, const typename Log::Key& key, const typename Log::Value& value, WalWait<Log>& wait) :
+  log_(log),
+  value_(value),
+  wait_(wait)
+  {
+    if (log_ != nullptr) {
+      key_.emplace(key);
+    }
+  }
+
+  // an append that fails fails the log, whose next Put or Sync throws
+  ~WalPutOnExit()
+  {
+    if (log_ != nullptr) {
+      try {
+        wait_.Hand(log_->Put(*key_, value_));
+      } catch (...) {
+        log_->Fail(current_exception());
+      }
+    }
+  }
+
+  WalPutOnExit(const WalPutOnExit&) = delete;
+  WalPutOnExit& operator=(const WalPutOnExit&) = delete;
+
+private:
+  Log* log_;
+  optional<typename Log::Key> key_;
+  const typename Log::Value& value_;
+  WalWait<Log>& wait_;
+};
+
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hot_keys.h"
+
+using namespace std;
+
+namespace cmap_common
+{
+
+// Options of ConcurrentMap::EnableWriteCombining().
+struct WriteCombining {
+  // distinct keys pending in a thread's buffer that make the thread flush
+  // it
+  size_t max_keys = 256;
+  // age of the oldest pending delta that makes the thread flush its
+  // buffer, checked every WriteCombiner::kClockEvery additions
+  chrono::microseconds max_delay{1000};
+};
+
+// Whether deltas of V can be summed with +=.
+template <typename V, typename = void>
+struct is_combinable : false_type {};
+
+template <typename V>
+struct is_combinable<V, void_t<decltype(declval<V&>() += declval<const V&>())>> : true_type {};
+
+// Thread-local buffers of the deltas added to the keys of one map. Every
+// thread sums its deltas per key in a buffer of its own and applies them
+// to the map in one batch, which takes every shard lock once per batch
+// instead of once per addition. Only commutative additions can be
+// combined this way: the map sees them in a different order and later
+// than they were made.
+//
+// A thread flushes its buffer when it holds max_keys keys, when its
+// oldest delta is older than max_delay, or on Flush(), which flushes the
+// buffers of every thread. Reads through Read() see the flushed state
+// plus the calling thread's own pending deltas; deltas pending in other
+// threads stay invisible until flushed. Buffers of exited threads are
+// kept for the next Flush(), and whatever is pending when the combiner is
+// destroyed is lost.
+//
+// The owner takes its buffer's mutex for every addition, uncontended but
+// for the flushes of other threads, so it never leaves the owner's cache.
+template <typename K, typename V, typename Hash>
+class WriteCombiner {
+public:
+  using Deltas = unordered_map<K, V, Hash>;
+
+  static constexpr size_t kClockEvery = 64;
+
+  explicit WriteCombiner(WriteCombining options) :
+  options_(options),
+  id_(NextMapId())
+  {}
+
+  WriteCombiner(const WriteCombiner&) = delete;
+  WriteCombiner& operator=(const WriteCombiner&) = delete;
+
+  // Adds delta to key in the calling thread's buffer. Flushes the buffer
+  // through apply(deltas), which must add every delta to the map, when
+  // a threshold is reached.
+  template <typename Apply>
+  void Add(const K& key, V delta, Apply apply)
+  {
+    Buffer& buffer = Local();
+    lock_guard<mutex> guard(buffer.lock);
+    if (buffer.deltas.empty()) {
+      buffer.oldest = chrono::steady_clock::now();
+    }
+    buffer.deltas[key] += delta;
+    if (buffer.deltas.size() >= options_.max_keys ||
+        (++buffer.adds % kClockEvery == 0 &&
+         chrono::steady_clock::now() - buffer.oldest >= options_.max_delay)) {
+      FlushLocked(buffer, apply);
+    }
+  }
+
+  // read() plus the delta the calling thread has pending for key; a key
+  // only the pending delta knows of reads as V() plus the delta.
+  template <typename ReadFlushed>
+  optional<V> Read(const K& key, ReadFlushed read)
+  {
+    Buffer& buffer = Local();
+    // held across read() so a concurrent Flush() cannot count the delta
+    // in both places or in neither
+    lock_guard<mutex> guard(buffer.lock);
+    optional<V> value = read();
+    const auto it = buffer.deltas.find(key);
+    if (it != buffer.deltas.end()) {
+      if (!value) {
+        value.emplace();
+      }
+      *value += it->second;
+    }
+    return value;
+  }
+
+  // Applies the pending deltas of every thread through apply(deltas);
+  // additions that complete before the call are in the map afterwards.
+  template <typename Apply>
+  void Flush(Apply apply)
+  {
+    lock_guard<mutex> guard(registry_mutex_);
+    for (size_t i = 0; i < buffers_.size();) {
+      {
+        lock_guard<mutex> buffer_guard(buffers_[i]->lock);
+        FlushLocked(*buffers_[i], apply);
+      }
+      // only the registry still holds the buffer of an exited thread
+      if (buffers_[i].use_count() == 1) {
+        buffers_[i] = move(buffers_.back());
+        buffers_.pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+
+  // Keys pending in the calling thread's buffer.
+  size_t Pending()
+  {
+    Buffer& buffer = Local();
+    lock_guard<mutex> guard(buffer.lock);
+    return buffer.deltas.size();
+  }
+
+private:
+  struct Buffer {
+    mutex lock;
+    Deltas deltas;
+    chrono::steady_clock::time_point oldest;
+    size_t adds = 0;
+  };
+
+  // The buffers of the calling thread, by combiner id; ids are never
+  // reused, so a buffer cannot outlive its combiner into a new one.
+  struct LocalBuffers {
+    unordered_map<uint64_t, shared_ptr<Buffer>> by_id;
+    uint64_t last_id = 0;
+    Buffer* last = nullptr;
+  };
+
+  template <typename Apply>
+  static void FlushLocked(Buffer& buffer, Apply& apply)
+  {
+    if (buffer.deltas.empty()) {
+      return;
+    }
+    apply(static_cast<const Deltas&>(buffer.deltas));
+    buffer.deltas.clear();
+  }
+
+  Buffer& Local()
+  {
+    thread_local LocalBuffers local;
+    if (local.last_id == id_) {
+      return *local.last;
+    }
+
+    auto found = local.by_id.find(id_);
+    if (found == local.by_id.end()) {
+      // drop the buffers of destroyed combiners, which no registry holds
+      for (auto it = local.by_id.begin(); it != local.by_id.end();) {
+        if (it->second.use_count() == 1) {
+          it = local.by_id.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      auto created = make_shared<Buffer>();
+      {
+        lock_guard<mutex> guard(registry_mutex_);
+        buffers_.push_back(created);
+      }
+      found = local.by_id.emplace(id_, move(created)).first;
+    }
+    local.last_id = id_;
+    local.last = found->second.get();
+    return *local.last;
+  }
+
+  const WriteCombining options_;
+  const uint64_t id_;
+
+  // every thread's buffer, for Flush()
+  mutex registry_mutex_;
+  vector<shared_ptr<Buffer>> buffers_;
+};
+
+}